@@ -0,0 +1,206 @@
+#include "vcl/vcl.hpp"
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include "Simulator.h"
+#include "Ensemble.h"
+#include "Domain_decomposition.h"
+
+/* Checks of the Simulator and of the headers built on it, run by ctest (target simulator_checks).
+*
+* The application does not use the Simulator yet, so this is the only place where these headers are compiled.
+* Every check prints one line; the exit code is the number of failed checks.
+*/
+
+int failures = 0;
+
+void check(bool ok, const std::string& what, double value) {
+	std::cout << (ok ? "ok     " : "FAILED ") << what << ": " << value << std::endl;
+	if (!ok)
+		failures++;
+}
+
+Mass_object body(float mass, vcl::vec3 position, vcl::vec3 speed, int level) {
+	Mass_object o = {};
+	o.mass = mass;
+	o.position = position;
+	o.axis = { 0, 0, 1 };
+	o.speed = speed;
+	o.attraction_level = level;
+	return o;
+}
+
+// A planet on a circular orbit of radius 1 around a sun of mass 1. planet_level below 2 makes it a one-sided pair
+Simulator two_body(integrator scheme, int planet_level) {
+	Simulator sim;
+	sim.set_integrator(scheme);
+	float m = 1e-3f;
+	float v = (float)std::sqrt(G * (1 + (planet_level == 2 ? m : 0)));
+	int sun = sim.add_object("Sun", body(1.0f, { 0, 0, 0 }, { 0, 0, 0 }, 2));
+	int planet = sim.add_object("Planet", body(m, { 1, 0, 0 }, { 0, v, 0 }, planet_level));
+	if (scheme == integrator::HIERARCHICAL)
+		sim.set_parent(planet, sun);
+	return sim;
+}
+
+// Random cloud of n objects in a unit cube, at rest
+Simulator cloud(int n, unsigned seed) {
+	Simulator sim;
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+	for (int i = 0; i < n; i++) {
+		vcl::vec3 p = { u(rng), u(rng), u(rng) };
+		vcl::vec3 v = { 0.1f * u(rng), 0.1f * u(rng), 0.1f * u(rng) };
+		sim.add_object("o" + std::to_string(i), body(1.0f / n, p, v, 1));
+	}
+	sim.set_barnes_hut_threshold(0);
+	return sim;
+}
+
+// Largest relative difference between the speed changes of a and b over the step, relative to the mean change
+double speed_change_error(Simulator& a, Simulator& b, const std::vector<vcl::vec3>& initial) {
+	const std::vector<int>& handles = a.get_handles();
+	double error = 0, scale = 0;
+	for (size_t k = 0; k < handles.size(); k++) {
+		vcl::vec3 da = a.get_speed(handles[k]) - initial[k];
+		vcl::vec3 db = b.get_speed(handles[k]) - initial[k];
+		error = std::max(error, (double)vcl::norm(da - db));
+		scale += vcl::norm(db);
+	}
+	return error / (scale / handles.size());
+}
+
+// Energy drift over 10 orbits (user-003/004/010/014)
+void check_two_body_drift() {
+	struct Case { integrator scheme; std::string name; };
+	std::vector<Case> cases = {
+		{ integrator::LEAPFROG, "LEAPFROG" },
+		{ integrator::YOSHIDA4, "YOSHIDA4" },
+		{ integrator::WISDOM_HOLMAN, "WISDOM_HOLMAN" },
+		{ integrator::BLOCK_LEAPFROG, "BLOCK_LEAPFROG" },
+		{ integrator::HIERARCHICAL, "HIERARCHICAL" }
+	};
+
+	for (const Case& c : cases) {
+		for (int planet_level : { 2, 1 }) {
+			Simulator sim = two_body(c.scheme, planet_level);
+			sim.evaluate_energy();
+			sim.simulate(20 * 3.1416, 0.01);
+			double drift = sim.evaluate_energy().max_drift;
+			check(std::abs(drift) < 1e-3, "two-body energy drift, " + c.name + (planet_level == 2 ? "" : ", one-sided"), drift);
+		}
+	}
+}
+
+// The number of threads must not change the result (user-006)
+void check_threads() {
+	struct Case { force_method method; std::string name; };
+	std::vector<Case> cases = {
+		{ force_method::DIRECT, "DIRECT" },
+		{ force_method::BARNES_HUT, "BARNES_HUT" },
+		{ force_method::FMM, "FMM" },
+		{ force_method::PARTICLE_MESH, "PARTICLE_MESH" }
+	};
+
+	for (const Case& c : cases) {
+		Simulator one = cloud(1000, 1), many = cloud(1000, 1);
+		for (Simulator* sim : { &one, &many }) {
+			sim->set_force_method(c.method);
+			sim->set_mesh_size(16);
+		}
+		many.set_threads(4);
+		one.simulate(0.05, 0.01);
+		many.simulate(0.05, 0.01);
+
+		double difference = 0;
+		for (int h : one.get_handles())
+			difference = std::max(difference, (double)vcl::norm(one.get_position(h) - many.get_position(h)));
+		check(difference == 0, "1 vs 4 threads, " + c.name, difference);
+	}
+}
+
+// The approximate force methods against the exact sum, over one step (user-001/005/008/016)
+void check_force_methods() {
+	struct Case { force_method method; std::string name; double tolerance; };
+	std::vector<Case> cases = {
+		{ force_method::DIRECT_SIMD, "DIRECT_SIMD", 1e-3 },
+		{ force_method::BARNES_HUT, "BARNES_HUT", 5e-2 },
+		{ force_method::FMM, "FMM", 5e-2 },
+		{ force_method::PARTICLE_MESH, "PARTICLE_MESH", 1e-1 }
+	};
+
+	Simulator direct = cloud(1000, 2);
+	std::vector<vcl::vec3> initial;
+	for (int h : direct.get_handles())
+		initial.push_back(direct.get_speed(h));
+	direct.simulate(0.01);
+
+	for (const Case& c : cases) {
+		Simulator sim = cloud(1000, 2);
+		sim.set_force_method(c.method);
+		sim.set_mesh_size(16); // Larger meshes sum 1000 objects directly
+		sim.simulate(0.01);
+		double error = speed_change_error(sim, direct, initial);
+		check(error < c.tolerance, c.name + " vs DIRECT", error);
+	}
+
+	Simulator simd = cloud(1000, 2);
+	double error = simd.check_simd_kernel();
+	check(error < 1e-3, "SIMD kernel", error);
+}
+
+// The members of an ensemble of a one-sided two-body orbit keep their energy (user-011)
+void check_ensemble() {
+	Simulator sim = two_body(integrator::LEAPFROG, 1);
+	Ensemble ensemble(sim, 8);
+	ensemble.perturb(1e-4f, 1e-4f, 3);
+	ensemble.set_divergence_check(10, 1e-2);
+	ensemble.simulate(4 * 3.1416, 0.01);
+	check(ensemble.get_active_members() == 8, "ensemble members still active", ensemble.get_active_members());
+}
+
+// Two light objects that meet halfway through the step: the merged object is on the path of their barycenter (user-018)
+void check_merge() {
+	Simulator sim;
+	sim.set_collision_response(collision_response::MERGE);
+	int a = sim.add_object("a", body(3e-9f, { -1, 0, 0 }, { 1, 0.5f, 0 }, 1));
+	sim.add_object("b", body(1e-9f, { 1, 0, 0 }, { -1, 0, 0 }, 1));
+	sim.set_radius(a, 0.25f);
+	sim.set_radius(sim.find("b"), 0.25f);
+	sim.simulate(1.0);
+
+	vcl::vec3 expected = { 0, 0.375f, 0 }; // Barycenter at the end of the step
+	double error = sim.size() == 1 ? vcl::norm(sim.get_position(a) - expected) : 1.0;
+	check(error < 1e-5, "merged object on the barycenter path", error);
+}
+
+// A domain decomposition follows the Simulator it was made from
+void check_domain_decomposition() {
+#ifdef DOMAIN_DECOMPOSITION_AVAILABLE
+	Simulator reference = cloud(500, 4);
+	reference.set_force_method(force_method::BARNES_HUT);
+	Simulator copy = cloud(500, 4);
+
+	Domain_decomposition domains(copy, 2);
+	domains.simulate(0.05, 0.01);
+	reference.simulate(0.05, 0.01);
+
+	double difference = 0;
+	for (int h : reference.get_handles())
+		difference = std::max(difference, (double)vcl::norm(domains.get_position(h) - reference.get_position(h)));
+	check(difference < 1e-3, "domain decomposition vs BARNES_HUT", difference);
+#endif
+}
+
+int main() {
+	check_two_body_drift();
+	check_threads();
+	check_force_methods();
+	check_ensemble();
+	check_merge();
+	check_domain_decomposition();
+	return failures;
+}
@@ -0,0 +1,150 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+
+/* Compile-time diagnostics level of the Simulator
+*
+* 0: no diagnostics code at all (default in release builds, with NDEBUG)
+* 1: one record per energy evaluation (system energy drift). See Simulator::set_energy_interval
+* 2: one record per object and per energy evaluation
+*/
+#ifndef SIMULATOR_DIAGNOSTICS
+#ifdef NDEBUG
+#define SIMULATOR_DIAGNOSTICS 0
+#else
+#define SIMULATOR_DIAGNOSTICS 1
+#endif
+#endif
+
+
+enum class diagnostic_type {
+	STEP, // handle = -1, delta = timestep, energy_error = drift of the system energy (Energy_report::drift)
+	OBJECT, // delta = norm of the speed change over the last step, energy_error = change of the object's total_energy since the previous evaluation
+	MEMBER // Ensemble check: handle = member, delta = RMS distance to member 0, energy_error = energy drift of the member
+};
+
+struct Diagnostic_record {
+	diagnostic_type type;
+	long long step;
+	int handle;
+	double delta;
+	double energy_error;
+};
+
+
+/* Channel between the integrator and the outside world
+*
+* The Simulator pushes records into a preallocated single-producer single-consumer ring buffer: no lock, no allocation, no output in the step.
+* A background thread drains it into a file or a callback. When the buffer is full, records are dropped (and counted) rather than waiting.
+*/
+class Diagnostics {
+
+public:
+
+	// capacity is rounded up to a power of two
+	explicit Diagnostics(int capacity = 1 << 16) {
+		int c = 1;
+		while (c < capacity)
+			c *= 2;
+		records.resize(c);
+		mask = c - 1;
+	}
+
+	~Diagnostics() {
+		stop();
+	}
+
+	Diagnostics(const Diagnostics&) = delete;
+	void operator=(const Diagnostics&) = delete;
+
+	// Producer side. Returns false if the record was dropped
+	bool push(const Diagnostic_record& r) {
+		long long h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) > mask) {
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		records[h & mask] = r;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side. Only one thread may pop (the drain thread when there is one)
+	bool pop(Diagnostic_record& r) {
+		long long t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		r = records[t & mask];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Starts a background thread that calls f on every record
+	void drain_to_callback(std::function<void(const Diagnostic_record&)> f) {
+		if (drain.joinable())
+			throw std::logic_error("Diagnostics are already being drained.");
+		running = true;
+		drain = std::thread([this, f] {
+			Diagnostic_record r;
+			while (running.load()) {
+				while (pop(r))
+					f(r);
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			}
+			while (pop(r))
+				f(r);
+		});
+	}
+
+	// Starts a background thread that writes every record as a line of text
+	void drain_to_file(std::string path) {
+		auto file = std::make_shared<std::ofstream>(path);
+		if (!*file)
+			throw std::runtime_error("Cannot open diagnostics file " + path);
+		*file << "type step handle delta energy_error\n";
+		drain_to_callback([file](const Diagnostic_record& r) {
+			*file << type_name(r.type) << r.step << " " << r.handle << " " << r.delta << " " << r.energy_error << "\n";
+		});
+	}
+
+	// Stops the drain thread once the buffer is empty
+	void stop() {
+		running = false;
+		if (drain.joinable())
+			drain.join();
+	}
+
+	long long get_dropped() const { return dropped.load(); }
+
+	static const char* type_name(diagnostic_type t) {
+		switch (t) {
+		case diagnostic_type::STEP: return "step ";
+		case diagnostic_type::OBJECT: return "object ";
+		default: return "member ";
+		}
+	}
+
+private:
+
+	std::vector<Diagnostic_record> records;
+	long long mask;
+
+	std::atomic<long long> head{ 0 };
+	std::atomic<long long> tail{ 0 };
+	std::atomic<long long> dropped{ 0 };
+
+	std::atomic<bool> running{ false };
+	std::thread drain;
+};
+
+#endif // DIAGNOSTICS_H
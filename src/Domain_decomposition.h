@@ -0,0 +1,642 @@
+#ifndef DOMAIN_DECOMPOSITION_H
+#define DOMAIN_DECOMPOSITION_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "Simulator.h"
+#include "Octree.h"
+
+// Worker processes and POSIX shared memory: Linux only
+#ifdef __linux__
+#define DOMAIN_DECOMPOSITION_AVAILABLE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+
+/* The objects of a Simulator split between worker processes on the same host, for systems too large for one process
+*
+* The objects are sorted along a Morton curve and each worker owns a contiguous slice of it (a compact region of space).
+* Everything lives in one POSIX shared memory segment: the objects, and a summary of each domain (a few cells with their
+* bounding sphere and, per attraction level, their mass and center of mass). Every worker has its own heap and its own tree.
+*
+* At every step a worker kicks and drifts its objects and summarizes its domain. After a barrier it computes the forces on
+* its objects: the cells of the other domains that are far from all of its own cells (radii sum < theta distance) act
+* through their summary, the others are copied as ghosts into a local Barnes-Hut tree with its own objects. See Octree.h.
+* Integration is kick-drift-kick leapfrog, whatever the integrator of the Simulator.
+*
+* The coordinator is the process that creates the decomposition. Between commands it re-sorts the objects and moves the
+* slice boundaries so that every worker spends the same time in its force computation (measured at the previous command).
+*
+* Workers are fork()-ed from the coordinator: create the decomposition before starting other threads (Thread_pool, GUI),
+* and keep using the Simulator only through get_position / write_back until it is destroyed.
+*/
+
+const int domain_max_workers = 64;
+const int domain_max_levels = 8; // Distinct attraction levels
+const int domain_cells = 64; // Summary cells per domain
+
+// Barrier between processes, in shared memory
+struct Shared_barrier {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int count;
+	int waiting;
+	unsigned generation;
+
+	void init(int n) {
+		pthread_mutexattr_t ma;
+		pthread_mutexattr_init(&ma);
+		pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+		pthread_mutex_init(&mutex, &ma);
+		pthread_mutexattr_destroy(&ma);
+
+		pthread_condattr_t ca;
+		pthread_condattr_init(&ca);
+		pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+		pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+		pthread_cond_init(&cond, &ca);
+		pthread_condattr_destroy(&ca);
+
+		count = n;
+		waiting = 0;
+		generation = 0;
+	}
+
+	// alive is called every 100 ms while waiting: when it returns false, the wait is given up and false is returned
+	template <typename Alive>
+	bool wait(Alive alive) {
+		pthread_mutex_lock(&mutex);
+		unsigned g = generation;
+		if (++waiting == count) {
+			waiting = 0;
+			generation++;
+			pthread_cond_broadcast(&cond);
+			pthread_mutex_unlock(&mutex);
+			return true;
+		}
+
+		while (g == generation) {
+			timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_nsec += 100000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			if (pthread_cond_timedwait(&cond, &mutex, &deadline) == ETIMEDOUT && g == generation && !alive()) {
+				waiting--;
+				pthread_mutex_unlock(&mutex);
+				return false;
+			}
+		}
+		pthread_mutex_unlock(&mutex);
+		return true;
+	}
+};
+
+// Summary of a part of a domain
+struct Domain_cell {
+	vcl::vec3 center; // Of the bounding box
+	float radius; // Bounding sphere
+	int first, count; // Slots
+	float mass[domain_max_levels]; // What attracts an object of level index k
+	vcl::vec3 barycenter[domain_max_levels];
+};
+
+enum class domain_command { STEP, STOP };
+
+struct Domain_header {
+	int n;
+	int workers;
+	int n_levels;
+	int levels[domain_max_levels]; // Sorted
+	float theta;
+
+	domain_command command;
+	int steps;
+	double timestep;
+	int forces_valid;
+
+	int first[domain_max_workers + 1]; // Slice of each worker
+	int cell_count[domain_max_workers];
+	double force_time[domain_max_workers]; // Seconds spent in the forces during the last command
+	char error[256]; // Set by a worker before it stops on an exception
+
+	Shared_barrier start; // Coordinator and workers
+	Shared_barrier done;
+	Shared_barrier step; // Workers only
+};
+
+
+class Domain_decomposition {
+
+public:
+
+	// A copy of the objects of simulator split between workers processes
+	Domain_decomposition(const Simulator& simulator, int workers) {
+		if (workers < 1 || workers > domain_max_workers)
+			throw std::invalid_argument("The number of workers must be between 1 and " + std::to_string(domain_max_workers) + ".");
+
+		handles = simulator.get_handles();
+		n = (int)handles.size();
+		w = std::min(workers, std::max(1, n));
+
+		std::vector<int> levels;
+		for (int h : handles)
+			levels.push_back(simulator.get_object(h).attraction_level);
+		std::sort(levels.begin(), levels.end());
+		levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+		if ((int)levels.size() > domain_max_levels)
+			throw std::invalid_argument("Too many attraction levels for a domain decomposition.");
+
+		create_segment();
+
+		header->n = n;
+		header->workers = w;
+		header->n_levels = (int)levels.size();
+		std::copy(levels.begin(), levels.end(), header->levels);
+		header->theta = 0.5f;
+		header->forces_valid = 0;
+		header->error[0] = 0;
+		header->start.init(w + 1);
+		header->done.init(w + 1);
+		header->step.init(w);
+
+		slot_handle = handles;
+		for (int s = 0; s < n; s++) {
+			Mass_object o = simulator.get_object(handles[s]);
+			position[s] = o.position;
+			speed[s] = o.speed;
+			acceleration[s] = vcl::vec3();
+			mass[s] = o.mass;
+			level[s] = o.attraction_level;
+			similar[s] = o.attracts_similar;
+		}
+
+		// Equal slices until the first timing
+		cost.assign(n, 1.0);
+		rebalance();
+
+		coordinator = getpid();
+		for (int k = 0; k < w; k++) {
+			pid_t pid = fork();
+			if (pid < 0) {
+				stop_workers();
+				throw std::runtime_error("Could not start a domain worker.");
+			}
+			if (pid == 0)
+				run_worker(k);
+			pids.push_back(pid);
+		}
+	}
+
+	~Domain_decomposition() {
+		if (header && !pids.empty()) {
+			header->command = domain_command::STOP;
+			if (!header->start.wait([this] { return workers_alive(); }))
+				stop_workers();
+			for (pid_t pid : pids)
+				waitpid(pid, nullptr, 0);
+		}
+		if (header)
+			munmap(header, segment_size);
+	}
+
+	Domain_decomposition(const Domain_decomposition&) = delete;
+	void operator=(const Domain_decomposition&) = delete;
+
+	int get_workers() const { return w; }
+
+	vcl::vec3 get_position(int handle) const { return position[slot(handle)]; }
+	vcl::vec3 get_speed(int handle) const { return speed[slot(handle)]; }
+
+	// Number of objects of each worker, and its share of the force time at the last command (1 is perfect balance)
+	int get_domain_size(int worker) const { return header->first[worker + 1] - header->first[worker]; }
+	double get_load(int worker) const {
+		double total = 0;
+		for (int k = 0; k < w; k++)
+			total += header->force_time[k];
+		return total > 0 ? header->force_time[worker] * w / total : 1;
+	}
+
+	// Opening angle of the domain summaries and of the local trees
+	void set_opening_angle(float theta) { header->theta = theta; }
+
+	// The objects are re-sorted and the slices moved every interval steps (0: never)
+	void set_rebalance_interval(int interval) { rebalance_interval = std::max(0, interval); }
+
+	void simulate(double timestep) { run(timestep, 1); }
+
+	void simulate(double time, double timestep) {
+		int n_timesteps = (int)(time / timestep);
+
+		// Whole commands between rebalances
+		int batch = rebalance_interval > 0 ? rebalance_interval : std::max(1, n_timesteps);
+		for (int done = 0; done < n_timesteps; done += batch)
+			run(timestep, std::min(batch, n_timesteps - done));
+
+		double remaining = time - timestep * n_timesteps;
+		if (remaining > 0)
+			run(remaining, 1);
+	}
+
+	// Copies the positions and speeds back into the Simulator the decomposition was made from
+	void write_back(Simulator& simulator) const {
+		for (int s = 0; s < n; s++) {
+			simulator.set_position(slot_handle[s], position[s]);
+			simulator.set_speed(slot_handle[s], speed[s]);
+		}
+	}
+
+private:
+
+	int n = 0;
+	int w = 0;
+	std::vector<int> handles;
+	std::vector<int> slot_handle; // Handle of the object in each slot
+	std::vector<int> slot_of; // Slot of each handle, -1 if it was not in the Simulator
+	std::vector<double> cost; // Of each slot, seconds
+
+	int rebalance_interval = 16;
+	int steps_since_rebalance = 0;
+
+	pid_t coordinator = 0;
+	std::vector<pid_t> pids;
+
+	// Shared segment
+	size_t segment_size = 0;
+	Domain_header* header = nullptr;
+	vcl::vec3* position = nullptr;
+	vcl::vec3* speed = nullptr;
+	vcl::vec3* acceleration = nullptr;
+	float* mass = nullptr;
+	int* level = nullptr;
+	char* similar = nullptr;
+	Domain_cell* cells = nullptr; // domain_cells per worker
+
+	int slot(int handle) const {
+		if (handle < 0 || handle >= (int)slot_of.size() || slot_of[handle] == -1)
+			throw std::invalid_argument("Unknown handle.");
+		return slot_of[handle];
+	}
+
+	static size_t aligned(size_t bytes) { return (bytes + 63) / 64 * 64; }
+
+	// The name is removed as soon as the segment is mapped: the mapping is inherited by the workers, and nothing is left behind
+	void create_segment() {
+		size_t offsets[8];
+		size_t total = aligned(sizeof(Domain_header));
+		size_t sizes[7] = { sizeof(vcl::vec3), sizeof(vcl::vec3), sizeof(vcl::vec3), sizeof(float), sizeof(int), sizeof(char), 0 };
+		for (int a = 0; a < 6; a++) {
+			offsets[a] = total;
+			total += aligned(sizes[a] * std::max(1, n));
+		}
+		offsets[6] = total;
+		total += aligned(sizeof(Domain_cell) * domain_cells * domain_max_workers);
+
+		static int counter = 0;
+		std::string name = "/nbody_domains_" + std::to_string(getpid()) + "_" + std::to_string(counter++);
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0)
+			throw std::runtime_error("Could not create the shared memory segment " + name + ".");
+		if (ftruncate(fd, (off_t)total) != 0) {
+			close(fd);
+			shm_unlink(name.c_str());
+			throw std::runtime_error("Could not size the shared memory segment " + name + ".");
+		}
+		void* base = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		shm_unlink(name.c_str());
+		if (base == MAP_FAILED)
+			throw std::runtime_error("Could not map the shared memory segment " + name + ".");
+
+		segment_size = total;
+		char* b = static_cast<char*>(base);
+		header = reinterpret_cast<Domain_header*>(b);
+		position = reinterpret_cast<vcl::vec3*>(b + offsets[0]);
+		speed = reinterpret_cast<vcl::vec3*>(b + offsets[1]);
+		acceleration = reinterpret_cast<vcl::vec3*>(b + offsets[2]);
+		mass = reinterpret_cast<float*>(b + offsets[3]);
+		level = reinterpret_cast<int*>(b + offsets[4]);
+		similar = reinterpret_cast<char*>(b + offsets[5]);
+		cells = reinterpret_cast<Domain_cell*>(b + offsets[6]);
+	}
+
+	bool workers_alive() {
+		for (pid_t pid : pids) {
+			int status;
+			if (waitpid(pid, &status, WNOHANG) != 0)
+				return false;
+		}
+		return true;
+	}
+
+	void stop_workers() {
+		for (pid_t pid : pids)
+			kill(pid, SIGKILL);
+		for (pid_t pid : pids)
+			waitpid(pid, nullptr, 0);
+		pids.clear();
+	}
+
+	void run(double timestep, int steps) {
+		if (pids.empty())
+			throw std::runtime_error("The domain workers are stopped.");
+
+		header->command = domain_command::STEP;
+		header->timestep = timestep;
+		header->steps = steps;
+
+		auto alive = [this] { return workers_alive(); };
+		if (!header->start.wait(alive) || !header->done.wait(alive)) {
+			std::string message = header->error[0] ? header->error : "A domain worker stopped.";
+			stop_workers();
+			throw std::runtime_error(message);
+		}
+		header->forces_valid = 1;
+
+		// Cost of each object from the time of its worker
+		for (int k = 0; k < w; k++) {
+			int count = get_domain_size(k);
+			for (int s = header->first[k]; s < header->first[k + 1]; s++)
+				cost[s] = header->force_time[k] / std::max(1, count);
+		}
+
+		steps_since_rebalance += steps;
+		if (rebalance_interval > 0 && steps_since_rebalance >= rebalance_interval)
+			rebalance();
+	}
+
+	// Morton order of the current positions, and slices of equal cost. Accelerations follow their objects
+	void rebalance() {
+		steps_since_rebalance = 0;
+		if (n == 0) {
+			std::fill(header->first, header->first + w + 1, 0);
+			return;
+		}
+
+		vcl::vec3 low = position[0], high = position[0];
+		for (int s = 1; s < n; s++) {
+			for (int c = 0; c < 3; c++) {
+				low[c] = std::min(low[c], position[s][c]);
+				high[c] = std::max(high[c], position[s][c]);
+			}
+		}
+		float side = std::max(high.x - low.x, std::max(high.y - low.y, high.z - low.z));
+		float scale = side > 0 ? 2097151.0f / side : 0; // 21 bits per coordinate
+
+		std::vector<uint64_t> key(n);
+		for (int s = 0; s < n; s++) {
+			uint64_t k = 0;
+			for (int c = 0; c < 3; c++)
+				k |= spread(uint32_t((position[s][c] - low[c]) * scale)) << c;
+			key[s] = k;
+		}
+
+		std::vector<int> order(n);
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](int a, int b) { return key[a] < key[b]; });
+
+		permute(position, order);
+		permute(speed, order);
+		permute(acceleration, order);
+		permute(mass, order);
+		permute(level, order);
+		permute(similar, order);
+		permute(slot_handle.data(), order);
+		permute(cost.data(), order);
+
+		int max_handle = 0;
+		for (int h : slot_handle)
+			max_handle = std::max(max_handle, h + 1);
+		slot_of.assign(max_handle, -1);
+		for (int s = 0; s < n; s++)
+			slot_of[slot_handle[s]] = s;
+
+		// Cut the cumulated cost in w equal parts
+		double total = std::accumulate(cost.begin(), cost.end(), 0.0);
+		double sum = 0;
+		int k = 1;
+		header->first[0] = 0;
+		for (int s = 0; s < n && k < w; s++) {
+			sum += cost[s];
+			while (k < w && sum >= total * k / w)
+				header->first[k++] = s + 1;
+		}
+		while (k <= w)
+			header->first[k++] = n;
+	}
+
+	template <typename T>
+	void permute(T* a, const std::vector<int>& order) {
+		std::vector<T> copy(a, a + n);
+		for (int s = 0; s < n; s++)
+			a[s] = copy[order[s]];
+	}
+
+	// Bits of x 3 places apart
+	static uint64_t spread(uint32_t x) {
+		uint64_t v = x & 0x1fffff;
+		v = (v | v << 32) & 0x1f00000000ffffULL;
+		v = (v | v << 16) & 0x1f0000ff0000ffULL;
+		v = (v | v << 8) & 0x100f00f00f00f00fULL;
+		v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+		v = (v | v << 2) & 0x1249249249249249ULL;
+		return v;
+	}
+
+	// Worker process
+
+	struct Worker_state {
+		int k;
+		int first, end;
+		Octree tree;
+		std::vector<vcl::vec3> local_position; // Own objects, then ghosts
+		std::vector<float> local_mass;
+		std::vector<int> local_level;
+		std::vector<char> local_similar;
+		std::vector<int> far_cells;
+	};
+
+	void run_worker(int k) {
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		if (getppid() != coordinator)
+			_exit(1);
+
+		// Only the coordinator stops on a dead process: workers just wait for it (or are killed with it)
+		auto forever = [] { return true; };
+		Worker_state state;
+		state.k = k;
+
+		try {
+			for (;;) {
+				header->start.wait(forever);
+				if (header->command == domain_command::STOP)
+					_exit(0);
+
+				state.first = header->first[k];
+				state.end = header->first[k + 1];
+				state.tree.theta = header->theta;
+				timespec t0, t1;
+				double force_time = 0;
+
+				const double dt = header->timestep;
+				bool forces_valid = header->forces_valid != 0;
+
+				for (int step = 0; step < header->steps; step++) {
+					if (forces_valid) {
+						for (int s = state.first; s < state.end; s++) {
+							speed[s] += float(dt / 2) * acceleration[s];
+							position[s] += float(dt) * speed[s];
+						}
+					}
+					summarize(state);
+					header->step.wait(forever);
+
+					clock_gettime(CLOCK_MONOTONIC, &t0);
+					forces(state);
+					clock_gettime(CLOCK_MONOTONIC, &t1);
+					force_time += (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+
+					if (forces_valid) {
+						for (int s = state.first; s < state.end; s++)
+							speed[s] += float(dt / 2) * acceleration[s];
+					}
+					else {
+						forces_valid = true;
+						step--; // Forces of the initial state only
+					}
+
+					// Nobody moves before everybody is done reading
+					header->step.wait(forever);
+				}
+
+				header->force_time[k] = force_time;
+				header->done.wait(forever);
+			}
+		}
+		catch (const std::exception& e) {
+			std::strncpy(header->error, e.what(), sizeof(header->error) - 1);
+			_exit(1);
+		}
+	}
+
+	int level_index(int l) const {
+		return (int)(std::lower_bound(header->levels, header->levels + header->n_levels, l) - header->levels);
+	}
+
+	// Cells of equal counts along the slice: consecutive objects on the Morton curve are close to each other
+	void summarize(Worker_state& state) {
+		const int count = state.end - state.first;
+		const int n_cells = std::min(domain_cells, count);
+		Domain_cell* own = cells + (size_t)state.k * domain_cells;
+
+		for (int c = 0; c < n_cells; c++) {
+			Domain_cell& cell = own[c];
+			cell.first = state.first + (int)((long long)count * c / n_cells);
+			cell.count = state.first + (int)((long long)count * (c + 1) / n_cells) - cell.first;
+
+			vcl::vec3 low = position[cell.first], high = low;
+			for (int l = 0; l < header->n_levels; l++) {
+				cell.mass[l] = 0;
+				cell.barycenter[l] = vcl::vec3();
+			}
+
+			for (int s = cell.first; s < cell.first + cell.count; s++) {
+				for (int a = 0; a < 3; a++) {
+					low[a] = std::min(low[a], position[s][a]);
+					high[a] = std::max(high[a], position[s][a]);
+				}
+
+				// Attracts every lower level, and its own level if it attracts similar objects
+				int last = similar[s] ? level_index(level[s]) : level_index(level[s]) - 1;
+				for (int l = 0; l <= last; l++) {
+					cell.mass[l] += mass[s];
+					cell.barycenter[l] += mass[s] * position[s];
+				}
+			}
+
+			cell.center = 0.5f * (low + high);
+			cell.radius = 0.5f * vcl::norm(high - low);
+			for (int l = 0; l < header->n_levels; l++)
+				if (cell.mass[l] > 0)
+					cell.barycenter[l] /= cell.mass[l];
+		}
+		header->cell_count[state.k] = n_cells;
+	}
+
+	void forces(Worker_state& state) {
+		const int count = state.end - state.first;
+		const float theta = header->theta;
+		const Domain_cell* own = cells + (size_t)state.k * domain_cells;
+		const int own_cells = header->cell_count[state.k];
+
+		state.local_position.assign(position + state.first, position + state.end);
+		state.local_mass.assign(mass + state.first, mass + state.end);
+		state.local_level.assign(level + state.first, level + state.end);
+		state.local_similar.assign(similar + state.first, similar + state.end);
+		state.far_cells.clear();
+
+		// Remote cells far from all own cells act through their summary, the others are ghosts
+		for (int other = 0; other < w; other++) {
+			if (other == state.k)
+				continue;
+			const Domain_cell* remote = cells + (size_t)other * domain_cells;
+			for (int c = 0; c < header->cell_count[other]; c++) {
+				const Domain_cell& cell = remote[c];
+				bool far = true;
+				for (int o = 0; o < own_cells && far; o++)
+					far = own[o].radius + cell.radius < theta * vcl::norm(cell.center - own[o].center);
+
+				if (far) {
+					state.far_cells.push_back(other * domain_cells + c);
+				}
+				else {
+					state.local_position.insert(state.local_position.end(), position + cell.first, position + cell.first + cell.count);
+					state.local_mass.insert(state.local_mass.end(), mass + cell.first, mass + cell.first + cell.count);
+					state.local_level.insert(state.local_level.end(), level + cell.first, level + cell.first + cell.count);
+					state.local_similar.insert(state.local_similar.end(), similar + cell.first, similar + cell.first + cell.count);
+				}
+			}
+		}
+
+		state.tree.build(state.local_position.data(), state.local_mass.data(), state.local_level.data(), state.local_similar.data(), (int)state.local_position.size());
+
+		for (int i = 0; i < count; i++) {
+			double potential;
+			vcl::vec3 field = state.tree.field_at(i, potential);
+
+			const vcl::vec3 p = state.local_position[i];
+			const int l = level_index(state.local_level[i]);
+			for (int id : state.far_cells) {
+				const Domain_cell& cell = cells[id];
+				if (cell.mass[l] == 0)
+					continue;
+				vcl::vec3 d = cell.barycenter[l] - p;
+				float r2 = vcl::dot(d, d);
+				field += cell.mass[l] / (r2 * std::sqrt(r2)) * d;
+			}
+
+			acceleration[state.first + i] = float(G) * field;
+		}
+	}
+};
+
+#endif // __linux__
+
+#endif // DOMAIN_DECOMPOSITION_H
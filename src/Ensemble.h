@@ -0,0 +1,463 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <memory>
+#include <random>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+#include "Simulator.h"
+#include "Gravity_kernel.h"
+#include "Thread_pool.h"
+#include "Diagnostics.h"
+
+
+/* K perturbed copies ("members") of the objects of a Simulator, advanced together
+*
+* Members are grouped in blocks of ensemble_lanes. Inside a block the data is interleaved (AoSoA): for each object and each coordinate,
+* the values of the members follow each other, so one SIMD register holds one coordinate of one object in ensemble_lanes universes.
+* The attraction rule depends on the objects only, so every lane goes through the same interaction list and no lane is ever masked.
+*
+* Member 0 is the unperturbed system. Members are integrated with kick-drift-kick leapfrog and exact pairwise forces.
+* Every check_interval steps each member's energy drift is measured: members above max_drift (or with non-finite values) are stopped,
+* and a block whose members are all stopped is skipped.
+*/
+
+const int ensemble_lanes = 8; // One AVX2 register of floats
+
+// Field on every object of one block. position and field hold [object][coordinate][lane], sources[i] the objects attracting object i
+typedef void (*ensemble_field_fn)(const float* position, const float* mass, const std::vector<int>* const* sources, int begin, int end, float* field);
+
+
+inline void ensemble_field_scalar(const float* position, const float* mass, const std::vector<int>* const* sources, int begin, int end, float* field) {
+	const int L = ensemble_lanes;
+	for (int i = begin; i < end; i++) {
+		const float* pi = position + i * 3 * L;
+		float* fi = field + i * 3 * L;
+		for (int c = 0; c < 3 * L; c++)
+			fi[c] = 0;
+
+		for (int j : *sources[i]) {
+			if (j == i)
+				continue;
+			const float* pj = position + j * 3 * L;
+			for (int l = 0; l < L; l++) {
+				float dx = pj[l] - pi[l], dy = pj[L + l] - pi[L + l], dz = pj[2 * L + l] - pi[2 * L + l];
+				float r2 = dx * dx + dy * dy + dz * dz;
+				float ri = 1.0f / std::sqrt(r2);
+				float f = mass[j] * ri * ri * ri;
+				fi[l] += f * dx;
+				fi[L + l] += f * dy;
+				fi[2 * L + l] += f * dz;
+			}
+		}
+	}
+}
+
+#ifdef GRAVITY_KERNEL_X86
+
+GRAVITY_TARGET("avx2,fma")
+inline void ensemble_field_avx2(const float* position, const float* mass, const std::vector<int>* const* sources, int begin, int end, float* field) {
+	const int L = ensemble_lanes;
+	const __m256 one = _mm256_set1_ps(1.0f);
+	for (int i = begin; i < end; i++) {
+		const float* pi = position + i * 3 * L;
+		const __m256 px = _mm256_loadu_ps(pi), py = _mm256_loadu_ps(pi + L), pz = _mm256_loadu_ps(pi + 2 * L);
+		__m256 ax = _mm256_setzero_ps(), ay = ax, az = ax;
+
+		for (int j : *sources[i]) {
+			if (j == i)
+				continue;
+			const float* pj = position + j * 3 * L;
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(pj), px);
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(pj + L), py);
+			__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(pj + 2 * L), pz);
+			__m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+			__m256 ri = _mm256_div_ps(one, _mm256_sqrt_ps(r2));
+			__m256 f = _mm256_mul_ps(_mm256_set1_ps(mass[j]), _mm256_mul_ps(ri, _mm256_mul_ps(ri, ri)));
+			ax = _mm256_fmadd_ps(f, dx, ax);
+			ay = _mm256_fmadd_ps(f, dy, ay);
+			az = _mm256_fmadd_ps(f, dz, az);
+		}
+
+		float* fi = field + i * 3 * L;
+		_mm256_storeu_ps(fi, ax);
+		_mm256_storeu_ps(fi + L, ay);
+		_mm256_storeu_ps(fi + 2 * L, az);
+	}
+}
+
+#endif // GRAVITY_KERNEL_X86
+
+inline ensemble_field_fn get_ensemble_kernel(simd_level level) {
+#ifdef GRAVITY_KERNEL_X86
+	if (level >= simd_level::AVX2 && detect_simd_level() >= simd_level::AVX2)
+		return ensemble_field_avx2;
+#else
+	(void)level;
+#endif
+	return ensemble_field_scalar;
+}
+
+
+class Ensemble {
+
+public:
+
+	// members copies of the current state of simulator, all identical until perturb is called
+	Ensemble(const Simulator& simulator, int members) {
+		if (members < 1)
+			throw std::invalid_argument("An ensemble needs at least one member.");
+
+		handles = simulator.get_handles();
+		n = (int)handles.size();
+		k = members;
+		n_blocks = (k + ensemble_lanes - 1) / ensemble_lanes;
+
+		int max_handle = 0;
+		for (int h : handles)
+			max_handle = std::max(max_handle, h + 1);
+		object_of.assign(max_handle, -1);
+
+		mass.resize(n);
+		level.resize(n);
+		similar.resize(n);
+		position.assign(block_floats() * n_blocks, 0.0f);
+		speed.assign(block_floats() * n_blocks, 0.0f);
+		acceleration.assign(block_floats() * n_blocks, 0.0f);
+
+		for (int i = 0; i < n; i++) {
+			Mass_object o = simulator.get_object(handles[i]);
+			object_of[handles[i]] = i;
+			mass[i] = o.mass;
+			level[i] = o.attraction_level;
+			similar[i] = o.attracts_similar;
+			for (int m = 0; m < k; m++) {
+				set(position, m, i, o.position);
+				set(speed, m, i, o.speed);
+			}
+		}
+
+		// Unused lanes of the last block are stopped from the start
+		stopped_at.assign(n_blocks * ensemble_lanes, -1);
+		for (int m = k; m < n_blocks * ensemble_lanes; m++)
+			stopped_at[m] = 0;
+		block_active.assign(n_blocks, 1);
+		drift.assign(k, 0.0);
+
+		build_sources();
+		kernel = get_ensemble_kernel(detect_simd_level());
+	}
+
+	int size() const { return k; }
+
+	// Adds gaussian noise of the given standard deviations to every coordinate of every member but member 0
+	void perturb(float position_sigma, float speed_sigma, unsigned seed) {
+		std::mt19937 rng(seed);
+		std::normal_distribution<float> dp(0.0f, position_sigma), dv(0.0f, speed_sigma);
+		for (int m = 1; m < k; m++) {
+			for (int i = 0; i < n; i++) {
+				set(position, m, i, get(position, m, i) + vcl::vec3(dp(rng), dp(rng), dp(rng)));
+				set(speed, m, i, get(speed, m, i) + vcl::vec3(dv(rng), dv(rng), dv(rng)));
+			}
+		}
+		forces_valid = false;
+		reference_valid = false;
+	}
+
+	// Explicit initial conditions for one object of one member
+	void set_state(int member, int handle, vcl::vec3 p, vcl::vec3 v) {
+		set(position, check(member), object(handle), p);
+		set(speed, member, object(handle), v);
+		forces_valid = false;
+		reference_valid = false;
+	}
+
+	vcl::vec3 get_position(int member, int handle) const { return get(position, check(member), object(handle)); }
+	vcl::vec3 get_speed(int member, int handle) const { return get(speed, check(member), object(handle)); }
+
+	// Step at which the member was stopped, -1 if it is still running
+	long long get_stop_step(int member) const { return stopped_at[check(member)]; }
+	bool is_active(int member) const { return get_stop_step(member) == -1; }
+
+	int get_active_members() const {
+		int a = 0;
+		for (int m = 0; m < k; m++)
+			a += is_active(m);
+		return a;
+	}
+
+	// Relative energy drift of the member at the last check, and RMS distance of its objects to those of member 0
+	double get_drift(int member) const { return drift[check(member)]; }
+	double get_separation(int member) const {
+		check(member);
+		double s = 0;
+		for (int i = 0; i < n; i++) {
+			vcl::vec3 d = get(position, member, i) - get(position, 0, i);
+			s += vcl::dot(d, d);
+		}
+		return n > 0 ? std::sqrt(s / n) : 0;
+	}
+
+	// Every interval steps (0: never), members whose energy drift exceeds max_drift are stopped
+	void set_divergence_check(int interval, double max_drift_) {
+		check_interval = std::max(0, interval);
+		max_drift = max_drift_;
+	}
+
+	void set_threads(int t) {
+		t = std::max(1, t);
+		pool.reset(t > 1 ? new Thread_pool(t) : nullptr);
+	}
+
+	// One MEMBER record per member at every check. See Diagnostics.h
+	void set_diagnostics(Diagnostics* d) { diagnostics = d; }
+
+	void set_simd_level(simd_level s) { kernel = get_ensemble_kernel(s); }
+
+	void simulate(double timestep) {
+		if (!reference_valid)
+			measure_energy(reference);
+		reference_valid = true;
+
+		if (!forces_valid)
+			compute_forces();
+
+		kick(timestep / 2);
+		drift_positions(timestep);
+		compute_forces();
+		kick(timestep / 2);
+
+		step_count++;
+		if (check_interval > 0 && step_count % check_interval == 0)
+			check_divergence();
+	}
+
+	void simulate(double time, double timestep) {
+		int n_timesteps = (int)(time / timestep);
+
+		for (int i = 0; i < n_timesteps; i++)
+			simulate(timestep);
+
+		double remaining = time - timestep * n_timesteps;
+		if (remaining > 0)
+			simulate(remaining);
+	}
+
+	// Measures the drifts and stops the members that diverged. Called every check_interval steps
+	void check_divergence() {
+		if (!reference_valid)
+			return;
+
+		std::vector<double> energy;
+		std::vector<double> scale;
+		measure_energy(energy, &scale);
+
+		for (int m = 0; m < k; m++) {
+			if (!is_active(m))
+				continue;
+			drift[m] = scale[m] > 0 ? (energy[m] - reference[m]) / scale[m] : 0;
+			if (!std::isfinite(drift[m]) || std::abs(drift[m]) > max_drift)
+				stopped_at[m] = step_count;
+
+#if SIMULATOR_DIAGNOSTICS >= 1
+			if (diagnostics)
+				diagnostics->push({ diagnostic_type::MEMBER, step_count, m, get_separation(m), drift[m] });
+#endif
+		}
+
+		for (int b = 0; b < n_blocks; b++) {
+			block_active[b] = 0;
+			for (int l = 0; l < ensemble_lanes; l++)
+				if (stopped_at[b * ensemble_lanes + l] == -1)
+					block_active[b] = 1;
+		}
+	}
+
+private:
+
+	int n = 0; // Objects
+	int k = 0; // Members
+	int n_blocks = 0;
+
+	std::vector<int> handles; // Simulator handle of each object
+	std::vector<int> object_of; // Object of each handle, -1 if it was not in the Simulator
+
+	std::vector<float> mass;
+	std::vector<int> level;
+	std::vector<char> similar;
+
+	// [block][object][coordinate][lane]
+	std::vector<float> position;
+	std::vector<float> speed;
+	std::vector<float> acceleration;
+
+	std::vector<std::vector<int>> attractor_lists; // One per distinct level, like in the Simulator
+	std::vector<const std::vector<int>*> sources; // List of each object
+
+	std::vector<long long> stopped_at; // Per lane
+	std::vector<char> block_active;
+	std::vector<double> reference; // Energy of each member when the integration started
+	std::vector<double> drift; // At the last check. Frozen when the member is stopped
+	bool reference_valid = false;
+	bool forces_valid = false;
+
+	int check_interval = 16;
+	double max_drift = 1e-2;
+	long long step_count = 0;
+
+	ensemble_field_fn kernel = nullptr;
+	std::unique_ptr<Thread_pool> pool;
+	Diagnostics* diagnostics = nullptr;
+
+	size_t block_floats() const { return (size_t)n * 3 * ensemble_lanes; }
+
+	size_t offset(int member, int i, int c) const {
+		return (member / ensemble_lanes) * block_floats() + ((size_t)i * 3 + c) * ensemble_lanes + member % ensemble_lanes;
+	}
+
+	vcl::vec3 get(const std::vector<float>& a, int member, int i) const {
+		return vcl::vec3(a[offset(member, i, 0)], a[offset(member, i, 1)], a[offset(member, i, 2)]);
+	}
+
+	void set(std::vector<float>& a, int member, int i, vcl::vec3 v) {
+		a[offset(member, i, 0)] = v.x;
+		a[offset(member, i, 1)] = v.y;
+		a[offset(member, i, 2)] = v.z;
+	}
+
+	int check(int member) const {
+		if (member < 0 || member >= k)
+			throw std::invalid_argument("Invalid ensemble member.");
+		return member;
+	}
+
+	int object(int handle) const {
+		if (handle < 0 || handle >= (int)object_of.size() || object_of[handle] == -1)
+			throw std::invalid_argument("Invalid object handle.");
+		return object_of[handle];
+	}
+
+	void build_sources() {
+		std::vector<int> distinct(level);
+		std::sort(distinct.begin(), distinct.end());
+		distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+		attractor_lists.assign(distinct.size(), std::vector<int>());
+		for (size_t d = 0; d < distinct.size(); d++)
+			for (int j = 0; j < n; j++)
+				if (level[j] > distinct[d] || (level[j] == distinct[d] && similar[j]))
+					attractor_lists[d].push_back(j);
+
+		sources.resize(n);
+		for (int i = 0; i < n; i++)
+			sources[i] = &attractor_lists[std::lower_bound(distinct.begin(), distinct.end(), level[i]) - distinct.begin()];
+	}
+
+	// Tasks are (block, range of objects) pairs, so that small ensembles still spread over the threads
+	void compute_forces() {
+		const int chunk = 16;
+		const int chunks = (n + chunk - 1) / chunk;
+
+		auto work = [&](int begin, int end) {
+			for (int t = begin; t < end; t++) {
+				int b = t / chunks;
+				if (!block_active[b])
+					continue;
+				int first = (t % chunks) * chunk;
+				size_t base = b * block_floats();
+				kernel(position.data() + base, mass.data(), sources.data(), first, std::min(n, first + chunk), acceleration.data() + base);
+			}
+		};
+
+		if (pool)
+			pool->parallel_for(n_blocks * chunks, work);
+		else
+			work(0, n_blocks * chunks);
+
+		forces_valid = true;
+	}
+
+	// Stopped lanes get a zero step, so that they keep their last state
+	void kick(double dt) {
+		for (int b = 0; b < n_blocks; b++) {
+			if (!block_active[b])
+				continue;
+			float lane_dt[ensemble_lanes];
+			for (int l = 0; l < ensemble_lanes; l++)
+				lane_dt[l] = stopped_at[b * ensemble_lanes + l] == -1 ? float(G * dt) : 0.0f;
+
+			float* v = speed.data() + b * block_floats();
+			const float* a = acceleration.data() + b * block_floats();
+			for (size_t c = 0; c < block_floats(); c += ensemble_lanes)
+				for (int l = 0; l < ensemble_lanes; l++)
+					v[c + l] = lane_dt[l] != 0 ? v[c + l] + a[c + l] * lane_dt[l] : v[c + l]; // A stopped lane may hold non-finite values
+		}
+	}
+
+	void drift_positions(double dt) {
+		for (int b = 0; b < n_blocks; b++) {
+			if (!block_active[b])
+				continue;
+			float lane_dt[ensemble_lanes];
+			for (int l = 0; l < ensemble_lanes; l++)
+				lane_dt[l] = stopped_at[b * ensemble_lanes + l] == -1 ? float(dt) : 0.0f;
+
+			float* p = position.data() + b * block_floats();
+			const float* v = speed.data() + b * block_floats();
+			for (size_t c = 0; c < block_floats(); c += ensemble_lanes)
+				for (int l = 0; l < ensemble_lanes; l++)
+					p[c + l] = lane_dt[l] != 0 ? p[c + l] + v[c + l] * lane_dt[l] : p[c + l];
+		}
+	}
+
+	// Kinetic plus potential energy of every member (each pair counted once, as in Simulator::evaluate_energy), and the sum of the magnitudes of the terms.
+	// Lane by lane like the forces, in double
+	void measure_energy(std::vector<double>& energy, std::vector<double>* scale = nullptr) const {
+		const int L = ensemble_lanes;
+		energy.assign(n_blocks * L, 0.0);
+		if (scale)
+			scale->assign(n_blocks * L, 0.0);
+
+		for (int b = 0; b < n_blocks; b++) {
+			if (!block_active[b])
+				continue;
+			const float* p = position.data() + b * block_floats();
+			const float* v = speed.data() + b * block_floats();
+			double e[L] = {}, s[L] = {};
+
+			for (int i = 0; i < n; i++) {
+				const float* pi = p + i * 3 * L;
+				const float* vi = v + i * 3 * L;
+				double potential[L] = {};
+				for (int j : *sources[i]) {
+					if (j == i)
+						continue;
+					// j attracts i. Attracted back (same level, i attracts similar objects), the pair is also in the sum of j: half here
+					const double share = level[j] == level[i] && similar[i] ? 0.5 : 1.0;
+					const float* pj = p + j * 3 * L;
+					for (int l = 0; l < L; l++) {
+						double dx = pj[l] - pi[l], dy = pj[L + l] - pi[L + l], dz = pj[2 * L + l] - pi[2 * L + l];
+						potential[l] -= share * mass[j] / std::sqrt(dx * dx + dy * dy + dz * dz);
+					}
+				}
+				for (int l = 0; l < L; l++) {
+					double kinetic = 0.5 * mass[i] * (double(vi[l]) * vi[l] + double(vi[L + l]) * vi[L + l] + double(vi[2 * L + l]) * vi[2 * L + l]);
+					double pairs = G * mass[i] * potential[l];
+					e[l] += kinetic + pairs;
+					s[l] += kinetic - pairs;
+				}
+			}
+
+			for (int l = 0; l < L; l++) {
+				energy[b * L + l] = e[l];
+				if (scale)
+					(*scale)[b * L + l] = s[l];
+			}
+		}
+	}
+};
+
+#endif // ENSEMBLE_H
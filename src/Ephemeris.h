@@ -0,0 +1,357 @@
+#ifndef EPHEMERIS_H
+#define EPHEMERIS_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <string>
+#include <functional>
+#include <fstream>
+#include <stdexcept>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "Kepler.h"
+
+// Files are memory-mapped where mmap exists, read otherwise
+#if defined(__unix__) || defined(__APPLE__)
+#define EPHEMERIS_MMAP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+/* Positions of many bodies over a time span, stored as Chebyshev polynomials
+*
+* The span is cut in segments of equal length. In each segment, each coordinate of each body is the polynomial
+* sum c_j T_j(x) of the given degree, x in [-1, 1] being the time inside the segment. The coefficients are fitted by
+* interpolation at the Chebyshev nodes of the segment, so the error is close to the best possible for the degree.
+* A lookup is a division to find the segment, then one polynomial evaluation: its cost does not depend on t or on
+* what produced the positions (Kepler solves, an integration, ...). Speeds are the derivatives of the polynomials.
+*
+* The file format is the layout in memory, so that a file is used in place once mapped:
+*   Ephemeris_header
+*   body names, ephemeris_name_size bytes each, zero padded
+*   coefficients (double) at data_offset, segment after segment; in a segment body after body, x then y then z,
+*   degree + 1 coefficients each. Everything the lookups of one time need is contiguous.
+* The byte order is the one of the machine that wrote the file.
+*/
+
+const char ephemeris_magic[8] = { 'C', 'H', 'E', 'B', 'E', 'P', 'H', '1' };
+const int ephemeris_name_size = 32;
+const int ephemeris_max_degree = 30;
+
+struct Ephemeris_header {
+	char magic[8];
+	uint32_t bodies;
+	uint32_t degree;
+	uint64_t segments;
+	double begin; // Time at the start of the first segment
+	double segment_length;
+	uint64_t data_offset; // Bytes from the start of the file to the coefficients, a multiple of 64
+};
+
+
+class Ephemeris {
+
+public:
+
+	Ephemeris() = default;
+	~Ephemeris() { release(); }
+
+	Ephemeris(const Ephemeris&) = delete;
+	Ephemeris& operator=(const Ephemeris&) = delete;
+
+	Ephemeris(Ephemeris&& other) noexcept { swap(other); }
+	Ephemeris& operator=(Ephemeris&& other) noexcept {
+		if (this != &other) {
+			release();
+			swap(other);
+		}
+		return *this;
+	}
+
+	/* Fits the positions of the bodies over [begin, end]. sample(t, out) must write the position of every body at t in out.
+	* It is called with increasing times (degree + 1 per segment), so it can step a simulation forward.
+	* The last segment may go past end: get_end_time tells where the ephemeris stops
+	*/
+	static Ephemeris build(const std::vector<std::string>& names, double begin, double end, double segment_length, int degree,
+		const std::function<void(double, vcl::vec3*)>& sample) {
+
+		if (names.empty())
+			throw std::invalid_argument("An ephemeris needs at least one body.");
+		if (!(end > begin) || !(segment_length > 0))
+			throw std::invalid_argument("An ephemeris needs a time span and a positive segment length.");
+		if (degree < 1 || degree > ephemeris_max_degree)
+			throw std::invalid_argument("The degree of an ephemeris must be between 1 and " + std::to_string(ephemeris_max_degree) + ".");
+
+		const int bodies = (int)names.size();
+		const int n = degree + 1;
+		const uint64_t segments = (uint64_t)std::ceil((end - begin) / segment_length);
+
+		Ephemeris e;
+		e.allocate(bodies, degree, segments, begin, segment_length);
+		char* name_block = e.owned.data() + sizeof(Ephemeris_header);
+		for (int b = 0; b < bodies; b++)
+			std::strncpy(name_block + b * ephemeris_name_size, names[b].c_str(), ephemeris_name_size - 1);
+
+		// cos(pi j (k + 1/2) / n), shared by every segment
+		std::vector<double> basis(n * n);
+		for (int j = 0; j < n; j++)
+			for (int k = 0; k < n; k++)
+				basis[j * n + k] = std::cos(kepler_two_pi / 2 * j * (k + 0.5) / n);
+
+		std::vector<vcl::vec3> samples(bodies * n);
+		double* c = const_cast<double*>(e.coefficients);
+
+		for (uint64_t s = 0; s < segments; s++) {
+			const double middle = begin + (s + 0.5) * segment_length;
+
+			// The nodes x_k = cos(pi (k + 1/2) / n) decrease with k: sample them backwards for increasing times
+			for (int k = n - 1; k >= 0; k--) {
+				const double x = std::cos(kepler_two_pi / 2 * (k + 0.5) / n);
+				sample(middle + 0.5 * segment_length * x, &samples[k * bodies]);
+			}
+
+			for (int b = 0; b < bodies; b++) {
+				double* cb = c + (s * bodies + b) * 3 * n;
+				for (int j = 0; j < n; j++) {
+					double sx = 0, sy = 0, sz = 0;
+					for (int k = 0; k < n; k++) {
+						const vcl::vec3& p = samples[k * bodies + b];
+						const double w = basis[j * n + k];
+						sx += w * p.x;
+						sy += w * p.y;
+						sz += w * p.z;
+					}
+					const double scale = (j == 0 ? 1.0 : 2.0) / n;
+					cb[j] = scale * sx;
+					cb[n + j] = scale * sy;
+					cb[2 * n + j] = scale * sz;
+				}
+			}
+		}
+		return e;
+	}
+
+	void save(const std::string& path) const {
+		check_ready();
+		std::ofstream file(path, std::ios::binary);
+		if (!file)
+			throw std::runtime_error("Cannot open ephemeris file " + path);
+		file.write(base, (std::streamsize)byte_size());
+		if (!file)
+			throw std::runtime_error("Cannot write ephemeris file " + path);
+	}
+
+	// Maps the file (reads it where mmap does not exist). The file must not change while the Ephemeris is alive
+	static Ephemeris load(const std::string& path) {
+		Ephemeris e;
+#ifdef EPHEMERIS_MMAP
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Cannot open ephemeris file " + path);
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Ephemeris_header)) {
+			::close(fd);
+			throw std::runtime_error("Not an ephemeris file: " + path);
+		}
+		void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			throw std::runtime_error("Cannot map ephemeris file " + path);
+		e.mapped = p;
+		e.mapped_size = (size_t)st.st_size;
+		e.base = static_cast<const char*>(p);
+		const size_t size = e.mapped_size;
+#else
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file)
+			throw std::runtime_error("Cannot open ephemeris file " + path);
+		const size_t size = (size_t)file.tellg();
+		file.seekg(0);
+		e.owned.resize(size);
+		if (!file.read(e.owned.data(), (std::streamsize)size))
+			throw std::runtime_error("Cannot read ephemeris file " + path);
+		e.base = e.owned.data();
+#endif
+
+		e.header = reinterpret_cast<const Ephemeris_header*>(e.base);
+		const Ephemeris_header& h = *e.header;
+		if (size < sizeof(Ephemeris_header) || std::memcmp(h.magic, ephemeris_magic, sizeof(ephemeris_magic)) != 0
+			|| h.bodies == 0 || h.degree < 1 || h.degree > (uint32_t)ephemeris_max_degree || h.segments == 0
+			|| h.data_offset % 64 != 0 || h.data_offset < sizeof(Ephemeris_header) + (uint64_t)h.bodies * ephemeris_name_size
+			|| size < e.byte_size())
+			throw std::runtime_error("Not an ephemeris file, or a truncated one: " + path);
+
+		e.coefficients = reinterpret_cast<const double*>(e.base + h.data_offset);
+		return e;
+	}
+
+	int get_body_count() const { check_ready(); return (int)header->bodies; }
+	int get_degree() const { check_ready(); return (int)header->degree; }
+	double get_begin_time() const { check_ready(); return header->begin; }
+	double get_end_time() const { check_ready(); return header->begin + header->segments * header->segment_length; }
+	bool covers(double t) const { return header != nullptr && t >= get_begin_time() && t <= get_end_time(); }
+
+	std::string get_name(int body) const {
+		check_body(body);
+		const char* name = base + sizeof(Ephemeris_header) + body * ephemeris_name_size;
+		return std::string(name, strnlen(name, ephemeris_name_size));
+	}
+
+	// Index of the body with this name, -1 if there is none
+	int find(const std::string& name) const {
+		for (int b = 0; b < get_body_count(); b++)
+			if (get_name(b) == name)
+				return b;
+		return -1;
+	}
+
+	vcl::vec3 position(int body, double t) const {
+		double x;
+		const double* c = segment(body, t, x);
+		return clenshaw(c, header->degree + 1, x);
+	}
+
+	vcl::vec3 speed(int body, double t) const {
+		vcl::vec3 p, v;
+		state(body, t, p, v);
+		return v;
+	}
+
+	void state(int body, double t, vcl::vec3& p, vcl::vec3& v) const {
+		double x;
+		const double* c = segment(body, t, x);
+		const int n = header->degree + 1;
+		const double dx_dt = 2 / header->segment_length;
+
+		// T_j and T_j' together: T_j+1 = 2x T_j - T_j-1 and T_j+1' = 2 T_j + 2x T_j' - T_j-1'
+		double t0 = 1, t1 = x, d0 = 0, d1 = 1;
+		double px = c[0], py = c[n], pz = c[2 * n];
+		double vx = 0, vy = 0, vz = 0;
+		for (int j = 1; j < n; j++) {
+			px += c[j] * t1;
+			py += c[n + j] * t1;
+			pz += c[2 * n + j] * t1;
+			vx += c[j] * d1;
+			vy += c[n + j] * d1;
+			vz += c[2 * n + j] * d1;
+
+			const double t2 = 2 * x * t1 - t0;
+			const double d2 = 2 * t1 + 2 * x * d1 - d0;
+			t0 = t1; t1 = t2;
+			d0 = d1; d1 = d2;
+		}
+		p = vcl::vec3(float(px), float(py), float(pz));
+		v = vcl::vec3(float(vx * dx_dt), float(vy * dx_dt), float(vz * dx_dt));
+	}
+
+	// Positions of every body at t, in out. The coefficients of one time are contiguous, so this reads a single block
+	void positions(double t, vcl::vec3* out) const {
+		double x;
+		const double* c = segment(0, t, x);
+		const int n = header->degree + 1;
+		for (uint32_t b = 0; b < header->bodies; b++)
+			out[b] = clenshaw(c + b * 3 * n, n, x);
+	}
+
+private:
+
+	std::vector<char> owned; // Built in memory, or read without mmap
+	void* mapped = nullptr;
+	size_t mapped_size = 0;
+
+	const char* base = nullptr;
+	const Ephemeris_header* header = nullptr;
+	const double* coefficients = nullptr;
+
+	void allocate(int bodies, int degree, uint64_t segments, double begin, double segment_length) {
+		uint64_t offset = sizeof(Ephemeris_header) + (uint64_t)bodies * ephemeris_name_size;
+		offset = (offset + 63) / 64 * 64;
+
+		Ephemeris_header h;
+		std::memcpy(h.magic, ephemeris_magic, sizeof(ephemeris_magic));
+		h.bodies = (uint32_t)bodies;
+		h.degree = (uint32_t)degree;
+		h.segments = segments;
+		h.begin = begin;
+		h.segment_length = segment_length;
+		h.data_offset = offset;
+
+		owned.assign(offset + segments * bodies * 3 * (degree + 1) * sizeof(double), 0);
+		std::memcpy(owned.data(), &h, sizeof(h));
+		base = owned.data();
+		header = reinterpret_cast<const Ephemeris_header*>(base);
+		coefficients = reinterpret_cast<const double*>(base + offset);
+	}
+
+	size_t byte_size() const {
+		return (size_t)(header->data_offset + header->segments * header->bodies * 3 * (header->degree + 1) * sizeof(double));
+	}
+
+	// Coefficients of body in the segment of t, and the time x in [-1, 1] inside the segment
+	const double* segment(int body, double t, double& x) const {
+		check_body(body);
+		if (!covers(t))
+			throw std::out_of_range("Time " + std::to_string(t) + " is outside of the ephemeris.");
+
+		const double u = (t - header->begin) / header->segment_length;
+		uint64_t s = (uint64_t)u;
+		if (s >= header->segments) // t at the very end
+			s = header->segments - 1;
+		x = 2 * (u - s) - 1;
+		return coefficients + (s * header->bodies + body) * 3 * (header->degree + 1);
+	}
+
+	// The three coordinates together: three independent recurrences in flight instead of one
+	static vcl::vec3 clenshaw(const double* c, int n, double x) {
+		const double two_x = 2 * x;
+		double bx1 = 0, bx2 = 0, by1 = 0, by2 = 0, bz1 = 0, bz2 = 0;
+		for (int j = n - 1; j >= 1; j--) {
+			const double bx0 = two_x * bx1 - bx2 + c[j];
+			const double by0 = two_x * by1 - by2 + c[n + j];
+			const double bz0 = two_x * bz1 - bz2 + c[2 * n + j];
+			bx2 = bx1; bx1 = bx0;
+			by2 = by1; by1 = by0;
+			bz2 = bz1; bz1 = bz0;
+		}
+		return vcl::vec3(float(x * bx1 - bx2 + c[0]), float(x * by1 - by2 + c[n]), float(x * bz1 - bz2 + c[2 * n]));
+	}
+
+	void check_ready() const {
+		if (header == nullptr)
+			throw std::logic_error("The ephemeris is empty: build or load it first.");
+	}
+
+	void check_body(int body) const {
+		if (body < 0 || body >= get_body_count())
+			throw std::out_of_range("No body " + std::to_string(body) + " in the ephemeris.");
+	}
+
+	void release() {
+#ifdef EPHEMERIS_MMAP
+		if (mapped != nullptr)
+			munmap(mapped, mapped_size);
+#endif
+		owned.clear();
+		mapped = nullptr;
+		mapped_size = 0;
+		base = nullptr;
+		header = nullptr;
+		coefficients = nullptr;
+	}
+
+	void swap(Ephemeris& other) {
+		std::swap(owned, other.owned);
+		std::swap(mapped, other.mapped);
+		std::swap(mapped_size, other.mapped_size);
+		std::swap(base, other.base);
+		std::swap(header, other.header);
+		std::swap(coefficients, other.coefficients);
+	}
+};
+
+#endif // EPHEMERIS_H
@@ -0,0 +1,679 @@
+#ifndef EVENT_SEARCH_H
+#define EVENT_SEARCH_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <string>
+#include <functional>
+#include <initializer_list>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <cmath>
+#include "Thread_pool.h"
+
+
+/* Close approaches, conjunctions and eclipses between bodies on closed-form orbits, over a window of time
+*
+* Each event is an interval during which a function of time is negative: a distance minus a threshold (close approach), the
+* angle between two bodies seen from an observer minus a threshold (conjunction), the distance of a body to a shadow cone
+* (eclipse). Bodies give their positions and speeds relative to their parents, with bounds on the norms of the speed and of
+* its derivative (for a circular Orbit_Object: 2 pi r / period and speed^2 / r). The bounds on the motion of a body relative to
+* another only add up the orbits between them and their common ancestor: the Moon is slow around the Earth, although both
+* are fast around the Sun.
+*
+* The scan jumps from sample to sample: the bounds tell how long the function surely keeps its sign (a quadratic bound with
+* the derivative for distances, a Lipschitz bound for angles and shadows), and the next sample is taken there. Far from an
+* event a step covers a good part of an orbit, close to one it shrinks down to the time resolution. Changes of sign are
+* refined with Brent's root finder, the extremum of each interval with Brent's minimizer. An event shorter than the
+* resolution, or two events closer than it, can be missed.
+*
+* Pairs (and triples, for eclipses) are independent: they are scanned in parallel, each into its own list, merged by time.
+*/
+
+struct Event_body {
+	std::string name;
+	float radius = 0;
+	int parent = -1; // Index of the body it orbits, -1 for none. Parents come before their children
+	std::function<vcl::vec3(double)> position; // Relative to the parent
+	std::function<vcl::vec3(double)> speed; // Relative to the parent
+	double max_speed = 0; // Bound on the norm of speed
+	double max_acceleration = 0; // Bound on the norm of the derivative of speed
+};
+
+enum class event_type { CLOSE_APPROACH, CONJUNCTION, PARTIAL_ECLIPSE, TOTAL_ECLIPSE, ANNULAR_ECLIPSE };
+
+struct Event {
+	event_type type;
+	int body_a; // Close approach, conjunction: the first body. Eclipse: the body casting the shadow
+	int body_b; // Close approach, conjunction: the second body. Eclipse: the body in the shadow
+	int reference; // Conjunction: the observer. Eclipse: the source of light. Close approach: -1
+	double begin, end; // Clipped to the window
+	double time; // Of the closest approach, the smallest angle, the greatest eclipse
+	/* Close approach: distance between the centers. Conjunction: angle (radians).
+	* Eclipse: distance of the center of body_b to the axis of the shadow
+	*/
+	double value;
+};
+
+class Event_search {
+
+public:
+
+	double distance_tolerance = 1e-4; // Relative, for minimum_distance
+
+	explicit Event_search(std::vector<Event_body> bodies_) : bodies(std::move(bodies_)) {
+		double shortest = std::numeric_limits<double>::infinity();
+		for (int b = 0; b < (int)bodies.size(); b++) {
+			const Event_body& body = bodies[b];
+			if (body.parent >= b)
+				throw std::invalid_argument("The parent of " + body.name + " must come before it.");
+			if (body.parent >= 0 && (!body.position || !body.speed))
+				throw std::invalid_argument(body.name + " needs a position and a speed.");
+			if (!(body.max_speed >= 0) || !(body.max_acceleration >= 0))
+				throw std::invalid_argument("The bounds of " + body.name + " must be positive.");
+			if (body.max_speed > 0 && body.max_acceleration > 0)
+				shortest = std::min(shortest, 2 * 3.14159265358979 * body.max_speed / body.max_acceleration);
+		}
+		resolution = std::isfinite(shortest) ? 1e-5 * shortest : 1e-5;
+	}
+
+	int get_body_count() const { return (int)bodies.size(); }
+	const Event_body& get_body(int b) const { return bodies.at(b); }
+
+	// -1 if there is none
+	int find(const std::string& name) const {
+		for (int b = 0; b < (int)bodies.size(); b++)
+			if (bodies[b].name == name)
+				return b;
+		return -1;
+	}
+
+	// Smallest step of the scans. Default: 1e-5 of the shortest period
+	void set_time_resolution(double dt) {
+		if (!(dt > 0))
+			throw std::invalid_argument("The time resolution must be positive.");
+		resolution = dt;
+	}
+	double get_time_resolution() const { return resolution; }
+
+	// Every interval during which the centers of two bodies are closer than max_distance. pool may be nullptr
+	std::vector<Event> close_approaches(double begin, double end, double max_distance, Thread_pool* pool = nullptr) const {
+		check_window(begin, end);
+		std::vector<std::pair<int, int>> pairs;
+		for (int a = 0; a < (int)bodies.size(); a++)
+			for (int b = a + 1; b < (int)bodies.size(); b++)
+				pairs.push_back({ a, b });
+
+		return run((int)pairs.size(), pool, [&](int k, std::vector<Event>& out) {
+			const Link ab = link(pairs[k].first, pairs[k].second);
+			auto sample = [&](double t) { return distance_sample(ab, t, max_distance); };
+			for (const Interval& i : scan(sample, begin, end)) {
+				Event e = { event_type::CLOSE_APPROACH, pairs[k].first, pairs[k].second, -1, i.begin, i.end, 0, 0 };
+				e.value = deepest(sample, i, e.time) + max_distance;
+				out.push_back(e);
+			}
+		});
+	}
+
+	// Every interval during which two bodies, seen from observer, are less than max_angle (radians) apart
+	std::vector<Event> conjunctions(int observer, double begin, double end, double max_angle, Thread_pool* pool = nullptr) const {
+		check_window(begin, end);
+		check_body(observer);
+		std::vector<std::pair<int, int>> pairs;
+		for (int a = 0; a < (int)bodies.size(); a++)
+			for (int b = a + 1; b < (int)bodies.size(); b++)
+				if (a != observer && b != observer)
+					pairs.push_back({ a, b });
+
+		return run((int)pairs.size(), pool, [&](int k, std::vector<Event>& out) {
+			const Sight l = sight(pairs[k].first, pairs[k].second, observer);
+			auto sample = [&](double t) { return angle_sample(l, t, max_angle); };
+			for (const Interval& i : scan(sample, begin, end)) {
+				Event e = { event_type::CONJUNCTION, pairs[k].first, pairs[k].second, observer, i.begin, i.end, 0, 0 };
+				e.value = deepest(sample, i, e.time) + max_angle;
+				out.push_back(e);
+			}
+		});
+	}
+
+	/* Every eclipse of the light: a body touches the penumbra of another one (partial eclipse), then possibly its umbra (total)
+	* or the cone beyond the end of the umbra (annular). A total or annular eclipse is also reported within its partial one
+	*/
+	std::vector<Event> eclipses(int light, double begin, double end, Thread_pool* pool = nullptr) const {
+		check_window(begin, end);
+		check_body(light);
+		std::vector<std::pair<int, int>> pairs; // (casting the shadow, in the shadow)
+		for (int o = 0; o < (int)bodies.size(); o++)
+			for (int t = 0; t < (int)bodies.size(); t++)
+				if (o != light && t != light && o != t && bodies[o].radius > 0)
+					pairs.push_back({ o, t });
+
+		return run((int)pairs.size(), pool, [&](int k, std::vector<Event>& out) {
+			const int o = pairs[k].first, t = pairs[k].second;
+			const Link lo = link(o, light);
+			const Link to = link(t, o);
+			auto penumbra = [&](double time) { return shadow_sample(lo, to, light, o, t, time, false); };
+			auto central = [&](double time) { return shadow_sample(lo, to, light, o, t, time, true); };
+
+			for (const Interval& i : scan(penumbra, begin, end)) {
+				Event e = { event_type::PARTIAL_ECLIPSE, o, t, light, i.begin, i.end, 0, 0 };
+				deepest(penumbra, i, e.time);
+				e.value = shadow(lo, to, light, o, e.time).axis_distance;
+				out.push_back(e);
+
+				for (const Interval& c : scan(central, i.begin, i.end)) {
+					Event f = { event_type::TOTAL_ECLIPSE, o, t, light, c.begin, c.end, 0, 0 };
+					deepest(central, c, f.time);
+					const Shadow in = shadow(lo, to, light, o, f.time);
+					f.type = in.umbra > 0 ? event_type::TOTAL_ECLIPSE : event_type::ANNULAR_ECLIPSE;
+					f.value = in.axis_distance;
+					out.push_back(f);
+				}
+			}
+		});
+	}
+
+	// Smallest distance between the centers of a and b over [begin, end], within distance_tolerance
+	Event minimum_distance(int a, int b, double begin, double end) const {
+		check_window(begin, end);
+		check_body(a);
+		check_body(b);
+		const Link ab = link(a, b);
+		auto distance = [&](double t) { return (double)vcl::norm(relative_position(ab, t)); };
+
+		Event best = { event_type::CLOSE_APPROACH, a, b, -1, begin, end, begin, distance(begin) };
+		if (distance(end) < best.value) {
+			best.time = end;
+			best.value = distance(end);
+		}
+
+		// Scans for a distance below the best one found so far, then follows the descent down to its local minimum
+		double t = begin;
+		Sample s = distance_sample(ab, t, best.value * (1 - distance_tolerance));
+		while (t < end) {
+			const double next = std::min(t + step(s), end);
+			const Sample n = distance_sample(ab, next, best.value * (1 - distance_tolerance));
+			if (n.value >= 0) {
+				t = next;
+				s = n;
+				continue;
+			}
+
+			// The descent ends where the derivative of the distance becomes positive. It stays negative at least |slope| / curvature
+			double low = t, high = next;
+			Sample h = n;
+			while (h.slope < 0 && high < end) {
+				low = high;
+				high = std::min(high + std::max(std::min(-h.slope / h.curvature, h.max_step), resolution), end);
+				h = distance_sample(ab, high, 0);
+			}
+			double time;
+			const double d = deepest(distance, { low, high }, time);
+			if (d < best.value) {
+				best.time = time;
+				best.value = d;
+			}
+			t = high;
+			s = distance_sample(ab, t, best.value * (1 - distance_tolerance));
+		}
+		return best;
+	}
+
+	// minimum_distance for every pair of bodies
+	std::vector<Event> minimum_distances(double begin, double end, Thread_pool* pool = nullptr) const {
+		check_window(begin, end);
+		std::vector<std::pair<int, int>> pairs;
+		for (int a = 0; a < (int)bodies.size(); a++)
+			for (int b = a + 1; b < (int)bodies.size(); b++)
+				pairs.push_back({ a, b });
+
+		return run((int)pairs.size(), pool, [&](int k, std::vector<Event>& out) {
+			out.push_back(minimum_distance(pairs[k].first, pairs[k].second, begin, end));
+		});
+	}
+
+private:
+
+	std::vector<Event_body> bodies;
+	double resolution;
+
+	struct Interval { double begin, end; };
+
+	/* value, its derivative when known (slope, curvature: bound on the norm of the second derivative), or a bound on the norm of
+	* its derivative (rate, which may grow by rate_growth per unit of time). Bounds hold up to max_step after the sample
+	*/
+	struct Sample {
+		double value;
+		double slope;
+		double curvature;
+		double rate;
+		double rate_growth;
+		double max_step;
+	};
+
+	// Position of a body relative to another: the orbits from the first one up to their common ancestor, minus those of the other
+	struct Link {
+		std::vector<int> plus, minus;
+		double max_speed = 0;
+		double max_acceleration = 0;
+	};
+
+	Link link(int a, int b) const {
+		std::vector<int> up_a, up_b;
+		for (int k = a; k >= 0; k = bodies[k].parent)
+			up_a.push_back(k);
+		for (int k = b; k >= 0; k = bodies[k].parent)
+			up_b.push_back(k);
+		while (!up_a.empty() && !up_b.empty() && up_a.back() == up_b.back()) {
+			up_a.pop_back();
+			up_b.pop_back();
+		}
+
+		Link l;
+		l.plus = up_a;
+		l.minus = up_b;
+		for (int k : up_a) {
+			l.max_speed += bodies[k].max_speed;
+			l.max_acceleration += bodies[k].max_acceleration;
+		}
+		for (int k : up_b) {
+			l.max_speed += bodies[k].max_speed;
+			l.max_acceleration += bodies[k].max_acceleration;
+		}
+		return l;
+	}
+
+	// -1 if a and b are in different trees
+	int common_ancestor(int a, int b) const {
+		while (a != b && a >= 0 && b >= 0) {
+			if (a > b)
+				a = bodies[a].parent; // Parents come first: the larger index cannot be an ancestor of the other
+			else
+				b = bodies[b].parent;
+		}
+		return a == b ? a : -1;
+	}
+
+	vcl::vec3 relative_position(const Link& l, double t) const {
+		vcl::vec3 p;
+		for (int k : l.plus)
+			p += bodies[k].position(t);
+		for (int k : l.minus)
+			p -= bodies[k].position(t);
+		return p;
+	}
+
+	vcl::vec3 relative_speed(const Link& l, double t) const {
+		vcl::vec3 v;
+		for (int k : l.plus)
+			v += bodies[k].speed(t);
+		for (int k : l.minus)
+			v -= bodies[k].speed(t);
+		return v;
+	}
+
+	// Distance minus threshold. Over a step where the distance d loses at most half of itself, |d''| <= A + 2 V^2 / d
+	Sample distance_sample(const Link& l, double t, double threshold) const {
+		const vcl::vec3 p = relative_position(l, t);
+		const vcl::vec3 v = relative_speed(l, t);
+		const double d = vcl::norm(p);
+		const double V = l.max_speed, A = l.max_acceleration;
+		Sample s;
+		s.value = d - threshold;
+		s.slope = d > 0 ? vcl::dot(p, v) / d : -V;
+		s.curvature = d > 0 ? A + 2 * V * V / d : std::numeric_limits<double>::infinity();
+		s.rate = 0;
+		s.rate_growth = 0;
+		s.max_step = V > 0 ? d / (2 * V) : std::numeric_limits<double>::infinity();
+		return s;
+	}
+
+	/* Bodies i and j seen from an observer: a = i - observer, b = j - observer. Both also move with their common ancestor m,
+	* which turns a and b together: what opens the angle is their motion relative to m, and the difference of their distances
+	*/
+	struct Sight {
+		Link a, b;
+		double common_speed = -1; // Bound for m relative to the observer, -1 without common ancestor
+		double speed_a = 0, speed_b = 0; // Bounds for i and j relative to m
+	};
+
+	Sight sight(int i, int j, int observer) const {
+		Sight l;
+		l.a = link(i, observer);
+		l.b = link(j, observer);
+		const int m = common_ancestor(i, j);
+		if (m >= 0) {
+			l.common_speed = link(m, observer).max_speed;
+			l.speed_a = link(i, m).max_speed;
+			l.speed_b = link(j, m).max_speed;
+		}
+		return l;
+	}
+
+	// Angle between a and b minus threshold
+	Sample angle_sample(const Sight& l, double t, double threshold) const {
+		const double pi = 3.14159265358979;
+		const vcl::vec3 pa = relative_position(l.a, t);
+		const vcl::vec3 pb = relative_position(l.b, t);
+		const double da = vcl::norm(pa), db = vcl::norm(pb);
+		const double theta = std::atan2((double)vcl::norm(vcl::cross(pa, pb)), (double)vcl::dot(pa, pb));
+		Sample s;
+		s.value = theta - threshold;
+		s.slope = 0;
+		s.curvature = 0;
+		// Over the step, the distances lose at most half of themselves
+		s.max_step = std::min(l.a.max_speed > 0 ? da / (2 * l.a.max_speed) : std::numeric_limits<double>::infinity(),
+			l.b.max_speed > 0 ? db / (2 * l.b.max_speed) : std::numeric_limits<double>::infinity());
+
+		// A direction at distance d turns at most at V / d
+		s.rate = 2 * (l.a.max_speed / da + l.b.max_speed / db);
+		s.rate_growth = 0;
+
+		/* For the directions u and w, |theta'| <= |u' - w'| / cos(theta / 2). With p', q' the motions of i, j relative to m and
+		* e' the one of m: |u' - w'| <= |p'| / da + |q'| / db + |e'| (sin(theta) / da + |db - da| / (da db)).
+		* Over the step theta stays below theta + |value|, and |db - da| grows at most at |p'| + |q'| + theta |e'|
+		*/
+		const double widest = theta + std::abs(s.value);
+		if (l.common_speed >= 0 && widest < 2 * pi / 3) {
+			const double c = 1 / std::cos(widest / 2);
+			const double E = l.common_speed;
+			const double rate = c * (2 * l.speed_a / da + 2 * l.speed_b / db
+				+ E * (2 * std::sin(std::min(widest, pi / 2)) / da + 4 * std::abs(db - da) / (da * db)));
+			const double growth = c * 4 * E * (l.speed_a + l.speed_b + widest * E) / (da * db);
+			if (lipschitz_step(std::abs(s.value), rate, growth) > lipschitz_step(std::abs(s.value), s.rate, 0)) {
+				s.rate = rate;
+				s.rate_growth = growth;
+			}
+		}
+		return s;
+	}
+
+	/* Shadow of o lit by light, around the axis from the light through o. At the distance axial beyond o along the axis,
+	* the penumbra has the radius R_o + axial (R_light + R_o) / D and the umbra R_o - axial (R_light - R_o) / D (D: from the
+	* light to o), negative past its end: the cone of the annular eclipses
+	*/
+	struct Shadow {
+		double axial;
+		double axis_distance;
+		double penumbra;
+		double umbra;
+		double rate; // Bound on the derivatives of axis_distance - penumbra and axis_distance - |umbra|
+		double rate_growth;
+		double max_step;
+	};
+
+	Shadow shadow(const Link& lo, const Link& to, int light, int o, double time) const {
+		const vcl::vec3 axis = relative_position(lo, time);
+		const vcl::vec3 w = relative_position(to, time);
+		const double D = vcl::norm(axis);
+		const vcl::vec3 n = axis / float(D);
+		const double R_light = bodies[light].radius, R_o = bodies[o].radius;
+
+		Shadow s;
+		s.axial = vcl::dot(w, n);
+		s.axis_distance = vcl::norm(w - float(s.axial) * n);
+		s.penumbra = R_o + s.axial * (R_light + R_o) / D;
+		s.umbra = R_o - s.axial * (R_light - R_o) / D;
+
+		/* |axis_distance'| <= |w'| + 2 |w| |n'|, |axial'| <= |w'| + |w| |n'|, |n'| <= V_lo / D and the slope of the cones, k,
+		* changes at most at k V_lo / D: the derivatives are below (1 + k) (V_to + 2 |w| V_lo / D).
+		* Over the step, D loses at most half of itself and |w| grows at most at V_to
+		*/
+		const double W = vcl::norm(w);
+		const double k = (R_light + R_o) / D;
+		s.rate = (1 + 2 * k) * (to.max_speed + 4 * W * lo.max_speed / D);
+		s.rate_growth = (1 + 2 * k) * 4 * to.max_speed * lo.max_speed / D;
+		s.max_step = lo.max_speed > 0 ? D / (2 * lo.max_speed) : std::numeric_limits<double>::infinity();
+		return s;
+	}
+
+	/* Distance of t to the penumbra (or the umbra and its cone beyond), negative when it touches it. On the side of the light,
+	* the distance to the plane through o across the axis: the axis itself is far from the shadow there
+	*/
+	Sample shadow_sample(const Link& lo, const Link& to, int light, int o, int t, double time, bool central) const {
+		const Shadow sh = shadow(lo, to, light, o, time);
+		Sample s;
+		s.value = std::max(sh.axis_distance - (central ? std::abs(sh.umbra) : sh.penumbra), -sh.axial) - bodies[t].radius;
+		s.slope = 0;
+		s.curvature = 0;
+		s.rate = sh.rate;
+		s.rate_growth = sh.rate_growth;
+		s.max_step = sh.max_step;
+		return s;
+	}
+
+	// How long the sign of the sampled function surely stays the same, at least the resolution
+	double step(const Sample& s) const {
+		const double f = std::abs(s.value);
+		double h;
+		if (s.rate > 0)
+			h = lipschitz_step(f, s.rate, s.rate_growth);
+		else {
+			const double toward = s.value >= 0 ? s.slope : -s.slope; // Negative when going toward 0
+			if (s.curvature > 0)
+				h = (toward + std::sqrt(toward * toward + 2 * s.curvature * f)) / s.curvature;
+			else
+				h = toward < 0 ? f / -toward : std::numeric_limits<double>::infinity();
+		}
+		h = std::min(h, s.max_step);
+		return h > resolution ? h : resolution;
+	}
+
+	// Time for a function of norm f to reach 0 when its rate is at most rate + growth h after h
+	static double lipschitz_step(double f, double rate, double growth) {
+		return 2 * f / (rate + std::sqrt(rate * rate + 4 * growth * f));
+	}
+
+	// Intervals of [begin, end] where the sampled value is negative
+	template <typename F>
+	std::vector<Interval> scan(const F& sample, double begin, double end) const {
+		std::vector<Interval> found;
+		auto value = [&](double t) { return sample(t).value; };
+		double t = begin;
+		Sample s = sample(t);
+		double entered = begin;
+		while (t < end) {
+			const double next = std::min(t + step(s), end);
+			const Sample n = sample(next);
+			if ((n.value < 0) != (s.value < 0)) {
+				const double root = brent_root(value, t, next, s.value, n.value);
+				if (n.value < 0)
+					entered = root;
+				else
+					found.push_back({ entered, root });
+			}
+			t = next;
+			s = n;
+		}
+		if (s.value < 0)
+			found.push_back({ entered, end });
+		return found;
+	}
+
+	// Smallest value over the interval, and its time
+	template <typename F>
+	double deepest(const F& sample, const Interval& i, double& time) const {
+		auto value = [&](double t) { return value_of(sample(t)); };
+		double best = brent_minimum(value, i.begin, i.end, time);
+		for (double edge : { i.begin, i.end }) {
+			const double v = value(edge);
+			if (v < best) {
+				best = v;
+				time = edge;
+			}
+		}
+		return best;
+	}
+
+	static double value_of(const Sample& s) { return s.value; }
+	static double value_of(double v) { return v; }
+
+	// Root of f in [a, b], where fa and fb have opposite signs (Brent, 1973)
+	template <typename F>
+	double brent_root(const F& f, double a, double b, double fa, double fb) const {
+		const double tol = resolution;
+		const double eps = std::numeric_limits<double>::epsilon();
+		double c = b, fc = fb, d = b - a, e = d;
+		for (int iteration = 0; iteration < 100; iteration++) {
+			if ((fb > 0 && fc > 0) || (fb < 0 && fc < 0)) {
+				c = a;
+				fc = fa;
+				d = e = b - a;
+			}
+			if (std::abs(fc) < std::abs(fb)) {
+				a = b;
+				b = c;
+				c = a;
+				fa = fb;
+				fb = fc;
+				fc = fa;
+			}
+			const double tol1 = 2 * eps * std::abs(b) + 0.5 * tol;
+			const double m = 0.5 * (c - b);
+			if (std::abs(m) <= tol1 || fb == 0)
+				return b;
+			if (std::abs(e) >= tol1 && std::abs(fa) > std::abs(fb)) {
+				// Secant or inverse quadratic interpolation
+				const double s = fb / fa;
+				double p, q;
+				if (a == c) {
+					p = 2 * m * s;
+					q = 1 - s;
+				}
+				else {
+					const double r = fb / fc;
+					q = fa / fc;
+					p = s * (2 * m * q * (q - r) - (b - a) * (r - 1));
+					q = (q - 1) * (r - 1) * (s - 1);
+				}
+				if (p > 0)
+					q = -q;
+				else
+					p = -p;
+				if (2 * p < std::min(3 * m * q - std::abs(tol1 * q), std::abs(e * q))) {
+					e = d;
+					d = p / q;
+				}
+				else {
+					d = m;
+					e = m;
+				}
+			}
+			else {
+				// Bisection
+				d = m;
+				e = m;
+			}
+			a = b;
+			fa = fb;
+			b += std::abs(d) > tol1 ? d : (m > 0 ? tol1 : -tol1);
+			fb = f(b);
+		}
+		return b;
+	}
+
+	// Local minimum of f in [a, b], golden sections and parabolic interpolation (Brent, 1973)
+	template <typename F>
+	double brent_minimum(const F& f, double a, double b, double& x) const {
+		const double golden = 0.5 * (3 - std::sqrt(5.0));
+		const double tol = resolution;
+		x = a + golden * (b - a);
+		double w = x, v = x, fx = f(x), fw = fx, fv = fx;
+		double d = 0, e = 0;
+		for (int iteration = 0; iteration < 100; iteration++) {
+			const double m = 0.5 * (a + b);
+			const double tol1 = 3e-8 * std::abs(x) + tol / 3;
+			const double tol2 = 2 * tol1;
+			if (std::abs(x - m) <= tol2 - 0.5 * (b - a))
+				break;
+
+			double p = 0, q = 0, r = 0;
+			if (std::abs(e) > tol1) {
+				r = (x - w) * (fx - fv);
+				q = (x - v) * (fx - fw);
+				p = (x - v) * q - (x - w) * r;
+				q = 2 * (q - r);
+				if (q > 0)
+					p = -p;
+				else
+					q = -q;
+				r = e;
+				e = d;
+			}
+			if (std::abs(p) < std::abs(0.5 * q * r) && p > q * (a - x) && p < q * (b - x)) {
+				d = p / q;
+				const double u = x + d;
+				if (u - a < tol2 || b - u < tol2)
+					d = x < m ? tol1 : -tol1;
+			}
+			else {
+				e = (x < m ? b : a) - x;
+				d = golden * e;
+			}
+
+			const double u = x + (std::abs(d) >= tol1 ? d : (d > 0 ? tol1 : -tol1));
+			const double fu = f(u);
+			if (fu <= fx) {
+				if (u < x)
+					b = x;
+				else
+					a = x;
+				v = w;
+				fv = fw;
+				w = x;
+				fw = fx;
+				x = u;
+				fx = fu;
+			}
+			else {
+				if (u < x)
+					a = u;
+				else
+					b = u;
+				if (fu <= fw || w == x) {
+					v = w;
+					fv = fw;
+					w = u;
+					fw = fu;
+				}
+				else if (fu <= fv || v == x || v == w) {
+					v = u;
+					fv = fu;
+				}
+			}
+		}
+		return fx;
+	}
+
+	// Runs task(k, events) for k in [0, n), in parallel, and merges the events by time
+	std::vector<Event> run(int n, Thread_pool* pool, const std::function<void(int, std::vector<Event>&)>& task) const {
+		std::vector<std::vector<Event>> found(n);
+		auto work = [&](int first, int last) {
+			for (int k = first; k < last; k++)
+				task(k, found[k]);
+		};
+		if (pool)
+			pool->parallel_for(n, work);
+		else
+			work(0, n);
+
+		std::vector<Event> events;
+		for (const std::vector<Event>& f : found)
+			events.insert(events.end(), f.begin(), f.end());
+		std::stable_sort(events.begin(), events.end(), [](const Event& x, const Event& y) { return x.begin < y.begin; });
+		return events;
+	}
+
+	void check_window(double begin, double end) const {
+		if (!(end > begin))
+			throw std::invalid_argument("The end of the window must come after its beginning.");
+	}
+
+	void check_body(int b) const {
+		if (b < 0 || b >= (int)bodies.size())
+			throw std::out_of_range("No such body.");
+	}
+};
+
+#endif // EVENT_SEARCH_H
@@ -0,0 +1,536 @@
+#ifndef FMM_H
+#define FMM_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include "Thread_pool.h"
+
+
+/* Fast multipole method in Cartesian coordinates, O(N)
+*
+* The adaptive octree is built like in Octree.h (leaves of at most leaf_size objects). Each cell gets multipole moments up to "order"
+* around its center (P2M at the leaves, M2M upwards). A dual tree walk then pairs cells: well separated pairs exchange
+* multipoles for local expansions (M2L), touching leaves interact directly (P2P). Local expansions go down the tree (L2L)
+* and are evaluated at every object (L2P). The error decreases like theta^(order+1).
+*
+* As in Octree.h, attraction levels get their own moments: the moments of level k describe what attracts an object of level k,
+* and the local expansions of level k are only evaluated for objects of level k.
+*
+* Expansions use raw moments M_a = sum of m d^a over the cell (d relative to its center, a a multi-index) and
+* the derivatives T_a = D^a(1/r) / a! of the Green function, given by the recurrence
+* n r^2 T_a = -(2n - 1) sum_i r_i T_(a - e_i) - (n - 1) sum_i T_(a - 2e_i), n = |a|.
+*
+* Values are computed without G (the caller scales them).
+*/
+
+class Fmm {
+
+public:
+
+	float theta = 0.7f; // Cells of radii r1 and r2 at distance d interact through expansions if r1 + r2 < theta d
+	int leaf_size = 32;
+
+	int get_order() const { return order; }
+
+	// Expansion order, from 1 (mass and dipole) to 8
+	void set_order(int p) {
+		p = std::max(1, std::min(p, 8));
+		if (p != order) {
+			order = p;
+			tables_ready = false;
+		}
+	}
+
+	/* Computes the field (acceleration without G) and the potential per unit mass of every object.
+	* The object at index excluded (-1 for none) attracts nothing.
+	* field and potential must have room for n values. pool may be nullptr.
+	*/
+	void compute(const vcl::vec3* position_, const float* mass_, const int* level_, const char* similar_, int n_, int excluded_,
+		vcl::vec3* field, double* potential, Thread_pool* pool) {
+
+		position = position_;
+		mass = mass_;
+		level = level_;
+		similar = similar_;
+		n = n_;
+		excluded = excluded_;
+
+		if (!tables_ready)
+			build_tables();
+
+		for (int i = 0; i < n; i++) {
+			field[i] = vcl::vec3();
+			potential[i] = 0;
+		}
+		if (n == 0)
+			return;
+
+		build_tree();
+		upward(0);
+
+		// Interaction lists, grouped by target cell so that every target can be handled by one thread
+		far_pairs.clear();
+		near_pairs.clear();
+		walk(0, 0);
+
+		group(far_pairs, far_start, far_sorted);
+		group(near_pairs, near_start, near_sorted);
+
+		local.assign(cells.size() * n_levels * n_terms, 0.0);
+
+		auto m2l_cells = [&](int begin, int end) {
+			std::vector<double> T(n_terms);
+			for (int t = begin; t < end; t++)
+				for (int e = far_start[t]; e < far_start[t + 1]; e++)
+					m2l(far_sorted[e], t, T);
+		};
+		if (pool)
+			pool->parallel_for((int)cells.size(), m2l_cells);
+		else
+			m2l_cells(0, (int)cells.size());
+
+		downward(0);
+
+		auto leaves = [&](int begin, int end) {
+			for (int t = begin; t < end; t++) {
+				if (!cells[t].leaf)
+					continue;
+				l2p(t, field, potential);
+				for (int e = near_start[t]; e < near_start[t + 1]; e++)
+					p2p(t, near_sorted[e], field, potential);
+			}
+		};
+		if (pool)
+			pool->parallel_for((int)cells.size(), leaves);
+		else
+			leaves(0, (int)cells.size());
+	}
+
+private:
+
+	struct Cell {
+		vcl::vec3 center; // Center of the bounding box of its objects: center of the expansions
+		float radius; // Distance from the center to its farthest object
+		int first, count; // Range in index
+		int child[8];
+		bool leaf;
+	};
+
+	struct Pair {
+		int target, source;
+	};
+
+	int order = 4;
+	bool tables_ready = false;
+
+	const vcl::vec3* position = nullptr;
+	const float* mass = nullptr;
+	const int* level = nullptr;
+	const char* similar = nullptr;
+	int n = 0;
+	int excluded = -1;
+
+	std::vector<Cell> cells;
+	std::vector<int> index;
+	std::vector<int> buffer;
+
+	std::vector<int> levels;
+	std::vector<int> level_index;
+	int n_levels = 0;
+
+	std::vector<double> multipole; // cells x levels x terms
+	std::vector<double> local;
+
+	std::vector<Pair> far_pairs, near_pairs;
+	std::vector<int> far_start, near_start;
+	std::vector<int> far_sorted, near_sorted; // Sources grouped by target
+
+	// Multi-indices a = (ax, ay, az) with |a| <= order
+	int n_terms = 0;
+	std::vector<int> ax, ay, az;
+	std::vector<int> term_index; // (order+1)^3 table, -1 outside
+	std::vector<int> lower[3]; // Index of a - e_k, -1 if a_k = 0
+
+	struct Product {
+		int a, b, c; // out[a] += coefficient * in1[b] * in2[c]
+		double coefficient;
+	};
+	std::vector<Product> m2m_table, m2l_table, l2l_table;
+
+	int term(int i, int j, int k) const {
+		if (i < 0 || j < 0 || k < 0 || i + j + k > order)
+			return -1;
+		return term_index[(i * (order + 1) + j) * (order + 1) + k];
+	}
+
+	static double binomial(int n_, int k) {
+		double b = 1;
+		for (int i = 1; i <= k; i++)
+			b = b * (n_ - k + i) / i;
+		return b;
+	}
+
+	void build_tables() {
+		term_index.assign((order + 1) * (order + 1) * (order + 1), -1);
+		ax.clear();
+		ay.clear();
+		az.clear();
+		for (int s = 0; s <= order; s++) // Sorted by total order, used by the recurrence
+			for (int i = s; i >= 0; i--)
+				for (int j = s - i; j >= 0; j--) {
+					int k = s - i - j;
+					term_index[(i * (order + 1) + j) * (order + 1) + k] = (int)ax.size();
+					ax.push_back(i);
+					ay.push_back(j);
+					az.push_back(k);
+				}
+		n_terms = (int)ax.size();
+
+		for (int c = 0; c < 3; c++)
+			lower[c].resize(n_terms);
+		for (int t = 0; t < n_terms; t++) {
+			lower[0][t] = term(ax[t] - 1, ay[t], az[t]);
+			lower[1][t] = term(ax[t], ay[t] - 1, az[t]);
+			lower[2][t] = term(ax[t], ay[t], az[t] - 1);
+		}
+
+		m2m_table.clear();
+		m2l_table.clear();
+		l2l_table.clear();
+		for (int a = 0; a < n_terms; a++) {
+			for (int g = 0; g < n_terms; g++) {
+				int dx = ax[a] - ax[g], dy = ay[a] - ay[g], dz = az[a] - az[g];
+
+				// M2M: M_a += C(a, g) M'_g s^(a - g)
+				// L2L: L'_g += C(a, g) L_a s^(a - g)
+				if (dx >= 0 && dy >= 0 && dz >= 0) {
+					double c = binomial(ax[a], ax[g]) * binomial(ay[a], ay[g]) * binomial(az[a], az[g]);
+					m2m_table.push_back({ a, g, term(dx, dy, dz), c });
+					l2l_table.push_back({ g, a, term(dx, dy, dz), c });
+				}
+
+				// M2L: L_b -= (-1)^|a| C(a + b, a) M_a T_(a + b)
+				int b = g;
+				int sum = term(ax[a] + ax[b], ay[a] + ay[b], az[a] + az[b]);
+				if (sum >= 0) {
+					double sign = ((ax[a] + ay[a] + az[a]) % 2) ? 1.0 : -1.0;
+					double c = binomial(ax[a] + ax[b], ax[a]) * binomial(ay[a] + ay[b], ay[a]) * binomial(az[a] + az[b], az[a]);
+					m2l_table.push_back({ b, a, sum, sign * c });
+				}
+			}
+		}
+
+		tables_ready = true;
+	}
+
+	// pw[t] = d^t for every multi-index t
+	void powers(double dx, double dy, double dz, double* pw) const {
+		pw[0] = 1;
+		for (int t = 1; t < n_terms; t++) {
+			if (lower[0][t] >= 0)
+				pw[t] = pw[lower[0][t]] * dx;
+			else if (lower[1][t] >= 0)
+				pw[t] = pw[lower[1][t]] * dy;
+			else
+				pw[t] = pw[lower[2][t]] * dz;
+		}
+	}
+
+	// T[t] = D^t(1/r) / t! at r
+	void derivatives(double rx, double ry, double rz, double* T) const {
+		double r2 = rx * rx + ry * ry + rz * rz;
+		T[0] = 1 / std::sqrt(r2);
+		const double r[3] = { rx, ry, rz };
+		for (int t = 1; t < n_terms; t++) {
+			int s = ax[t] + ay[t] + az[t];
+			double v = 0;
+			for (int c = 0; c < 3; c++) {
+				int l = lower[c][t];
+				if (l < 0)
+					continue;
+				v -= (2 * s - 1) * r[c] * T[l];
+				int ll = lower[c][l];
+				if (ll >= 0)
+					v -= (s - 1) * T[ll];
+			}
+			T[t] = v / (s * r2);
+		}
+	}
+
+	void build_tree() {
+		cells.clear();
+		index.resize(n);
+		buffer.resize(n);
+		for (int i = 0; i < n; i++)
+			index[i] = i;
+
+		levels.assign(level, level + n);
+		std::sort(levels.begin(), levels.end());
+		levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+		n_levels = (int)levels.size();
+
+		level_index.resize(n);
+		for (int i = 0; i < n; i++)
+			level_index[i] = (int)(std::lower_bound(levels.begin(), levels.end(), level[i]) - levels.begin());
+
+		vcl::vec3 low = position[0], high = position[0];
+		for (int i = 1; i < n; i++) {
+			for (int c = 0; c < 3; c++) {
+				low[c] = std::min(low[c], position[i][c]);
+				high[c] = std::max(high[c], position[i][c]);
+			}
+		}
+		float half = 0.5f * std::max(high.x - low.x, std::max(high.y - low.y, high.z - low.z));
+		half = half * 1.001f + 1e-6f;
+
+		build_cell(0, n, 0.5f * (low + high), half, 0);
+	}
+
+	int build_cell(int begin, int end, vcl::vec3 center, float half, int depth) {
+		int id = (int)cells.size();
+		cells.push_back(Cell());
+		cells[id].first = begin;
+		cells[id].count = end - begin;
+		for (int c = 0; c < 8; c++)
+			cells[id].child[c] = -1;
+		cells[id].leaf = end - begin <= leaf_size || depth >= 63;
+
+		// Expansion center and radius from the objects themselves, tighter than the octree cube
+		vcl::vec3 low = position[index[begin]], high = low;
+		for (int b = begin + 1; b < end; b++) {
+			for (int c = 0; c < 3; c++) {
+				low[c] = std::min(low[c], position[index[b]][c]);
+				high[c] = std::max(high[c], position[index[b]][c]);
+			}
+		}
+		vcl::vec3 box_center = 0.5f * (low + high);
+		float radius = 0;
+		for (int b = begin; b < end; b++)
+			radius = std::max(radius, vcl::norm(position[index[b]] - box_center));
+		cells[id].center = box_center;
+		cells[id].radius = radius;
+
+		if (cells[id].leaf)
+			return id;
+
+		int count[8] = { 0 };
+		for (int b = begin; b < end; b++)
+			count[octant(position[index[b]], center)]++;
+
+		int start[9];
+		start[0] = begin;
+		for (int c = 0; c < 8; c++)
+			start[c + 1] = start[c] + count[c];
+
+		int fill[8];
+		std::copy(start, start + 8, fill);
+		for (int b = begin; b < end; b++) {
+			int j = index[b];
+			buffer[fill[octant(position[j], center)]++] = j;
+		}
+		std::copy(buffer.begin() + begin, buffer.begin() + end, index.begin() + begin);
+
+		float h = 0.5f * half;
+		for (int c = 0; c < 8; c++) {
+			int child = -1;
+			if (count[c] > 0) {
+				vcl::vec3 child_center = center + vcl::vec3((c & 1) ? h : -h, (c & 2) ? h : -h, (c & 4) ? h : -h);
+				child = build_cell(start[c], start[c + 1], child_center, h, depth + 1);
+			}
+			cells[id].child[c] = child;
+		}
+		return id;
+	}
+
+	static int octant(const vcl::vec3& p, const vcl::vec3& center) {
+		return (p.x > center.x ? 1 : 0) | (p.y > center.y ? 2 : 0) | (p.z > center.z ? 4 : 0);
+	}
+
+	bool attracts(int from, int to) const {
+		return from != excluded && (level[from] > level[to] || (level[from] == level[to] && similar[from]));
+	}
+
+	double* moments(int cell, int k) { return &multipole[((size_t)cell * n_levels + k) * n_terms]; }
+	double* expansion(int cell, int k) { return &local[((size_t)cell * n_levels + k) * n_terms]; }
+
+	// P2M at the leaves, M2M above
+	void upward(int id) {
+		if (id == 0)
+			multipole.assign(cells.size() * n_levels * n_terms, 0.0);
+
+		const Cell& cell = cells[id];
+		std::vector<double> pw(n_terms);
+
+		if (cell.leaf) {
+			for (int b = cell.first; b < cell.first + cell.count; b++) {
+				int j = index[b];
+				if (j == excluded)
+					continue;
+				vcl::vec3 d = position[j] - cell.center;
+				powers(d.x, d.y, d.z, pw.data());
+
+				// Attracts every lower level, and its own level if it attracts similar objects
+				int last = similar[j] ? level_index[j] : level_index[j] - 1;
+				for (int k = 0; k <= last; k++) {
+					double* M = moments(id, k);
+					for (int t = 0; t < n_terms; t++)
+						M[t] += mass[j] * pw[t];
+				}
+			}
+			return;
+		}
+
+		for (int c = 0; c < 8; c++) {
+			int child = cell.child[c];
+			if (child < 0)
+				continue;
+			upward(child);
+
+			vcl::vec3 s = cells[child].center - cells[id].center;
+			powers(s.x, s.y, s.z, pw.data());
+			for (int k = 0; k < n_levels; k++) {
+				double* M = moments(id, k);
+				const double* Mc = moments(child, k);
+				for (const Product& p : m2m_table)
+					M[p.a] += p.coefficient * Mc[p.b] * pw[p.c];
+			}
+		}
+	}
+
+	// Dual tree walk. A cell interacts with itself through its children, and leaves with themselves directly
+	void walk(int target, int source) {
+		const Cell& T = cells[target];
+		const Cell& S = cells[source];
+
+		if (target != source) {
+			float d = vcl::norm(T.center - S.center);
+			if (T.radius + S.radius < theta * d) {
+				far_pairs.push_back({ target, source });
+				return;
+			}
+		}
+
+		if (T.leaf && S.leaf) {
+			near_pairs.push_back({ target, source });
+			return;
+		}
+
+		// Split the larger cell (the only one that can be split if the other is a leaf)
+		if (S.leaf || (!T.leaf && T.radius >= S.radius)) {
+			for (int c = 0; c < 8; c++)
+				if (cells[target].child[c] >= 0)
+					walk(cells[target].child[c], source);
+		}
+		else {
+			for (int c = 0; c < 8; c++)
+				if (cells[source].child[c] >= 0)
+					walk(target, cells[source].child[c]);
+		}
+	}
+
+	// Counting sort of the pairs by target, keeping the walk order within a target
+	void group(const std::vector<Pair>& pairs, std::vector<int>& start, std::vector<int>& sorted) const {
+		start.assign(cells.size() + 1, 0);
+		for (const Pair& p : pairs)
+			start[p.target + 1]++;
+		for (size_t c = 0; c < cells.size(); c++)
+			start[c + 1] += start[c];
+		std::vector<int> fill(start.begin(), start.end() - 1);
+		sorted.resize(pairs.size());
+		for (const Pair& p : pairs)
+			sorted[fill[p.target]++] = p.source;
+	}
+
+	void m2l(int source, int target, std::vector<double>& T) {
+		vcl::vec3 r = cells[target].center - cells[source].center;
+		derivatives(r.x, r.y, r.z, T.data());
+		for (int k = 0; k < n_levels; k++) {
+			const double* M = moments(source, k);
+			if (M[0] == 0)
+				continue;
+			double* L = expansion(target, k);
+			for (const Product& p : m2l_table)
+				L[p.a] += p.coefficient * M[p.b] * T[p.c];
+		}
+	}
+
+	void downward(int id) {
+		const Cell& cell = cells[id];
+		if (cell.leaf)
+			return;
+
+		std::vector<double> pw(n_terms);
+		for (int c = 0; c < 8; c++) {
+			int child = cell.child[c];
+			if (child < 0)
+				continue;
+
+			vcl::vec3 s = cells[child].center - cells[id].center;
+			powers(s.x, s.y, s.z, pw.data());
+			for (int k = 0; k < n_levels; k++) {
+				const double* L = expansion(id, k);
+				double* Lc = expansion(child, k);
+				for (const Product& p : l2l_table)
+					Lc[p.a] += p.coefficient * L[p.b] * pw[p.c];
+			}
+			downward(child);
+		}
+	}
+
+	// Evaluates the local expansion (potential and minus its gradient) at the objects of a leaf
+	void l2p(int id, vcl::vec3* field, double* potential) {
+		const Cell& cell = cells[id];
+		std::vector<double> pw(n_terms);
+
+		for (int b = cell.first; b < cell.first + cell.count; b++) {
+			int i = index[b];
+			vcl::vec3 e = position[i] - cell.center;
+			powers(e.x, e.y, e.z, pw.data());
+
+			const double* L = expansion(id, level_index[i]);
+			double phi = 0, g[3] = { 0, 0, 0 };
+			for (int t = 0; t < n_terms; t++) {
+				phi += L[t] * pw[t];
+				const int a[3] = { ax[t], ay[t], az[t] };
+				for (int c = 0; c < 3; c++)
+					if (a[c] > 0)
+						g[c] += a[c] * L[t] * pw[lower[c][t]];
+			}
+
+			potential[i] += phi;
+			field[i] += vcl::vec3(float(-g[0]), float(-g[1]), float(-g[2]));
+		}
+	}
+
+	void p2p(int target, int source, vcl::vec3* field, double* potential) {
+		const Cell& T = cells[target];
+		const Cell& S = cells[source];
+
+		for (int b = T.first; b < T.first + T.count; b++) {
+			int i = index[b];
+			double gx = 0, gy = 0, gz = 0, phi = 0;
+			for (int c = S.first; c < S.first + S.count; c++) {
+				int j = index[c];
+				if (j == i || !attracts(j, i))
+					continue;
+				vcl::vec3 d = position[j] - position[i];
+				double r2 = vcl::dot(d, d);
+				if (r2 == 0)
+					throw std::runtime_error("Two objects have the same position == BOOM...");
+				double r = std::sqrt(r2);
+				double f = mass[j] / (r2 * r);
+				gx += f * d.x;
+				gy += f * d.y;
+				gz += f * d.z;
+				phi -= mass[j] / r;
+			}
+			field[i] += vcl::vec3(float(gx), float(gy), float(gz));
+			potential[i] += phi;
+		}
+	}
+};
+
+#endif // FMM_H
@@ -0,0 +1,184 @@
+#ifndef FORCE_LAW_H
+#define FORCE_LAW_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+
+/* Force laws as policies of the pair loops below, so that every combination is compiled (and inlined) on its own
+*
+* A pair law gives the acceleration of object i due to object j divided by the separation p_j - p_i (negative for a repulsion),
+* and the energy of the pair. T is the scalar type of the loop (see Precision_core.h).
+* A particle law acts on one object alone: an acceleration, and a drift that is added to its speed when it moves.
+*/
+
+// Gravity. The acceleration does not depend on the mass of the target, so massless objects are fine
+struct Newtonian_law {
+	double G;
+
+	static const bool singular = true; // Objects at the same position are an error
+
+	template <typename T>
+	bool in_range(T) const { return true; }
+
+	template <typename T>
+	T acceleration(T r2, T, T mj) const {
+		T ri = T(1) / std::sqrt(r2);
+		return T(G) * mj * ri * ri * ri;
+	}
+
+	double potential(double r2, double mi, double mj) const { return -G * mi * mj / std::sqrt(r2); }
+};
+
+// Gravity softened at distances below softening: no singularity, and close encounters do not need tiny steps
+struct Plummer_law {
+	double G;
+	double softening;
+
+	static const bool singular = false;
+
+	template <typename T>
+	bool in_range(T) const { return true; }
+
+	template <typename T>
+	T acceleration(T r2, T, T mj) const {
+		T ri = T(1) / std::sqrt(r2 + T(softening * softening));
+		return T(G) * mj * ri * ri * ri;
+	}
+
+	double potential(double r2, double mi, double mj) const { return -G * mi * mj / std::sqrt(r2 + softening * softening); }
+};
+
+// Force ka / r pushing objects apart below the distance D, divided by the mass of each object (the asteroids of a Belt).
+// Objects at the same position have no direction to be pushed in, and are left alone
+struct Repulsive_law {
+	double ka;
+	double D;
+
+	static const bool singular = false;
+
+	template <typename T>
+	bool in_range(T r2) const { return r2 < T(D * D); }
+
+	template <typename T>
+	T acceleration(T r2, T mi, T) const { return -T(ka) / (mi * r2); }
+
+	double potential(double r2, double, double) const { return r2 < D * D ? -0.5 * ka * std::log(r2 / (D * D)) : 0.0; }
+};
+
+struct No_particle_law {
+	void apply(const vcl::vec3&, const vcl::vec3&, float, vcl::vec3&, vcl::vec3&) const {}
+};
+
+/* Keeps objects on a ring around axis (through the origin)
+*
+* The speed is damped towards the rotation speed of the ring, and the object drifts back to its projection on the ring:
+* weakly (sigma_far) when it is outside the flattened torus of thickness depth, strongly (sigma_near) inside
+*/
+struct Spring_to_ring_law {
+	vcl::vec3 axis; // Normalized
+	float radius;
+	float depth;
+	float sigma_far;
+	float sigma_near;
+	float damping;
+	float rotation_speed;
+	float flattening = 800.0f; // The torus is much thinner along the axis
+
+	void apply(const vcl::vec3& p, const vcl::vec3& v, float m, vcl::vec3& acceleration, vcl::vec3& drift) const {
+		vcl::vec3 in_plane = p - axis * vcl::dot(p, axis);
+		float distance = vcl::norm(in_plane);
+		vcl::vec3 on_ring = in_plane / distance * radius;
+
+		acceleration += -(v - rotation_speed * vcl::normalize(vcl::cross(axis, p))) * damping / m;
+
+		float height = vcl::dot(p - on_ring, axis);
+		float sigma = flattening * height * height + (radius - distance) * (radius - distance) > depth * depth ? sigma_far : sigma_near;
+		drift += -(p - on_ring) * sigma / m;
+	}
+};
+
+
+// Indices [first, last), to use a contiguous block of objects as the sources of a pair loop
+struct Index_range {
+	struct iterator {
+		int k;
+		int operator*() const { return k; }
+		iterator& operator++() { k++; return *this; }
+		bool operator!=(const iterator& other) const { return k != other.k; }
+	};
+
+	int first, last;
+
+	iterator begin() const { return { first }; }
+	iterator end() const { return { std::max(first, last) }; }
+};
+
+// Whether source j is left out for object i. A list may hold i itself and the excluded object, a range of later objects never does
+inline bool left_out(const std::vector<int>&, int j, int i, int excluded) { return j == i || j == excluded; }
+inline bool left_out(const Index_range&, int, int, int) { return false; }
+
+/* The pair loop shared by law_field and law_pairs: f(j, d, r2) for every j of sources that acts on object i under law,
+* with d = p_j - p_i. i, excluded and objects at the same position as i (an error if the law is singular) are skipped.
+* The skip test is chosen by the type of sources, so that the pairs of law_pairs do not pay for it
+*/
+template <typename Law, typename Sources, typename F>
+inline void for_each_law_pair(const Law& law, const vcl::vec3* position, int i, const Sources& sources, int excluded, F f) {
+	for (int j : sources) {
+		if (left_out(sources, j, i, excluded))
+			continue;
+
+		vcl::vec3 d = position[j] - position[i];
+		float r2 = vcl::dot(d, d);
+		if (r2 == 0 && Law::singular)
+			throw std::runtime_error("Two objects have the same position == BOOM...");
+		if (r2 == 0 || !law.in_range(r2))
+			continue;
+
+		f(j, d, r2);
+	}
+}
+
+// Acceleration and potential (if not null) of object i due to sources (indices, i and excluded are skipped), one side only
+template <typename Law>
+inline vcl::vec3 law_field(const Law& law, const vcl::vec3* position, const float* mass, const std::vector<int>& sources, int i, int excluded, double* potential) {
+	vcl::vec3 acc;
+	double pot = 0;
+
+	for_each_law_pair(law, position, i, sources, excluded, [&](int j, const vcl::vec3& d, float r2) {
+		acc += law.acceleration(r2, mass[i], mass[j]) * d;
+		if (potential)
+			pot += law.potential(r2, mass[i], mass[j]);
+	});
+
+	if (potential)
+		*potential = pot;
+	return acc;
+}
+
+/* All pairs of the n objects, each pair once, plus the particle law on every object. Both laws must be symmetric in the pairs (no attraction levels).
+* acceleration and drift are overwritten.
+*/
+template <typename Pair_law, typename Particle_law>
+inline void law_pairs(const Pair_law& pair, const Particle_law& particle, const vcl::vec3* position, const vcl::vec3* speed, const float* mass, int n, vcl::vec3* acceleration, vcl::vec3* drift) {
+	for (int i = 0; i < n; i++) {
+		acceleration[i] = vcl::vec3();
+		drift[i] = vcl::vec3();
+	}
+
+	for (int i = 0; i < n; i++) {
+		vcl::vec3 acc;
+		for_each_law_pair(pair, position, i, Index_range{ i + 1, n }, -1, [&](int j, const vcl::vec3& d, float r2) {
+			acc += pair.acceleration(r2, mass[i], mass[j]) * d;
+			acceleration[j] -= pair.acceleration(r2, mass[j], mass[i]) * d;
+		});
+		acceleration[i] += acc;
+
+		particle.apply(position[i], speed[i], mass[i], acceleration[i], drift[i]);
+	}
+}
+
+#endif // FORCE_LAW_H
@@ -0,0 +1,397 @@
+#ifndef GRAVITY_KERNEL_H
+#define GRAVITY_KERNEL_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <cmath>
+#include <climits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GRAVITY_KERNEL_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit AVX instructions in functions marked for them. MSVC does not need it
+#if defined(GRAVITY_KERNEL_X86) && (defined(__GNUC__) || defined(__clang__))
+#define GRAVITY_TARGET(t) __attribute__((target(t)))
+#else
+#define GRAVITY_TARGET(t)
+#endif
+
+
+/* Vectorized all-pairs gravity: the field felt by one target from every source, 4 (SSE), 8 (AVX2) or 16 (AVX-512) sources at a time
+*
+* 1/r comes from the hardware rsqrt estimate refined by one Newton iteration (about 23 correct bits, like a float division).
+* The attraction rule is folded into a single integer comparison turned into a lane mask: source j attracts a target of level L
+* if rank[j] > 2L, with rank = 2 * attraction_level + attracts_similar.
+* Sources at distance 0 (the target itself) are masked out as well.
+*
+* Results are computed without G.
+*/
+
+enum class simd_level { SCALAR, SSE, AVX2, AVX512 };
+
+// Sources as separate coordinate arrays, padded to a multiple of 16 with masked entries
+struct Gravity_sources {
+
+	std::vector<float> x, y, z, m;
+	std::vector<int> rank;
+	int n = 0;
+	int padded = 0;
+
+	// The object at index excluded (-1 for none) is masked out
+	void pack(const vcl::vec3* position, const float* mass, const int* level, const char* similar, int n_, int excluded) {
+		resize(n_);
+		for (int j = 0; j < n; j++)
+			set(j, position, mass, level, similar, j, excluded);
+	}
+
+	// Only the objects of members
+	void pack(const vcl::vec3* position, const float* mass, const int* level, const char* similar, const std::vector<int>& members, int excluded) {
+		resize((int)members.size());
+		for (int k = 0; k < n; k++)
+			set(k, position, mass, level, similar, members[k], excluded);
+	}
+
+private:
+
+	void resize(int n_) {
+		n = n_;
+		padded = (n + 15) / 16 * 16;
+
+		x.assign(padded, 0.0f);
+		y.assign(padded, 0.0f);
+		z.assign(padded, 0.0f);
+		m.assign(padded, 0.0f);
+		rank.assign(padded, INT_MIN);
+	}
+
+	void set(int k, const vcl::vec3* position, const float* mass, const int* level, const char* similar, int j, int excluded) {
+		x[k] = position[j].x;
+		y[k] = position[j].y;
+		z[k] = position[j].z;
+		m[k] = mass[j];
+		rank[k] = j == excluded ? INT_MIN : 2 * level[j] + (similar[j] ? 1 : 0);
+	}
+};
+
+// Rank limit of a target of attraction level L
+inline int gravity_rank_limit(int level) {
+	return 2 * level;
+}
+
+typedef void (*gravity_field_fn)(const Gravity_sources&, const vcl::vec3&, int, vcl::vec3&, double&);
+
+
+inline void gravity_field_scalar(const Gravity_sources& s, const vcl::vec3& p, int limit, vcl::vec3& acc, double& potential) {
+	double ax = 0, ay = 0, az = 0, pot = 0;
+	for (int j = 0; j < s.n; j++) {
+		if (s.rank[j] <= limit)
+			continue;
+		float dx = s.x[j] - p.x, dy = s.y[j] - p.y, dz = s.z[j] - p.z;
+		float r2 = dx * dx + dy * dy + dz * dz;
+		if (r2 == 0)
+			continue;
+		float ri = 1.0f / std::sqrt(r2);
+		float mri = s.m[j] * ri;
+		float f = mri * ri * ri;
+		ax += f * dx;
+		ay += f * dy;
+		az += f * dz;
+		pot -= mri;
+	}
+	acc = vcl::vec3(float(ax), float(ay), float(az));
+	potential = pot;
+}
+
+#ifdef GRAVITY_KERNEL_X86
+
+GRAVITY_TARGET("sse2")
+inline void gravity_field_sse(const Gravity_sources& s, const vcl::vec3& p, int limit, vcl::vec3& acc, double& potential) {
+	const __m128 px = _mm_set1_ps(p.x), py = _mm_set1_ps(p.y), pz = _mm_set1_ps(p.z);
+	const __m128i lim = _mm_set1_epi32(limit);
+	const __m128 zero = _mm_setzero_ps(), half = _mm_set1_ps(0.5f), three_halves = _mm_set1_ps(1.5f);
+	__m128 ax = zero, ay = zero, az = zero, pot = zero;
+
+	for (int j = 0; j < s.padded; j += 4) {
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(&s.x[j]), px);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(&s.y[j]), py);
+		__m128 dz = _mm_sub_ps(_mm_loadu_ps(&s.z[j]), pz);
+		__m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+		__m128 mask = _mm_and_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)&s.rank[j]), lim)), _mm_cmpgt_ps(r2, zero));
+
+		__m128 ri = _mm_rsqrt_ps(r2);
+		ri = _mm_mul_ps(ri, _mm_sub_ps(three_halves, _mm_mul_ps(_mm_mul_ps(half, r2), _mm_mul_ps(ri, ri))));
+		ri = _mm_and_ps(ri, mask);
+
+		__m128 mri = _mm_mul_ps(_mm_loadu_ps(&s.m[j]), ri);
+		__m128 f = _mm_mul_ps(mri, _mm_mul_ps(ri, ri));
+		ax = _mm_add_ps(ax, _mm_mul_ps(f, dx));
+		ay = _mm_add_ps(ay, _mm_mul_ps(f, dy));
+		az = _mm_add_ps(az, _mm_mul_ps(f, dz));
+		pot = _mm_add_ps(pot, mri);
+	}
+
+	float out[4][4];
+	_mm_storeu_ps(out[0], ax);
+	_mm_storeu_ps(out[1], ay);
+	_mm_storeu_ps(out[2], az);
+	_mm_storeu_ps(out[3], pot);
+	double sum[4] = { 0, 0, 0, 0 };
+	for (int c = 0; c < 4; c++)
+		for (int l = 0; l < 4; l++)
+			sum[c] += out[c][l];
+	acc = vcl::vec3(float(sum[0]), float(sum[1]), float(sum[2]));
+	potential = -sum[3];
+}
+
+GRAVITY_TARGET("avx2,fma")
+inline void gravity_field_avx2(const Gravity_sources& s, const vcl::vec3& p, int limit, vcl::vec3& acc, double& potential) {
+	const __m256 px = _mm256_set1_ps(p.x), py = _mm256_set1_ps(p.y), pz = _mm256_set1_ps(p.z);
+	const __m256i lim = _mm256_set1_epi32(limit);
+	const __m256 zero = _mm256_setzero_ps(), half = _mm256_set1_ps(0.5f), three_halves = _mm256_set1_ps(1.5f);
+	__m256 ax = zero, ay = zero, az = zero, pot = zero;
+
+	for (int j = 0; j < s.padded; j += 8) {
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&s.x[j]), px);
+		__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&s.y[j]), py);
+		__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&s.z[j]), pz);
+		__m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+
+		__m256 mask = _mm256_and_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*)&s.rank[j]), lim)), _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+
+		__m256 ri = _mm256_rsqrt_ps(r2);
+		ri = _mm256_mul_ps(ri, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(ri, ri), three_halves));
+		ri = _mm256_and_ps(ri, mask);
+
+		__m256 mri = _mm256_mul_ps(_mm256_loadu_ps(&s.m[j]), ri);
+		__m256 f = _mm256_mul_ps(mri, _mm256_mul_ps(ri, ri));
+		ax = _mm256_fmadd_ps(f, dx, ax);
+		ay = _mm256_fmadd_ps(f, dy, ay);
+		az = _mm256_fmadd_ps(f, dz, az);
+		pot = _mm256_add_ps(pot, mri);
+	}
+
+	float out[4][8];
+	_mm256_storeu_ps(out[0], ax);
+	_mm256_storeu_ps(out[1], ay);
+	_mm256_storeu_ps(out[2], az);
+	_mm256_storeu_ps(out[3], pot);
+	double sum[4] = { 0, 0, 0, 0 };
+	for (int c = 0; c < 4; c++)
+		for (int l = 0; l < 8; l++)
+			sum[c] += out[c][l];
+	acc = vcl::vec3(float(sum[0]), float(sum[1]), float(sum[2]));
+	potential = -sum[3];
+}
+
+GRAVITY_TARGET("avx512f")
+inline void gravity_field_avx512(const Gravity_sources& s, const vcl::vec3& p, int limit, vcl::vec3& acc, double& potential) {
+	const __m512 px = _mm512_set1_ps(p.x), py = _mm512_set1_ps(p.y), pz = _mm512_set1_ps(p.z);
+	const __m512i lim = _mm512_set1_epi32(limit);
+	const __m512 zero = _mm512_setzero_ps(), half = _mm512_set1_ps(0.5f), three_halves = _mm512_set1_ps(1.5f);
+	__m512 ax = zero, ay = zero, az = zero, pot = zero;
+
+	for (int j = 0; j < s.padded; j += 16) {
+		__m512 dx = _mm512_sub_ps(_mm512_loadu_ps(&s.x[j]), px);
+		__m512 dy = _mm512_sub_ps(_mm512_loadu_ps(&s.y[j]), py);
+		__m512 dz = _mm512_sub_ps(_mm512_loadu_ps(&s.z[j]), pz);
+		__m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+
+		__mmask16 mask = _mm512_cmpgt_epi32_mask(_mm512_loadu_si512(&s.rank[j]), lim) & _mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ);
+
+		__m512 ri = _mm512_maskz_rsqrt14_ps(mask, r2); // Masked lanes are 0 and stay 0
+		ri = _mm512_mul_ps(ri, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(ri, ri), three_halves));
+
+		__m512 mri = _mm512_mul_ps(_mm512_loadu_ps(&s.m[j]), ri);
+		__m512 f = _mm512_mul_ps(mri, _mm512_mul_ps(ri, ri));
+		ax = _mm512_fmadd_ps(f, dx, ax);
+		ay = _mm512_fmadd_ps(f, dy, ay);
+		az = _mm512_fmadd_ps(f, dz, az);
+		pot = _mm512_add_ps(pot, mri);
+	}
+
+	float out[4][16];
+	_mm512_storeu_ps(out[0], ax);
+	_mm512_storeu_ps(out[1], ay);
+	_mm512_storeu_ps(out[2], az);
+	_mm512_storeu_ps(out[3], pot);
+	double sum[4] = { 0, 0, 0, 0 };
+	for (int c = 0; c < 4; c++)
+		for (int l = 0; l < 16; l++)
+			sum[c] += out[c][l];
+	acc = vcl::vec3(float(sum[0]), float(sum[1]), float(sum[2]));
+	potential = -sum[3];
+}
+
+#endif // GRAVITY_KERNEL_X86
+
+
+// Best instruction set supported by the processor (and the OS)
+inline simd_level detect_simd_level() {
+#if defined(GRAVITY_KERNEL_X86) && (defined(__GNUC__) || defined(__clang__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return simd_level::AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return simd_level::AVX2;
+	return simd_level::SSE;
+#elif defined(GRAVITY_KERNEL_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave)
+		return simd_level::SSE;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	bool avx512 = (info[1] & (1 << 16)) != 0;
+	if (avx512 && (xcr0 & 0xe6) == 0xe6)
+		return simd_level::AVX512;
+	if (avx2 && fma && (xcr0 & 0x6) == 0x6)
+		return simd_level::AVX2;
+	return simd_level::SSE;
+#else
+	return simd_level::SCALAR;
+#endif
+}
+
+// Kernel for a given level. Asking for more than the processor supports falls back to what it does support
+inline gravity_field_fn get_gravity_kernel(simd_level level) {
+#ifdef GRAVITY_KERNEL_X86
+	simd_level supported = detect_simd_level();
+	if (level > supported)
+		level = supported;
+	switch (level) {
+	case simd_level::AVX512: return gravity_field_avx512;
+	case simd_level::AVX2: return gravity_field_avx2;
+	case simd_level::SSE: return gravity_field_sse;
+	default: break;
+	}
+#else
+	(void)level;
+#endif
+	return gravity_field_scalar;
+}
+
+
+/* Swarm kernels: the field of a few sources (the massive objects of a restricted problem) on many massless targets.
+*
+* Here the targets are the vectorized dimension: every source is broadcast, and 8 (AVX2) or 16 (AVX-512) targets are done at once.
+* Targets exactly at a source position get nothing from it. Results are computed without G.
+*/
+struct Swarm_sources {
+	std::vector<float> x, y, z, m;
+
+	void clear() { x.clear(); y.clear(); z.clear(); m.clear(); }
+
+	void add(const vcl::vec3& p, float mass) {
+		x.push_back(p.x);
+		y.push_back(p.y);
+		z.push_back(p.z);
+		m.push_back(mass);
+	}
+
+	int size() const { return (int)m.size(); }
+};
+
+typedef void (*gravity_swarm_fn)(const Swarm_sources&, const float*, const float*, const float*, float*, float*, float*, int, int);
+
+inline void gravity_swarm_scalar(const Swarm_sources& s, const float* x, const float* y, const float* z, float* ax, float* ay, float* az, int begin, int end) {
+	for (int i = begin; i < end; i++) {
+		float sx = 0, sy = 0, sz = 0;
+		for (int j = 0; j < s.size(); j++) {
+			float dx = s.x[j] - x[i], dy = s.y[j] - y[i], dz = s.z[j] - z[i];
+			float r2 = dx * dx + dy * dy + dz * dz;
+			if (r2 == 0)
+				continue;
+			float ri = 1.0f / std::sqrt(r2);
+			float f = s.m[j] * ri * ri * ri;
+			sx += f * dx;
+			sy += f * dy;
+			sz += f * dz;
+		}
+		ax[i] = sx;
+		ay[i] = sy;
+		az[i] = sz;
+	}
+}
+
+#ifdef GRAVITY_KERNEL_X86
+
+// Exact division and square root: the targets integrate for a long time, the estimate would bias them
+GRAVITY_TARGET("avx2,fma")
+inline void gravity_swarm_avx2(const Swarm_sources& s, const float* x, const float* y, const float* z, float* ax, float* ay, float* az, int begin, int end) {
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		const __m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+		__m256 sx = zero, sy = zero, sz = zero;
+		for (int j = 0; j < s.size(); j++) {
+			__m256 dx = _mm256_sub_ps(_mm256_set1_ps(s.x[j]), px);
+			__m256 dy = _mm256_sub_ps(_mm256_set1_ps(s.y[j]), py);
+			__m256 dz = _mm256_sub_ps(_mm256_set1_ps(s.z[j]), pz);
+			__m256 r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+			__m256 ri = _mm256_and_ps(_mm256_div_ps(one, _mm256_sqrt_ps(r2)), _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+			__m256 f = _mm256_mul_ps(_mm256_set1_ps(s.m[j]), _mm256_mul_ps(ri, _mm256_mul_ps(ri, ri)));
+			sx = _mm256_fmadd_ps(f, dx, sx);
+			sy = _mm256_fmadd_ps(f, dy, sy);
+			sz = _mm256_fmadd_ps(f, dz, sz);
+		}
+		_mm256_storeu_ps(ax + i, sx);
+		_mm256_storeu_ps(ay + i, sy);
+		_mm256_storeu_ps(az + i, sz);
+	}
+	gravity_swarm_scalar(s, x, y, z, ax, ay, az, i, end);
+}
+
+GRAVITY_TARGET("avx512f")
+inline void gravity_swarm_avx512(const Swarm_sources& s, const float* x, const float* y, const float* z, float* ax, float* ay, float* az, int begin, int end) {
+	const __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f);
+	int i = begin;
+	for (; i + 16 <= end; i += 16) {
+		const __m512 px = _mm512_loadu_ps(x + i), py = _mm512_loadu_ps(y + i), pz = _mm512_loadu_ps(z + i);
+		__m512 sx = zero, sy = zero, sz = zero;
+		for (int j = 0; j < s.size(); j++) {
+			__m512 dx = _mm512_sub_ps(_mm512_set1_ps(s.x[j]), px);
+			__m512 dy = _mm512_sub_ps(_mm512_set1_ps(s.y[j]), py);
+			__m512 dz = _mm512_sub_ps(_mm512_set1_ps(s.z[j]), pz);
+			__m512 r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+			__mmask16 mask = _mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ);
+			__m512 ri = _mm512_maskz_div_ps(mask, one, _mm512_maskz_sqrt_ps(mask, r2));
+			__m512 f = _mm512_mul_ps(_mm512_set1_ps(s.m[j]), _mm512_mul_ps(ri, _mm512_mul_ps(ri, ri)));
+			sx = _mm512_fmadd_ps(f, dx, sx);
+			sy = _mm512_fmadd_ps(f, dy, sy);
+			sz = _mm512_fmadd_ps(f, dz, sz);
+		}
+		_mm512_storeu_ps(ax + i, sx);
+		_mm512_storeu_ps(ay + i, sy);
+		_mm512_storeu_ps(az + i, sz);
+	}
+	gravity_swarm_scalar(s, x, y, z, ax, ay, az, i, end);
+}
+
+#endif // GRAVITY_KERNEL_X86
+
+inline gravity_swarm_fn get_swarm_kernel(simd_level level) {
+#ifdef GRAVITY_KERNEL_X86
+	simd_level supported = detect_simd_level();
+	if (level > supported)
+		level = supported;
+	switch (level) {
+	case simd_level::AVX512: return gravity_swarm_avx512;
+	case simd_level::AVX2: return gravity_swarm_avx2;
+	default: break;
+	}
+#else
+	(void)level;
+#endif
+	return gravity_swarm_scalar;
+}
+
+#endif // GRAVITY_KERNEL_H
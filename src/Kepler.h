@@ -0,0 +1,140 @@
+#ifndef KEPLER_H
+#define KEPLER_H
+
+#include "vcl/vcl.hpp"
+#include <cmath>
+
+
+// Stumpff functions c0(x)..c3(x). Series for small x, closed forms otherwise (x < 0 is the hyperbolic case)
+inline void stumpff(double x, double c[4]) {
+
+	if (std::abs(x) < 1.0) {
+		// c_k(x) = sum over n of (-x)^n / (k + 2n)!
+		for (int k = 0; k < 4; k++) {
+			double term = 1.0;
+			for (int i = 2; i <= k; i++)
+				term /= i;
+			double sum = term;
+			for (int n = 1; n < 12; n++) {
+				term *= -x / ((k + 2 * n - 1) * (k + 2 * n));
+				sum += term;
+			}
+			c[k] = sum;
+		}
+		return;
+	}
+
+	if (x > 0) {
+		double z = std::sqrt(x);
+		c[0] = std::cos(z);
+		c[1] = std::sin(z) / z;
+	}
+	else {
+		double z = std::sqrt(-x);
+		c[0] = std::cosh(z);
+		c[1] = std::sinh(z) / z;
+	}
+	c[2] = (1 - c[0]) / x;
+	c[3] = (1 - c[1]) / x;
+}
+
+
+const double kepler_two_pi = 6.283185307179586; // vcl::pi is a float
+
+// Eccentric anomaly E of an ellipse (0 <= e < 1): E - e sin E = M. Halley iterations from Danby's starter, which converge for every e < 1
+inline double kepler_eccentric_anomaly(double M, double e) {
+
+	const double turns = std::nearbyint(M / kepler_two_pi);
+	M -= turns * kepler_two_pi;
+
+	double E = M + 0.85 * e * ((M > 0) - (M < 0));
+	for (int it = 0; it < 50; it++) {
+		double F = E - e * std::sin(E) - M;
+		double dF = 1 - e * std::cos(E);
+		double ddF = e * std::sin(E);
+
+		double dE = -F / dF;
+		dE = -F / (dF + 0.5 * dE * ddF);
+		E += dE;
+
+		if (std::abs(dE) <= 1e-15)
+			break;
+	}
+	return E + turns * kepler_two_pi;
+}
+
+
+/* Moves (r, v) along the Keplerian orbit around a fixed point of gravitational parameter mu = G*M during dt
+*
+* Uses universal variables (Danby's Gauss f and g functions), so it works for any eccentricity, including unbound orbits.
+* All computations are done in double precision.
+*/
+inline void kepler_drift(vcl::vec3& r, vcl::vec3& v, double mu, double dt) {
+
+	if (dt == 0 || mu == 0) {
+		r += v * dt;
+		return;
+	}
+
+	const double r0v[3] = { r.x, r.y, r.z };
+	const double v0v[3] = { v.x, v.y, v.z };
+
+	const double r0 = std::sqrt(r0v[0] * r0v[0] + r0v[1] * r0v[1] + r0v[2] * r0v[2]);
+	const double v2 = v0v[0] * v0v[0] + v0v[1] * v0v[1] + v0v[2] * v0v[2];
+	const double eta = r0v[0] * v0v[0] + r0v[1] * v0v[1] + r0v[2] * v0v[2];
+	const double beta = 2 * mu / r0 - v2; // > 0 for bound orbits
+
+	// Whole periods of a bound orbit change nothing
+	if (beta > 0) {
+		double period = kepler_two_pi * mu / std::pow(beta, 1.5);
+		dt = std::fmod(dt, period);
+	}
+
+	double s = dt / r0; // Universal anomaly, first guess
+	double c[4];
+	double G0 = 1, G1 = s, G2 = 0, G3 = 0;
+
+	// Halley iterations on r0 G1 + eta G2 + mu G3 = dt
+	for (int it = 0; it < 50; it++) {
+		stumpff(beta * s * s, c);
+		G0 = c[0];
+		G1 = s * c[1];
+		G2 = s * s * c[2];
+		G3 = s * s * s * c[3];
+
+		double F = r0 * G1 + eta * G2 + mu * G3 - dt;
+		double dF = r0 * G0 + eta * G1 + mu * G2;
+		double ddF = (mu - beta * r0) * G1 + eta * G0;
+
+		double ds = -F / dF;
+		ds = -F / (dF + 0.5 * ds * ddF);
+		s += ds;
+
+		if (std::abs(ds) <= 1e-14 * std::abs(s) + 1e-300)
+			break;
+	}
+
+	stumpff(beta * s * s, c);
+	G0 = c[0];
+	G1 = s * c[1];
+	G2 = s * s * c[2];
+	G3 = s * s * s * c[3];
+
+	const double f = 1 - mu * G2 / r0;
+	const double g = dt - mu * G3;
+
+	double rn[3];
+	for (int k = 0; k < 3; k++)
+		rn[k] = f * r0v[k] + g * v0v[k];
+	const double rr = std::sqrt(rn[0] * rn[0] + rn[1] * rn[1] + rn[2] * rn[2]);
+
+	const double fdot = -mu * G1 / (rr * r0);
+	const double gdot = 1 - mu * G2 / rr;
+
+	for (int k = 0; k < 3; k++) {
+		r[k] = float(rn[k]);
+		v[k] = float(fdot * r0v[k] + gdot * v0v[k]);
+	}
+}
+
+#endif // KEPLER_H
@@ -0,0 +1,673 @@
+#ifndef LAMBERT_H
+#define LAMBERT_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <string>
+#include <functional>
+#include <fstream>
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include "Gravity_kernel.h"
+#include "Kepler.h"
+#include "Thread_pool.h"
+#include "Png_writer.h"
+
+
+/* Lambert's problem: the Keplerian orbit from r1 to r2 in a given time of flight, with any number of full revolutions (Izzo, 2015)
+*
+* With c = |r2 - r1| and s = (|r1| + |r2| + c) / 2, the transfer reduces to lambda = +-sqrt(1 - c / s) (negative when the angle
+* swept is over pi) and the non-dimensional time T = sqrt(2 mu / s^3) tof. The unknown x is found by Householder iterations
+* (fourth order) on T(x) = T from Izzo's starters: x > -1 without revolution, one solution; with M revolutions, -1 < x < 1 and two
+* solutions, the left and the right branch, or none when T is below the minimum for M. T(x) uses Battin's hypergeometric series
+* close to the parabola (|x - 1| < lambert_battin_range), the closed form elsewhere. A solution is kept when T(x) matches T
+* within lambert_tolerance after a fixed number of iterations: a branch that does not exist never converges.
+*
+* Transfers turn around normal: the angle swept from r1 to r2 is measured counterclockwise around it.
+*
+* Porkchop evaluates a grid of departure times by arrival times, and keeps in each cell the delta-v of the cheapest transfer:
+* |v1 - speed of the departure body| + |v2 - speed of the arrival body|. Rows (one arrival time) are shared between threads,
+* and each row goes 4 cells at a time through AVX2 (same algorithm, with polynomial acos, log and exp).
+*/
+
+const int lambert_householder_iterations = 5;
+const double lambert_battin_range = 0.01;
+const int lambert_series_terms = 12;
+const double lambert_tolerance = 1e-9; // On T(x) / T - 1
+const double lambert_pi = kepler_two_pi / 2;
+
+// 2F1(3, 1; 5/2; z), for the small z of Battin's series
+inline double lambert_hypergeometric(double z) {
+	double sum = 1;
+	for (int j = lambert_series_terms - 1; j >= 0; j--)
+		sum = 1 + (3.0 + j) * (1.0 + j) / ((2.5 + j) * (j + 1.0)) * z * sum;
+	return sum;
+}
+
+// Non-dimensional time of flight for x, with M revolutions
+inline double lambert_time(double x, double lambda, int M) {
+	const double E = x * x - 1, rho = std::abs(E);
+	const double z = std::sqrt(1 + lambda * lambda * E);
+	if (std::abs(x - 1) < lambert_battin_range) {
+		const double eta = z - lambda * x;
+		const double S1 = 0.5 * (1 - lambda - x * eta);
+		const double Q = 4.0 / 3 * lambert_hypergeometric(S1);
+		return (eta * eta * eta * Q + 4 * lambda * eta) / 2 + M * lambert_pi / (rho * std::sqrt(rho));
+	}
+	const double y = std::sqrt(rho), g = x * z - lambda * E;
+	const double d = E < 0 ? M * lambert_pi + std::acos(std::max(-1.0, std::min(g, 1.0))) : std::log(y * (z - lambda * x) + g);
+	return (x - lambda * z - d / y) / E;
+}
+
+// First three derivatives of T(x)
+inline void lambert_derivatives(double x, double T, double lambda, double& d1, double& d2, double& d3) {
+	const double l2 = lambda * lambda, l3 = l2 * lambda, umx2 = 1 - x * x;
+	const double y = std::sqrt(1 - l2 * umx2), y2 = y * y, y3 = y2 * y;
+	d1 = (3 * T * x - 2 + 2 * l3 * x / y) / umx2;
+	d2 = (3 * T + 5 * x * d1 + 2 * (1 - l2) * l3 / y3) / umx2;
+	d3 = (7 * x * d2 + 8 * d1 - 6 * (1 - l2) * l2 * l3 * x / (y3 * y2)) / umx2;
+}
+
+// Izzo's starter for M revolutions (the right branch for right, when M > 0)
+inline double lambert_starter(double lambda, double T, int M, bool right) {
+	if (M > 0) {
+		const double ratio = right ? 8 * T / (M * lambert_pi) : (M * lambert_pi + lambert_pi) / (8 * T);
+		const double k = std::pow(ratio, 2.0 / 3);
+		return (k - 1) / (k + 1);
+	}
+	const double T0 = std::acos(lambda) + lambda * std::sqrt(1 - lambda * lambda); // T at x = 0
+	const double T1 = 2.0 / 3 * (1 - lambda * lambda * lambda); // T at x = 1
+	if (T >= T0)
+		return std::pow(T0 / T, 2.0 / 3) - 1;
+	if (T < T1)
+		return 2.5 * T1 * (T1 - T) / (T * (1 - std::pow(lambda, 5))) + 1;
+	return std::pow(T / T0, std::log(2.0) / std::log(T1 / T0)) - 1;
+}
+
+// x of the M revolution transfer (branch as in lambert_starter). False if there is none
+inline bool lambert_solve(double lambda, double T, int M, bool right, double& x) {
+	x = lambert_starter(lambda, T, M, right);
+	for (int it = 0; it < lambert_householder_iterations; it++) {
+		double d1, d2, d3;
+		const double f = lambert_time(x, lambda, M) - T;
+		lambert_derivatives(x, f + T, lambda, d1, d2, d3);
+		x -= f * (d1 * d1 - f * d2 / 2) / (d1 * (d1 * d1 - f * d2) + d3 * f * f / 6);
+	}
+	const bool inside = M > 0 ? std::abs(x) < 1 : x > -1;
+	return inside && std::abs(lambert_time(x, lambda, M) - T) <= lambert_tolerance * T;
+}
+
+// A transfer from r1 to r2 in non-dimensional form, and the directions the speeds are built on
+struct Lambert_geometry {
+	double lambda;
+	double T;
+	double gamma, rho, sigma; // sqrt(mu s / 2), (|r1| - |r2|) / c, sqrt(1 - rho^2)
+	double r1, r2;
+	double ir1[3], ir2[3]; // Radial directions
+	double it1[3], it2[3]; // Tangential directions, in the direction of the transfer
+};
+
+// False when there is no transfer: tof <= 0, r1 and r2 aligned with the center or equal
+inline bool lambert_geometry(const double r1[3], const double r2[3], const double normal[3], double tof, double mu, Lambert_geometry& g) {
+	const double d[3] = { r2[0] - r1[0], r2[1] - r1[1], r2[2] - r1[2] };
+	const double c = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+	g.r1 = std::sqrt(r1[0] * r1[0] + r1[1] * r1[1] + r1[2] * r1[2]);
+	g.r2 = std::sqrt(r2[0] * r2[0] + r2[1] * r2[1] + r2[2] * r2[2]);
+	if (!(tof > 0) || !(c > 0) || !(g.r1 > 0) || !(g.r2 > 0))
+		return false;
+	const double s = (g.r1 + g.r2 + c) / 2;
+
+	for (int k = 0; k < 3; k++) {
+		g.ir1[k] = r1[k] / g.r1;
+		g.ir2[k] = r2[k] / g.r2;
+	}
+	double h[3] = { g.ir1[1] * g.ir2[2] - g.ir1[2] * g.ir2[1], g.ir1[2] * g.ir2[0] - g.ir1[0] * g.ir2[2], g.ir1[0] * g.ir2[1] - g.ir1[1] * g.ir2[0] };
+	const double hn = std::sqrt(h[0] * h[0] + h[1] * h[1] + h[2] * h[2]);
+	if (!(hn > 1e-12))
+		return false;
+	const double sign = h[0] * normal[0] + h[1] * normal[1] + h[2] * normal[2] >= 0 ? 1 : -1;
+	for (int k = 0; k < 3; k++)
+		h[k] *= sign / hn;
+	for (int k = 0; k < 3; k++) {
+		g.it1[k] = h[(k + 1) % 3] * g.ir1[(k + 2) % 3] - h[(k + 2) % 3] * g.ir1[(k + 1) % 3];
+		g.it2[k] = h[(k + 1) % 3] * g.ir2[(k + 2) % 3] - h[(k + 2) % 3] * g.ir2[(k + 1) % 3];
+	}
+
+	g.lambda = sign * std::sqrt(std::max(0.0, 1 - c / s));
+	g.T = std::sqrt(2 * mu / (s * s * s)) * tof;
+	g.gamma = std::sqrt(mu * s / 2);
+	g.rho = (g.r1 - g.r2) / c;
+	g.sigma = std::sqrt(std::max(0.0, 1 - g.rho * g.rho));
+	return true;
+}
+
+// Speeds at both ends of the transfer of parameter x
+inline void lambert_speeds(const Lambert_geometry& g, double x, double v1[3], double v2[3]) {
+	const double l = g.lambda;
+	const double y = std::sqrt(1 - l * l + l * l * x * x);
+	const double vr1 = g.gamma * ((l * y - x) - g.rho * (l * y + x)) / g.r1;
+	const double vr2 = -g.gamma * ((l * y - x) + g.rho * (l * y + x)) / g.r2;
+	const double vt = g.gamma * g.sigma * (y + l * x);
+	for (int k = 0; k < 3; k++) {
+		v1[k] = vr1 * g.ir1[k] + vt / g.r1 * g.it1[k];
+		v2[k] = vr2 * g.ir2[k] + vt / g.r2 * g.it2[k];
+	}
+}
+
+struct Lambert_solution {
+	int revolutions;
+	bool right_branch; // With revolutions: the solution reached from Izzo's right starter
+	vcl::vec3 v1, v2; // At departure and arrival
+};
+
+// Every transfer from r1 to r2 in tof around mu, with up to max_revolutions full turns, turning around normal
+inline std::vector<Lambert_solution> lambert(vcl::vec3 r1, vcl::vec3 r2, double tof, double mu, vcl::vec3 normal, int max_revolutions = 0) {
+	const double p1[3] = { r1.x, r1.y, r1.z }, p2[3] = { r2.x, r2.y, r2.z }, n[3] = { normal.x, normal.y, normal.z };
+	std::vector<Lambert_solution> solutions;
+	Lambert_geometry g;
+	if (!lambert_geometry(p1, p2, n, tof, mu, g))
+		return solutions;
+
+	for (int M = 0; M <= max_revolutions; M++)
+		for (int branch = 0; branch < (M > 0 ? 2 : 1); branch++) {
+			double x, v1[3], v2[3];
+			if (!lambert_solve(g.lambda, g.T, M, branch == 1, x))
+				continue;
+			lambert_speeds(g, x, v1, v2);
+			solutions.push_back({ M, branch == 1, vcl::vec3(float(v1[0]), float(v1[1]), float(v1[2])), vcl::vec3(float(v2[0]), float(v2[1]), float(v2[2])) });
+		}
+	return solutions;
+}
+
+
+// States of the departure body along a porkchop row, column by column
+struct Lambert_departures {
+	std::vector<double> t;
+	std::vector<double> x, y, z;
+	std::vector<double> vx, vy, vz;
+};
+
+// State of the arrival body for a porkchop row
+struct Lambert_arrival {
+	double t;
+	double r[3];
+	double v[3];
+};
+
+/* delta_v[i] for the departures i in [begin, end): delta-v of the cheapest transfer with up to max_revolutions, NaN if none.
+* Transfers turn like the departure body (around r x v)
+*/
+typedef void (*lambert_row_fn)(const Lambert_departures& d, const Lambert_arrival& a, double mu, int max_revolutions, float* delta_v, int begin, int end);
+
+inline void lambert_row_scalar(const Lambert_departures& d, const Lambert_arrival& a, double mu, int max_revolutions, float* delta_v, int begin, int end) {
+	for (int i = begin; i < end; i++) {
+		const double r1[3] = { d.x[i], d.y[i], d.z[i] }, u1[3] = { d.vx[i], d.vy[i], d.vz[i] };
+		const double normal[3] = { r1[1] * u1[2] - r1[2] * u1[1], r1[2] * u1[0] - r1[0] * u1[2], r1[0] * u1[1] - r1[1] * u1[0] };
+		double best = std::numeric_limits<double>::quiet_NaN();
+
+		Lambert_geometry g;
+		if (lambert_geometry(r1, a.r, normal, a.t - d.t[i], mu, g))
+			for (int M = 0; M <= max_revolutions; M++)
+				for (int branch = 0; branch < (M > 0 ? 2 : 1); branch++) {
+					double x, v1[3], v2[3];
+					if (!lambert_solve(g.lambda, g.T, M, branch == 1, x))
+						continue;
+					lambert_speeds(g, x, v1, v2);
+					double dv1 = 0, dv2 = 0;
+					for (int k = 0; k < 3; k++) {
+						dv1 += (v1[k] - u1[k]) * (v1[k] - u1[k]);
+						dv2 += (v2[k] - a.v[k]) * (v2[k] - a.v[k]);
+					}
+					const double dv = std::sqrt(dv1) + std::sqrt(dv2);
+					if (!(dv >= best))
+						best = dv;
+				}
+		delta_v[i] = float(best);
+	}
+}
+
+#ifdef GRAVITY_KERNEL_X86
+
+// log of 4 positive normal numbers: x = 2^k m with sqrt(1/2) <= m < sqrt(2), log m = 2 atanh((m - 1) / (m + 1)) as a series
+GRAVITY_TARGET("avx2,fma")
+inline __m256d lambert_log_avx2(__m256d x) {
+	const __m256i bits = _mm256_castpd_si256(x);
+	const __m256d two_52 = _mm256_set1_pd(4503599627370496.0);
+	__m256d k = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(two_52))), two_52);
+	k = _mm256_sub_pd(k, _mm256_set1_pd(1023));
+	__m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000fffffffffffffLL)), _mm256_set1_epi64x(0x3ff0000000000000LL)));
+	const __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(1.4142135623730951), _CMP_GT_OQ);
+	m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+	k = _mm256_add_pd(k, _mm256_and_pd(big, _mm256_set1_pd(1.0)));
+
+	const __m256d u = _mm256_div_pd(_mm256_sub_pd(m, _mm256_set1_pd(1.0)), _mm256_add_pd(m, _mm256_set1_pd(1.0)));
+	const __m256d z = _mm256_mul_pd(u, u);
+	__m256d p = _mm256_set1_pd(1.0 / 21);
+	for (int n = 9; n >= 1; n--)
+		p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(1.0 / (2 * n + 1)));
+	const __m256d atanh = _mm256_fmadd_pd(_mm256_mul_pd(u, z), p, u);
+	const __m256d log_m = _mm256_add_pd(atanh, atanh);
+	return _mm256_fmadd_pd(k, _mm256_set1_pd(0.6931471803691238), _mm256_fmadd_pd(k, _mm256_set1_pd(1.9082149292705877e-10), log_m));
+}
+
+// exp of 4 numbers in [-700, 700]: 2^k e^r with |r| <= log(2) / 2, as a series
+GRAVITY_TARGET("avx2,fma")
+inline __m256d lambert_exp_avx2(__m256d x) {
+	x = _mm256_max_pd(_mm256_min_pd(x, _mm256_set1_pd(700.0)), _mm256_set1_pd(-700.0));
+	const __m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(1.4426950408889634)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(0.6931471803691238), x);
+	r = _mm256_fnmadd_pd(k, _mm256_set1_pd(1.9082149292705877e-10), r);
+
+	__m256d p = _mm256_set1_pd(1.0 / 6227020800.0); // 1 / 13!
+	double factorial = 6227020800.0;
+	for (int n = 12; n >= 0; n--) {
+		factorial /= n > 0 ? n + 1 : 1;
+		p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0 / factorial));
+	}
+
+	// 2^k: k + 1023 in the exponent bits (k is read from the low bits of k + 1.5 2^52)
+	const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+	const __m256i ki = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(k, magic)), _mm256_castpd_si256(magic));
+	const __m256d scale = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_add_epi64(ki, _mm256_set1_epi64x(1023)), 52));
+	return _mm256_mul_pd(p, scale);
+}
+
+// acos of 4 numbers in [-1, 1]: from asin of at most 1/2 (directly, or with acos(a) = 2 asin(sqrt((1 - a) / 2)) for a > 1/2)
+GRAVITY_TARGET("avx2,fma")
+inline __m256d lambert_acos_avx2(__m256d x) {
+	// asin(t) = t + t^3 sum of c_n t^(2n - 2), c_n = (2n)! / (4^n n!^2 (2n + 1)): 24 terms for t <= 1/2
+	static const double series[24] = { 0.16666666666666666, 0.075, 0.044642857142857144, 0.030381944444444444,
+		0.022372159090909092, 0.017352764423076924, 0.01396484375, 0.011551800896139705, 0.009761609529194078,
+		0.008390335809616815, 0.0073125258735988454, 0.006447210311889649, 0.005740037670841924, 0.005153309682319905,
+		0.004660143486915096, 0.004240907093679363, 0.003880964558837669, 0.0035692053938259347, 0.003297059503473485,
+		0.0030578216492580306, 0.002846178401108942, 0.00265787063820729, 0.0024894486782468836, 0.002338091892111975 };
+	const __m256d sign_bit = _mm256_set1_pd(-0.0);
+	const __m256d a = _mm256_min_pd(_mm256_andnot_pd(sign_bit, x), _mm256_set1_pd(1.0));
+	const __m256d big = _mm256_cmp_pd(a, _mm256_set1_pd(0.5), _CMP_GT_OQ);
+	const __m256d t = _mm256_blendv_pd(a, _mm256_sqrt_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(1.0), a), _mm256_set1_pd(0.5))), big);
+	const __m256d z = _mm256_mul_pd(t, t);
+	__m256d p = _mm256_set1_pd(series[23]);
+	for (int n = 22; n >= 0; n--)
+		p = _mm256_fmadd_pd(p, z, _mm256_set1_pd(series[n]));
+	const __m256d asin_t = _mm256_fmadd_pd(_mm256_mul_pd(t, z), p, t);
+
+	// a > 1/2: acos(a) = 2 asin(t), acos(-a) = pi - acos(a). Otherwise acos(x) = pi / 2 - asin(x)
+	const __m256d negative = _mm256_and_pd(x, sign_bit);
+	const __m256d acos_a = _mm256_add_pd(asin_t, asin_t);
+	const __m256d far = _mm256_blendv_pd(acos_a, _mm256_sub_pd(_mm256_set1_pd(lambert_pi), acos_a), negative);
+	const __m256d near = _mm256_sub_pd(_mm256_set1_pd(lambert_pi / 2), _mm256_or_pd(asin_t, negative));
+	return _mm256_blendv_pd(near, far, big);
+}
+
+// lambert_time for 4 values of x: the closed form (acos and log branches) and Battin's series are all computed, then selected
+GRAVITY_TARGET("avx2,fma")
+inline __m256d lambert_time_avx2(__m256d x, __m256d lambda, int M) {
+	const __m256d one = _mm256_set1_pd(1.0), sign_bit = _mm256_set1_pd(-0.0);
+	const __m256d E = _mm256_fmsub_pd(x, x, one), rho = _mm256_andnot_pd(sign_bit, E);
+	const __m256d z = _mm256_sqrt_pd(_mm256_fmadd_pd(_mm256_mul_pd(lambda, lambda), E, one));
+	const __m256d turns = _mm256_set1_pd(M * lambert_pi);
+
+	// Battin
+	const __m256d eta = _mm256_fnmadd_pd(lambda, x, z);
+	const __m256d S1 = _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_fnmadd_pd(x, eta, _mm256_sub_pd(one, lambda)));
+	__m256d F = one;
+	for (int j = lambert_series_terms - 1; j >= 0; j--)
+		F = _mm256_fmadd_pd(_mm256_mul_pd(_mm256_set1_pd((3.0 + j) * (1.0 + j) / ((2.5 + j) * (j + 1.0))), S1), F, one);
+	const __m256d Q = _mm256_mul_pd(_mm256_set1_pd(4.0 / 3), F);
+	const __m256d eta3 = _mm256_mul_pd(_mm256_mul_pd(eta, eta), eta);
+	__m256d battin = _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_fmadd_pd(eta3, Q, _mm256_mul_pd(_mm256_set1_pd(4.0), _mm256_mul_pd(lambda, eta))));
+	if (M > 0)
+		battin = _mm256_add_pd(battin, _mm256_div_pd(turns, _mm256_mul_pd(rho, _mm256_sqrt_pd(rho))));
+
+	// Closed form
+	const __m256d y = _mm256_sqrt_pd(rho);
+	const __m256d g = _mm256_fnmadd_pd(lambda, E, _mm256_mul_pd(x, z));
+	const __m256d ellipse = _mm256_add_pd(turns, lambert_acos_avx2(_mm256_max_pd(_mm256_min_pd(g, one), _mm256_set1_pd(-1.0))));
+	const __m256d hyperbola = lambert_log_avx2(_mm256_max_pd(_mm256_fmadd_pd(y, _mm256_fnmadd_pd(lambda, x, z), g), _mm256_set1_pd(1e-300)));
+	const __m256d d = _mm256_blendv_pd(hyperbola, ellipse, _mm256_cmp_pd(E, _mm256_setzero_pd(), _CMP_LT_OQ));
+	const __m256d closed = _mm256_div_pd(_mm256_sub_pd(_mm256_fnmadd_pd(lambda, z, x), _mm256_div_pd(d, y)), E);
+
+	const __m256d near = _mm256_cmp_pd(_mm256_andnot_pd(sign_bit, _mm256_sub_pd(x, one)), _mm256_set1_pd(lambert_battin_range), _CMP_LT_OQ);
+	return _mm256_blendv_pd(closed, battin, near);
+}
+
+// x^y for x > 0
+GRAVITY_TARGET("avx2,fma")
+inline __m256d lambert_pow_avx2(__m256d x, __m256d y) {
+	return lambert_exp_avx2(_mm256_mul_pd(y, lambert_log_avx2(x)));
+}
+
+// lambert_solve for 4 transfers. Returns the mask of those that have a solution
+GRAVITY_TARGET("avx2,fma")
+inline __m256d lambert_solve_avx2(__m256d lambda, __m256d T, int M, bool right, __m256d& x) {
+	const __m256d one = _mm256_set1_pd(1.0), sign_bit = _mm256_set1_pd(-0.0);
+	const __m256d two_thirds = _mm256_set1_pd(2.0 / 3);
+	if (M > 0) {
+		const __m256d ratio = right ? _mm256_div_pd(_mm256_mul_pd(_mm256_set1_pd(8.0), T), _mm256_set1_pd(M * lambert_pi))
+			: _mm256_div_pd(_mm256_set1_pd(M * lambert_pi + lambert_pi), _mm256_mul_pd(_mm256_set1_pd(8.0), T));
+		const __m256d k = lambert_pow_avx2(ratio, two_thirds);
+		x = _mm256_div_pd(_mm256_sub_pd(k, one), _mm256_add_pd(k, one));
+	}
+	else {
+		const __m256d l2 = _mm256_mul_pd(lambda, lambda);
+		const __m256d T0 = _mm256_fmadd_pd(lambda, _mm256_sqrt_pd(_mm256_sub_pd(one, l2)), lambert_acos_avx2(lambda));
+		const __m256d T1 = _mm256_mul_pd(two_thirds, _mm256_fnmadd_pd(l2, lambda, one));
+		const __m256d log_ratio = lambert_log_avx2(_mm256_div_pd(T0, T));
+		const __m256d above = _mm256_sub_pd(lambert_exp_avx2(_mm256_mul_pd(two_thirds, log_ratio)), one);
+		const __m256d l5 = _mm256_mul_pd(_mm256_mul_pd(l2, l2), lambda);
+		const __m256d below = _mm256_fmadd_pd(_mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2.5), T1), _mm256_sub_pd(T1, T)),
+			_mm256_mul_pd(T, _mm256_sub_pd(one, l5))), one, one);
+		const __m256d exponent = _mm256_div_pd(_mm256_set1_pd(0.6931471805599453), lambert_log_avx2(_mm256_div_pd(T1, T0)));
+		const __m256d between = _mm256_sub_pd(lambert_exp_avx2(_mm256_mul_pd(_mm256_sub_pd(_mm256_setzero_pd(), log_ratio), exponent)), one);
+		x = _mm256_blendv_pd(_mm256_blendv_pd(between, below, _mm256_cmp_pd(T, T1, _CMP_LT_OQ)), above, _mm256_cmp_pd(T, T0, _CMP_GE_OQ));
+	}
+
+	const __m256d l2 = _mm256_mul_pd(lambda, lambda), l3 = _mm256_mul_pd(l2, lambda);
+	const __m256d one_minus_l2 = _mm256_sub_pd(one, l2);
+	for (int it = 0; it < lambert_householder_iterations; it++) {
+		const __m256d time = lambert_time_avx2(x, lambda, M);
+		const __m256d f = _mm256_sub_pd(time, T);
+
+		const __m256d umx2 = _mm256_fnmadd_pd(x, x, one);
+		const __m256d y = _mm256_sqrt_pd(_mm256_fnmadd_pd(l2, umx2, one));
+		const __m256d y2 = _mm256_mul_pd(y, y), y3 = _mm256_mul_pd(y2, y);
+		const __m256d d1 = _mm256_div_pd(_mm256_add_pd(_mm256_fmsub_pd(_mm256_mul_pd(_mm256_set1_pd(3.0), time), x, _mm256_set1_pd(2.0)),
+			_mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2.0), l3), x), y)), umx2);
+		const __m256d d2 = _mm256_div_pd(_mm256_add_pd(_mm256_fmadd_pd(_mm256_mul_pd(_mm256_set1_pd(5.0), x), d1, _mm256_mul_pd(_mm256_set1_pd(3.0), time)),
+			_mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2.0), one_minus_l2), l3), y3)), umx2);
+		const __m256d d3 = _mm256_div_pd(_mm256_sub_pd(_mm256_fmadd_pd(_mm256_mul_pd(_mm256_set1_pd(7.0), x), d2, _mm256_mul_pd(_mm256_set1_pd(8.0), d1)),
+			_mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(6.0), one_minus_l2), _mm256_mul_pd(l2, l3)), x), _mm256_mul_pd(y3, y2))), umx2);
+
+		const __m256d d1_2 = _mm256_mul_pd(d1, d1);
+		const __m256d num = _mm256_mul_pd(f, _mm256_fnmadd_pd(_mm256_mul_pd(f, _mm256_set1_pd(0.5)), d2, d1_2));
+		const __m256d den = _mm256_fmadd_pd(_mm256_mul_pd(d3, _mm256_set1_pd(1.0 / 6)), _mm256_mul_pd(f, f), _mm256_mul_pd(d1, _mm256_fnmadd_pd(f, d2, d1_2)));
+		x = _mm256_sub_pd(x, _mm256_div_pd(num, den));
+	}
+
+	const __m256d residual = _mm256_andnot_pd(sign_bit, _mm256_sub_pd(lambert_time_avx2(x, lambda, M), T));
+	const __m256d converged = _mm256_cmp_pd(residual, _mm256_mul_pd(_mm256_set1_pd(lambert_tolerance), T), _CMP_LE_OQ);
+	const __m256d inside = M > 0 ? _mm256_cmp_pd(_mm256_andnot_pd(sign_bit, x), one, _CMP_LT_OQ) : _mm256_cmp_pd(x, _mm256_set1_pd(-1.0), _CMP_GT_OQ);
+	return _mm256_and_pd(converged, inside);
+}
+
+// Dot and cross products of 4 vectors stored as x, y, z
+GRAVITY_TARGET("avx2,fma")
+inline __m256d lambert_dot_avx2(const __m256d* p, const __m256d* q) {
+	return _mm256_fmadd_pd(p[2], q[2], _mm256_fmadd_pd(p[1], q[1], _mm256_mul_pd(p[0], q[0])));
+}
+
+GRAVITY_TARGET("avx2,fma")
+inline void lambert_cross_avx2(const __m256d* p, const __m256d* q, __m256d* out) {
+	out[0] = _mm256_fmsub_pd(p[1], q[2], _mm256_mul_pd(p[2], q[1]));
+	out[1] = _mm256_fmsub_pd(p[2], q[0], _mm256_mul_pd(p[0], q[2]));
+	out[2] = _mm256_fmsub_pd(p[0], q[1], _mm256_mul_pd(p[1], q[0]));
+}
+
+GRAVITY_TARGET("avx2,fma")
+inline void lambert_row_avx2(const Lambert_departures& d, const Lambert_arrival& a, double mu, int max_revolutions, float* delta_v, int begin, int end) {
+	const __m256d one = _mm256_set1_pd(1.0), zero = _mm256_setzero_pd();
+	const __m256d r2[3] = { _mm256_set1_pd(a.r[0]), _mm256_set1_pd(a.r[1]), _mm256_set1_pd(a.r[2]) };
+	const __m256d u2[3] = { _mm256_set1_pd(a.v[0]), _mm256_set1_pd(a.v[1]), _mm256_set1_pd(a.v[2]) };
+	const __m256d r2n = _mm256_set1_pd(std::sqrt(a.r[0] * a.r[0] + a.r[1] * a.r[1] + a.r[2] * a.r[2]));
+
+	int i = begin;
+	for (; i + 4 <= end; i += 4) {
+		const __m256d r1[3] = { _mm256_loadu_pd(&d.x[i]), _mm256_loadu_pd(&d.y[i]), _mm256_loadu_pd(&d.z[i]) };
+		const __m256d u1[3] = { _mm256_loadu_pd(&d.vx[i]), _mm256_loadu_pd(&d.vy[i]), _mm256_loadu_pd(&d.vz[i]) };
+		const __m256d tof = _mm256_sub_pd(_mm256_set1_pd(a.t), _mm256_loadu_pd(&d.t[i]));
+
+		// Geometry, as in lambert_geometry
+		const __m256d dr[3] = { _mm256_sub_pd(r2[0], r1[0]), _mm256_sub_pd(r2[1], r1[1]), _mm256_sub_pd(r2[2], r1[2]) };
+		const __m256d c = _mm256_sqrt_pd(lambert_dot_avx2(dr, dr));
+		const __m256d r1n = _mm256_sqrt_pd(lambert_dot_avx2(r1, r1));
+		const __m256d s = _mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_add_pd(_mm256_add_pd(r1n, r2n), c));
+		__m256d ir1[3], ir2[3], h[3], normal[3], it1[3], it2[3];
+		for (int k = 0; k < 3; k++) {
+			ir1[k] = _mm256_div_pd(r1[k], r1n);
+			ir2[k] = _mm256_div_pd(r2[k], r2n);
+		}
+		lambert_cross_avx2(ir1, ir2, h);
+		lambert_cross_avx2(r1, u1, normal);
+		const __m256d hn = _mm256_sqrt_pd(lambert_dot_avx2(h, h));
+		const __m256d sign = _mm256_blendv_pd(one, _mm256_set1_pd(-1.0), _mm256_cmp_pd(lambert_dot_avx2(h, normal), zero, _CMP_LT_OQ));
+		const __m256d h_scale = _mm256_div_pd(sign, hn);
+		for (int k = 0; k < 3; k++)
+			h[k] = _mm256_mul_pd(h[k], h_scale);
+		lambert_cross_avx2(h, ir1, it1);
+		lambert_cross_avx2(h, ir2, it2);
+
+		const __m256d lambda = _mm256_mul_pd(sign, _mm256_sqrt_pd(_mm256_max_pd(zero, _mm256_sub_pd(one, _mm256_div_pd(c, s)))));
+		const __m256d T = _mm256_mul_pd(_mm256_sqrt_pd(_mm256_div_pd(_mm256_set1_pd(2 * mu), _mm256_mul_pd(_mm256_mul_pd(s, s), s))), tof);
+		const __m256d gamma = _mm256_sqrt_pd(_mm256_mul_pd(_mm256_set1_pd(mu / 2), s));
+		const __m256d rho = _mm256_div_pd(_mm256_sub_pd(r1n, r2n), c);
+		const __m256d sigma = _mm256_sqrt_pd(_mm256_max_pd(zero, _mm256_fnmadd_pd(rho, rho, one)));
+		const __m256d possible = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(tof, zero, _CMP_GT_OQ), _mm256_cmp_pd(c, zero, _CMP_GT_OQ)),
+			_mm256_cmp_pd(hn, _mm256_set1_pd(1e-12), _CMP_GT_OQ));
+
+		__m256d best = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+		for (int M = 0; M <= max_revolutions && _mm256_movemask_pd(possible); M++)
+			for (int branch = 0; branch < (M > 0 ? 2 : 1); branch++) {
+				__m256d x;
+				const __m256d found = _mm256_and_pd(possible, lambert_solve_avx2(lambda, T, M, branch == 1, x));
+				if (!_mm256_movemask_pd(found))
+					continue;
+
+				// Speeds, as in lambert_speeds
+				const __m256d l2 = _mm256_mul_pd(lambda, lambda);
+				const __m256d y = _mm256_sqrt_pd(_mm256_fmadd_pd(_mm256_mul_pd(l2, x), x, _mm256_sub_pd(one, l2)));
+				const __m256d ly_minus_x = _mm256_fmsub_pd(lambda, y, x), ly_plus_x = _mm256_fmadd_pd(lambda, y, x);
+				const __m256d vr1 = _mm256_div_pd(_mm256_mul_pd(gamma, _mm256_fnmadd_pd(rho, ly_plus_x, ly_minus_x)), r1n);
+				const __m256d vr2 = _mm256_div_pd(_mm256_mul_pd(gamma, _mm256_fmadd_pd(rho, ly_plus_x, ly_minus_x)), _mm256_sub_pd(zero, r2n));
+				const __m256d vt = _mm256_mul_pd(_mm256_mul_pd(gamma, sigma), _mm256_fmadd_pd(lambda, x, y));
+				const __m256d vt1 = _mm256_div_pd(vt, r1n), vt2 = _mm256_div_pd(vt, r2n);
+				__m256d dv1[3], dv2[3];
+				for (int k = 0; k < 3; k++) {
+					dv1[k] = _mm256_sub_pd(_mm256_fmadd_pd(vr1, ir1[k], _mm256_mul_pd(vt1, it1[k])), u1[k]);
+					dv2[k] = _mm256_sub_pd(_mm256_fmadd_pd(vr2, ir2[k], _mm256_mul_pd(vt2, it2[k])), u2[k]);
+				}
+				const __m256d dv = _mm256_add_pd(_mm256_sqrt_pd(lambert_dot_avx2(dv1, dv1)), _mm256_sqrt_pd(lambert_dot_avx2(dv2, dv2)));
+				best = _mm256_blendv_pd(best, dv, _mm256_and_pd(found, _mm256_cmp_pd(dv, best, _CMP_LT_OQ)));
+			}
+
+		best = _mm256_blendv_pd(_mm256_set1_pd(std::numeric_limits<double>::quiet_NaN()), best,
+			_mm256_cmp_pd(best, _mm256_set1_pd(std::numeric_limits<double>::infinity()), _CMP_LT_OQ));
+		_mm_storeu_ps(delta_v + i, _mm256_cvtpd_ps(best));
+	}
+	lambert_row_scalar(d, a, mu, max_revolutions, delta_v, i, end);
+}
+
+#endif // GRAVITY_KERNEL_X86
+
+inline lambert_row_fn get_lambert_kernel(simd_level level) {
+#ifdef GRAVITY_KERNEL_X86
+	if (level >= simd_level::AVX2 && detect_simd_level() >= simd_level::AVX2)
+		return lambert_row_avx2;
+#else
+	(void)level;
+#endif
+	return lambert_row_scalar;
+}
+
+
+// A body moving around the attracting center of the transfers, relative to it
+struct Transfer_body {
+	std::function<vcl::vec3(double)> position;
+	std::function<vcl::vec3(double)> speed;
+};
+
+const char porkchop_magic[8] = { 'P', 'O', 'R', 'K', 'C', 'H', 'O', 'P' };
+
+/* File format: this header, then arrivals rows of departures float delta-v (NaN: no transfer), the first row for the first
+* arrival time. The byte order is the one of the machine that wrote the file
+*/
+struct Porkchop_header {
+	char magic[8];
+	uint32_t departures;
+	uint32_t arrivals;
+	double departure_begin, departure_end;
+	double arrival_begin, arrival_end;
+};
+
+/* Delta-v of the cheapest transfer for departure times (columns) by arrival times (rows), both sampled with their ends included.
+* Cells where the arrival is not after the departure are NaN
+*/
+class Porkchop {
+
+public:
+
+	void set_grid(double departure_begin, double departure_end, int departures, double arrival_begin, double arrival_end, int arrivals) {
+		if (departures < 1 || arrivals < 1)
+			throw std::invalid_argument("A porkchop grid needs at least one departure and one arrival.");
+		if (!(departure_end >= departure_begin) || !(arrival_end >= arrival_begin))
+			throw std::invalid_argument("The ends of the porkchop grid must come after their beginnings.");
+		header.departures = (uint32_t)departures;
+		header.arrivals = (uint32_t)arrivals;
+		header.departure_begin = departure_begin;
+		header.departure_end = departure_end;
+		header.arrival_begin = arrival_begin;
+		header.arrival_end = arrival_end;
+		delta_v.assign((size_t)departures * arrivals, std::numeric_limits<float>::quiet_NaN());
+	}
+
+	int get_departure_count() const { return (int)header.departures; }
+	int get_arrival_count() const { return (int)header.arrivals; }
+
+	double departure_time(int i) const {
+		return header.departures > 1 ? header.departure_begin + (header.departure_end - header.departure_begin) * i / (header.departures - 1) : header.departure_begin;
+	}
+	double arrival_time(int j) const {
+		return header.arrivals > 1 ? header.arrival_begin + (header.arrival_end - header.arrival_begin) * j / (header.arrivals - 1) : header.arrival_begin;
+	}
+
+	float at(int departure, int arrival) const { return delta_v[(size_t)arrival * header.departures + departure]; }
+	const std::vector<float>& get_delta_v() const { return delta_v; }
+
+	void set_simd_level(simd_level s) { kernel = get_lambert_kernel(s); }
+
+	// Transfers from one body to the other around a center of gravitational parameter mu, with up to max_revolutions full turns. pool may be nullptr
+	void compute(const Transfer_body& from, const Transfer_body& to, double mu, int max_revolutions, Thread_pool* pool) {
+		if (delta_v.empty())
+			throw std::logic_error("Set the grid of the porkchop first.");
+		if (kernel == nullptr)
+			kernel = get_lambert_kernel(detect_simd_level());
+
+		const int n = get_departure_count(), m = get_arrival_count();
+		Lambert_departures d;
+		for (std::vector<double>* column : { &d.t, &d.x, &d.y, &d.z, &d.vx, &d.vy, &d.vz })
+			column->resize(n);
+		for (int i = 0; i < n; i++) {
+			d.t[i] = departure_time(i);
+			const vcl::vec3 p = from.position(d.t[i]), v = from.speed(d.t[i]);
+			d.x[i] = p.x;
+			d.y[i] = p.y;
+			d.z[i] = p.z;
+			d.vx[i] = v.x;
+			d.vy[i] = v.y;
+			d.vz[i] = v.z;
+		}
+		std::vector<Lambert_arrival> arrivals(m);
+		for (int j = 0; j < m; j++) {
+			Lambert_arrival& a = arrivals[j];
+			a.t = arrival_time(j);
+			const vcl::vec3 p = to.position(a.t), v = to.speed(a.t);
+			for (int k = 0; k < 3; k++) {
+				a.r[k] = p[k];
+				a.v[k] = v[k];
+			}
+		}
+
+		const lambert_row_fn row = kernel;
+		auto rows = [&](int first, int last) {
+			for (int j = first; j < last; j++)
+				row(d, arrivals[j], mu, max_revolutions, &delta_v[(size_t)j * n], 0, n);
+		};
+		if (pool)
+			pool->parallel_for(m, rows);
+		else
+			rows(0, m);
+	}
+
+	// Cheapest cell, -1 for both if there is no transfer
+	void minimum(int& departure, int& arrival) const {
+		departure = arrival = -1;
+		float best = std::numeric_limits<float>::infinity();
+		for (size_t k = 0; k < delta_v.size(); k++)
+			if (delta_v[k] < best) {
+				best = delta_v[k];
+				departure = int(k % header.departures);
+				arrival = int(k / header.departures);
+			}
+	}
+
+	void save(const std::string& path) const {
+		std::ofstream file(path, std::ios::binary);
+		if (!file)
+			throw std::runtime_error("Cannot open porkchop file " + path);
+		Porkchop_header h = header;
+		std::memcpy(h.magic, porkchop_magic, sizeof(porkchop_magic));
+		file.write(reinterpret_cast<const char*>(&h), sizeof(h));
+		file.write(reinterpret_cast<const char*>(delta_v.data()), (std::streamsize)(delta_v.size() * sizeof(float)));
+		if (!file)
+			throw std::runtime_error("Cannot write porkchop file " + path);
+	}
+
+	static Porkchop load(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+			throw std::runtime_error("Cannot open porkchop file " + path);
+		Porkchop p;
+		file.read(reinterpret_cast<char*>(&p.header), sizeof(p.header));
+		if (!file || std::memcmp(p.header.magic, porkchop_magic, sizeof(porkchop_magic)) != 0)
+			throw std::runtime_error("Not a porkchop file: " + path);
+		p.delta_v.resize((size_t)p.header.departures * p.header.arrivals);
+		file.read(reinterpret_cast<char*>(p.delta_v.data()), (std::streamsize)(p.delta_v.size() * sizeof(float)));
+		if (!file)
+			throw std::runtime_error("Truncated porkchop file: " + path);
+		return p;
+	}
+
+	/* One pixel per cell, departures to the right and arrivals upwards. Delta-v from the minimum (blue) to max_delta_v (red),
+	* darker lines every contour_step (0: none), black where there is no transfer or above max_delta_v
+	*/
+	void save_png(const std::string& path, float max_delta_v, float contour_step = 0) const {
+		const int w = get_departure_count(), h = get_arrival_count();
+		float low = std::numeric_limits<float>::infinity();
+		for (float v : delta_v)
+			low = std::min(low, v);
+		std::vector<unsigned char> rgb((size_t)3 * w * h, 0);
+
+		for (int j = 0; j < h; j++)
+			for (int i = 0; i < w; i++) {
+				const float v = at(i, j);
+				if (!(v <= max_delta_v))
+					continue;
+				const float u = max_delta_v > low ? (v - low) / (max_delta_v - low) : 0;
+				// Blue, cyan, green, yellow, red
+				const float stops[5][3] = { { 0.1f, 0.2f, 0.9f }, { 0.1f, 0.8f, 0.9f }, { 0.2f, 0.8f, 0.2f }, { 0.95f, 0.9f, 0.1f }, { 0.9f, 0.1f, 0.1f } };
+				const int s = std::min(3, int(u * 4));
+				const float f = u * 4 - s;
+				float shade = 1;
+				if (contour_step > 0) {
+					const float right = i + 1 < w ? at(i + 1, j) : v, up = j + 1 < h ? at(i, j + 1) : v;
+					if (std::floor(v / contour_step) != std::floor(right / contour_step) || std::floor(v / contour_step) != std::floor(up / contour_step))
+						shade = 0.45f;
+				}
+				unsigned char* px = &rgb[((size_t)(h - 1 - j) * w + i) * 3];
+				for (int k = 0; k < 3; k++)
+					px[k] = (unsigned char)(255 * shade * (stops[s][k] + f * (stops[s + 1][k] - stops[s][k])));
+			}
+		png_write_rgb(path, w, h, rgb.data());
+	}
+
+private:
+
+	Porkchop_header header = {};
+	std::vector<float> delta_v;
+	lambert_row_fn kernel = nullptr;
+};
+
+#endif // LAMBERT_H
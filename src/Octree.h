@@ -0,0 +1,270 @@
+#ifndef OCTREE_H
+#define OCTREE_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+
+/* Barnes-Hut octree used by the Simulator to approximate the gravity field in O(N log N)
+*
+* The tree is rebuilt from scratch at every step: bodies are sorted into octants by partitioning an index array, so every node covers a contiguous range of it.
+* A node far enough from a body (node size / distance < theta) is replaced by its center of mass.
+*
+* attraction_level makes gravity asymmetric, so a single center of mass per node is not enough.
+* Each node stores one aggregate per attraction level k: the mass (and center of mass) of everything in the node that attracts a body of level k,
+* i.e. bodies of a higher level, plus bodies of level k that attract similar objects.
+*
+* Values are computed without G (the caller scales them).
+*/
+
+class Octree {
+
+public:
+
+	float theta = 0.5f; // Opening angle. 0 is an exact (and slow) all-pairs sum
+	int leaf_size = 8; // Maximum number of bodies in a leaf
+
+	// The arrays must stay valid (and unchanged) until the next build
+	void build(const vcl::vec3* position_, const float* mass_, const int* level_, const char* similar_, int n_) {
+		position = position_;
+		mass = mass_;
+		level = level_;
+		similar = similar_;
+		n = n_;
+
+		nodes.clear();
+		index.resize(n);
+		buffer.resize(n);
+		for (int i = 0; i < n; i++)
+			index[i] = i;
+
+		// Levels are remapped to 0..n_levels-1
+		levels.assign(level, level + n);
+		std::sort(levels.begin(), levels.end());
+		levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+		n_levels = (int)levels.size();
+
+		level_index.resize(n);
+		for (int i = 0; i < n; i++)
+			level_index[i] = (int)(std::lower_bound(levels.begin(), levels.end(), level[i]) - levels.begin());
+
+		agg_mass.clear();
+		agg_com.clear();
+
+		if (n == 0)
+			return;
+
+		// Bounding cube
+		vcl::vec3 low = position[0], high = position[0];
+		for (int i = 1; i < n; i++) {
+			for (int c = 0; c < 3; c++) {
+				low[c] = std::min(low[c], position[i][c]);
+				high[c] = std::max(high[c], position[i][c]);
+			}
+		}
+		float half = 0.5f * std::max(high.x - low.x, std::max(high.y - low.y, high.z - low.z));
+		half = half * 1.001f + 1e-6f; // Keeps bodies on the border strictly inside
+
+		nodes.reserve(2 * n / leaf_size + 1);
+		build_node(0, n, 0.5f * (low + high), half, 0);
+	}
+
+	// Gravitational field (acceleration without G) felt by body i, and its potential per unit mass in "potential"
+	vcl::vec3 field_at(int i, double& potential) const {
+
+		vcl::vec3 acc;
+		potential = 0;
+
+		if (nodes.empty())
+			return acc;
+
+		const vcl::vec3 p = position[i];
+		const int k = level_index[i];
+		const float theta2 = theta * theta;
+
+		int stack[64 * 8];
+		int top = 0;
+		stack[top++] = 0;
+
+		while (top > 0) {
+			const Node& node = nodes[stack[--top]];
+
+			const float M = agg_mass[node.aggregate + k];
+			if (M == 0)
+				continue;
+
+			if (node.child[0] == -2) { // Leaf: direct sum
+				for (int b = node.first; b < node.first + node.count; b++) {
+					int j = index[b];
+					if (j == i || !attracts(j, i))
+						continue;
+					add_pair(position[j] - p, mass[j], acc, potential);
+				}
+				continue;
+			}
+
+			const vcl::vec3 d = agg_com[node.aggregate + k] - p;
+			const float dist2 = vcl::dot(d, d);
+			const float size = 2 * node.half;
+
+			if (size * size < theta2 * dist2 && !contains(node, p)) {
+				add_pair(d, M, acc, potential);
+				continue;
+			}
+
+			for (int c = 0; c < 8; c++)
+				if (node.child[c] >= 0)
+					stack[top++] = node.child[c];
+		}
+
+		return acc;
+	}
+
+	int size() const { return (int)nodes.size(); }
+
+private:
+
+	struct Node {
+		vcl::vec3 center;
+		float half;
+		int first, count; // Range in index
+		int child[8]; // -1 for an empty octant. child[0] == -2 marks a leaf
+		int aggregate; // Offset in agg_mass/agg_com (n_levels entries)
+	};
+
+	const vcl::vec3* position = nullptr;
+	const float* mass = nullptr;
+	const int* level = nullptr;
+	const char* similar = nullptr;
+	int n = 0;
+
+	std::vector<Node> nodes;
+	std::vector<int> index;
+	std::vector<int> buffer;
+
+	std::vector<int> levels;
+	std::vector<int> level_index;
+	int n_levels = 0;
+
+	std::vector<float> agg_mass;
+	std::vector<vcl::vec3> agg_com;
+
+	// Same rule as Simulator::potential_to
+	bool attracts(int from, int to) const {
+		return level[from] > level[to] || (level[from] == level[to] && similar[from]);
+	}
+
+	static bool contains(const Node& node, const vcl::vec3& p) {
+		return std::abs(p.x - node.center.x) <= node.half && std::abs(p.y - node.center.y) <= node.half && std::abs(p.z - node.center.z) <= node.half;
+	}
+
+	static void add_pair(const vcl::vec3& d, float m, vcl::vec3& acc, double& potential) {
+		float dist2 = vcl::dot(d, d);
+		if (dist2 == 0)
+			throw std::runtime_error("Two objects have the same position == BOOM...");
+		float dist = std::sqrt(dist2);
+		acc += (m / (dist2 * dist)) * d;
+		potential -= m / dist;
+	}
+
+	int build_node(int begin, int end, vcl::vec3 center, float half, int depth) {
+
+		int id = (int)nodes.size();
+		nodes.push_back(Node());
+		nodes[id].center = center;
+		nodes[id].half = half;
+		nodes[id].first = begin;
+		nodes[id].count = end - begin;
+		nodes[id].aggregate = (int)agg_mass.size();
+
+		agg_mass.resize(agg_mass.size() + n_levels, 0.0f);
+		agg_com.resize(agg_com.size() + n_levels, vcl::vec3());
+
+		if (end - begin <= leaf_size || depth >= 63) { // The depth limit handles coincident bodies
+			for (int c = 0; c < 8; c++)
+				nodes[id].child[c] = -1;
+			nodes[id].child[0] = -2;
+			compute_leaf_aggregate(id);
+			return id;
+		}
+
+		// Counting sort of the range into the 8 octants
+		int count[8] = { 0 };
+		for (int b = begin; b < end; b++)
+			count[octant(position[index[b]], center)]++;
+
+		int start[9];
+		start[0] = begin;
+		for (int c = 0; c < 8; c++)
+			start[c + 1] = start[c] + count[c];
+
+		int fill[8];
+		std::copy(start, start + 8, fill);
+		for (int b = begin; b < end; b++) {
+			int j = index[b];
+			buffer[fill[octant(position[j], center)]++] = j;
+		}
+		std::copy(buffer.begin() + begin, buffer.begin() + end, index.begin() + begin);
+
+		float h = 0.5f * half;
+		for (int c = 0; c < 8; c++) {
+			int child = -1;
+			if (count[c] > 0) {
+				vcl::vec3 child_center = center + vcl::vec3((c & 1) ? h : -h, (c & 2) ? h : -h, (c & 4) ? h : -h);
+				child = build_node(start[c], start[c + 1], child_center, h, depth + 1);
+			}
+			nodes[id].child[c] = child; // nodes may have been reallocated
+		}
+
+		// Children store centers of mass, weighted back by their masses
+		for (int c = 0; c < 8; c++) {
+			int child = nodes[id].child[c];
+			if (child < 0)
+				continue;
+			for (int k = 0; k < n_levels; k++) {
+				agg_mass[nodes[id].aggregate + k] += agg_mass[nodes[child].aggregate + k];
+				agg_com[nodes[id].aggregate + k] += agg_mass[nodes[child].aggregate + k] * agg_com[nodes[child].aggregate + k];
+			}
+		}
+
+		finish_aggregate(id);
+
+		return id;
+	}
+
+	// agg_com first accumulates mass weighted positions, finish_aggregate turns them into centers of mass
+	void compute_leaf_aggregate(int id) {
+		const Node& node = nodes[id];
+
+		for (int b = node.first; b < node.first + node.count; b++) {
+			int j = index[b];
+			int lj = level_index[j];
+
+			// Attracts every lower level, and its own level if it attracts similar objects
+			int last = similar[j] ? lj : lj - 1;
+			for (int k = 0; k <= last; k++) {
+				agg_mass[node.aggregate + k] += mass[j];
+				agg_com[node.aggregate + k] += mass[j] * position[j];
+			}
+		}
+
+		finish_aggregate(id);
+	}
+
+	void finish_aggregate(int id) {
+		const Node& node = nodes[id];
+		for (int k = 0; k < n_levels; k++) {
+			float M = agg_mass[node.aggregate + k];
+			if (M != 0)
+				agg_com[node.aggregate + k] /= M;
+		}
+	}
+
+	static int octant(const vcl::vec3& p, const vcl::vec3& center) {
+		return (p.x > center.x ? 1 : 0) | (p.y > center.y ? 2 : 0) | (p.z > center.z ? 4 : 0);
+	}
+};
+
+#endif // OCTREE_H
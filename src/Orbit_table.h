@@ -0,0 +1,270 @@
+#ifndef ORBIT_TABLE_H
+#define ORBIT_TABLE_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <cmath>
+#include <stdexcept>
+#include "Gravity_kernel.h"
+#include "Kepler.h"
+
+
+/* Keplerian orbits of many bodies (circular ones included), evaluated all at once
+*
+* Orbit_Object rebuilds its basis and checks its vectors at every call. Here each orbit is reduced to what the evaluation needs,
+* stored column by column: its mean motion n, mean anomaly at time 0, eccentricity e, and the vectors u = a P and w = b Q
+* (P towards the periapsis, Q 90 degrees ahead in the plane, a and b the semi-axes). The position relative to the parent is
+* (cos E - e) u + sin E w, where E solves Kepler's equation E - e sin E = M with M = M0 + n t, and the speed its derivative.
+* A circular orbit is e = 0: E = M.
+*
+* M is reduced to [-pi, pi] in double (t is large), then everything is in float, 8 bodies at a time with AVX2:
+* Danby's starter E = M + 0.85 e sign(M) and a fixed number of Halley iterations (enough for float precision up to e = 0.999),
+* with sin and cos from the same minimax polynomials as the float functions of the C library.
+*/
+
+// Columns of the table
+struct Orbit_elements {
+	std::vector<double> omega; // Mean motion
+	std::vector<double> phase; // Mean anomaly at time 0
+	std::vector<float> e; // Eccentricity
+	std::vector<float> ux, uy, uz; // Semi-major axis * direction of the periapsis
+	std::vector<float> wx, wy, wz; // Semi-minor axis * the direction 90 degrees ahead
+};
+
+// Orientation and shape of an ellipse around its parent. Angles in radians, relative to the (x, y) plane and the x axis
+struct Kepler_elements {
+	double semi_major_axis;
+	double eccentricity; // 0 <= e < 1
+	double inclination;
+	double ascending_node; // Longitude of the ascending node
+	double periapsis; // Argument of the periapsis
+	double mean_anomaly; // At time 0
+};
+
+// Positions and speeds relative to the parents, after Orbit_table::evaluate
+struct Orbit_states {
+	std::vector<float> x, y, z;
+	std::vector<float> vx, vy, vz;
+};
+
+typedef void (*orbit_evaluate_fn)(const Orbit_elements& e, double time, Orbit_states& s, int begin, int end);
+
+const int orbit_halley_iterations = 6;
+
+inline void orbit_evaluate_scalar(const Orbit_elements& e, double time, Orbit_states& s, int begin, int end) {
+	for (int i = begin; i < end; i++) {
+		double a = e.phase[i] + e.omega[i] * time;
+		float M = float(a - kepler_two_pi * std::nearbyint(a / kepler_two_pi));
+		float ecc = e.e[i];
+
+		float E = M + 0.85f * ecc * ((M > 0) - (M < 0));
+		for (int it = 0; it < orbit_halley_iterations && ecc > 0; it++) {
+			float F = E - ecc * std::sin(E) - M;
+			float dF = 1 - ecc * std::cos(E);
+			float dE = -F / dF;
+			dE = -F / (dF + 0.5f * dE * ecc * std::sin(E));
+			E += dE;
+		}
+
+		// Near the periapsis of an eccentric orbit, c - e and 1 - e c are differences of numbers close to 1: taken from 1 - e and 1 - c
+		float c = std::cos(E), sn = std::sin(E);
+		float one_minus_c = c > 0 ? sn * sn / (1 + c) : 1 - c;
+		float cx = (1 - ecc) - one_minus_c;
+		float rate = float(e.omega[i]) / ((1 - ecc) + ecc * one_minus_c); // dE/dt
+
+		s.x[i] = cx * e.ux[i] + sn * e.wx[i];
+		s.y[i] = cx * e.uy[i] + sn * e.wy[i];
+		s.z[i] = cx * e.uz[i] + sn * e.wz[i];
+		s.vx[i] = rate * (c * e.wx[i] - sn * e.ux[i]);
+		s.vy[i] = rate * (c * e.wy[i] - sn * e.uy[i]);
+		s.vz[i] = rate * (c * e.wz[i] - sn * e.uz[i]);
+	}
+}
+
+#ifdef GRAVITY_KERNEL_X86
+
+// sin and cos of 8 angles in [-pi, pi]: reduction to [-pi/4, pi/4] around the nearest multiple of pi/2, then a polynomial for each
+GRAVITY_TARGET("avx2,fma")
+inline void orbit_sincos_avx2(__m256 x, __m256& sin_x, __m256& cos_x) {
+	__m256 q = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(0.636619772f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	__m256 y = _mm256_fnmadd_ps(q, _mm256_set1_ps(1.57079637050628662109375f), x);
+	y = _mm256_fnmadd_ps(q, _mm256_set1_ps(-4.37113900018624283e-8f), y);
+	__m256 y2 = _mm256_mul_ps(y, y);
+
+	__m256 s = _mm256_fmadd_ps(y2, _mm256_set1_ps(-1.9515295891e-4f), _mm256_set1_ps(8.3321608736e-3f));
+	s = _mm256_fmadd_ps(y2, s, _mm256_set1_ps(-1.6666654611e-1f));
+	s = _mm256_fmadd_ps(_mm256_mul_ps(y2, y), s, y);
+
+	__m256 c = _mm256_fmadd_ps(y2, _mm256_set1_ps(2.443315711809948e-5f), _mm256_set1_ps(-1.388731625493765e-3f));
+	c = _mm256_fmadd_ps(y2, c, _mm256_set1_ps(4.166664568298827e-2f));
+	c = _mm256_fmadd_ps(_mm256_mul_ps(y2, y2), c, _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), y2, _mm256_set1_ps(1.0f)));
+
+	// Quadrant: odd ones swap sin and cos, then the signs
+	__m256i quadrant = _mm256_cvtps_epi32(q);
+	__m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(quadrant, _mm256_set1_epi32(1)), _mm256_set1_epi32(1)));
+	__m256 sin_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(quadrant, _mm256_set1_epi32(2)), 30));
+	__m256 cos_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(quadrant, _mm256_set1_epi32(1)), _mm256_set1_epi32(2)), 30));
+
+	sin_x = _mm256_xor_ps(_mm256_blendv_ps(s, c, swap), sin_sign);
+	cos_x = _mm256_xor_ps(_mm256_blendv_ps(c, s, swap), cos_sign);
+}
+
+GRAVITY_TARGET("avx2,fma")
+inline void orbit_evaluate_avx2(const Orbit_elements& e, double time, Orbit_states& s, int begin, int end) {
+	const __m256d t = _mm256_set1_pd(time);
+	const __m256d inverse_two_pi = _mm256_set1_pd(1 / kepler_two_pi);
+	const __m256d two_pi_high = _mm256_set1_pd(kepler_two_pi), two_pi_low = _mm256_set1_pd(2.4492935982947064e-16);
+	const __m256 one = _mm256_set1_ps(1.0f), half_one = _mm256_set1_ps(0.5f);
+	const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+
+	int i = begin;
+	for (; i + 8 <= end; i += 8) {
+		// Mean anomalies in double, reduced, then rounded to float
+		__m128 half[2];
+		for (int h = 0; h < 2; h++) {
+			__m256d a = _mm256_fmadd_pd(_mm256_loadu_pd(&e.omega[i + 4 * h]), t, _mm256_loadu_pd(&e.phase[i + 4 * h]));
+			__m256d turns = _mm256_round_pd(_mm256_mul_pd(a, inverse_two_pi), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+			a = _mm256_fnmadd_pd(turns, two_pi_high, a);
+			a = _mm256_fnmadd_pd(turns, two_pi_low, a);
+			half[h] = _mm256_cvtpd_ps(a);
+		}
+		const __m256 M = _mm256_insertf128_ps(_mm256_castps128_ps256(half[0]), half[1], 1);
+		const __m256 n = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_loadu_pd(&e.omega[i]))), _mm256_cvtpd_ps(_mm256_loadu_pd(&e.omega[i + 4])), 1);
+		const __m256 ecc = _mm256_loadu_ps(&e.e[i]);
+
+		// E = M + 0.85 e sign(M), 0 for M = 0
+		__m256 step = _mm256_and_ps(_mm256_or_ps(_mm256_and_ps(M, sign_bit), _mm256_mul_ps(_mm256_set1_ps(0.85f), ecc)), _mm256_cmp_ps(M, _mm256_setzero_ps(), _CMP_NEQ_OQ));
+		__m256 E = _mm256_add_ps(M, step);
+
+		// E = M for circular orbits: no iterations when the 8 of them are
+		const int iterations = _mm256_movemask_ps(_mm256_cmp_ps(ecc, _mm256_setzero_ps(), _CMP_NEQ_OQ)) ? orbit_halley_iterations : 0;
+		__m256 sn, c;
+		for (int it = 0; it < iterations; it++) {
+			orbit_sincos_avx2(E, sn, c);
+			__m256 F = _mm256_sub_ps(_mm256_fnmadd_ps(ecc, sn, E), M);
+			__m256 dF = _mm256_fnmadd_ps(ecc, c, one);
+			__m256 dE = _mm256_div_ps(F, dF); // Newton step, with the sign flipped
+			dE = _mm256_div_ps(F, _mm256_fnmadd_ps(_mm256_mul_ps(half_one, dE), _mm256_mul_ps(ecc, sn), dF));
+			E = _mm256_sub_ps(E, dE);
+		}
+		orbit_sincos_avx2(E, sn, c);
+
+		// c - e and 1 - e c from 1 - e and 1 - c, as in orbit_evaluate_scalar
+		const __m256 one_minus_c = _mm256_blendv_ps(_mm256_sub_ps(one, c), _mm256_div_ps(_mm256_mul_ps(sn, sn), _mm256_add_ps(one, c)), _mm256_cmp_ps(c, _mm256_setzero_ps(), _CMP_GT_OQ));
+		const __m256 one_minus_e = _mm256_sub_ps(one, ecc);
+		const __m256 cx = _mm256_sub_ps(one_minus_e, one_minus_c);
+		const __m256 rate = _mm256_div_ps(n, _mm256_fmadd_ps(ecc, one_minus_c, one_minus_e)); // dE/dt
+		const __m256 ws = _mm256_mul_ps(rate, sn), wc = _mm256_mul_ps(rate, c);
+
+		const float* u[3] = { &e.ux[i], &e.uy[i], &e.uz[i] };
+		const float* v[3] = { &e.wx[i], &e.wy[i], &e.wz[i] };
+		float* p[3] = { &s.x[i], &s.y[i], &s.z[i] };
+		float* dp[3] = { &s.vx[i], &s.vy[i], &s.vz[i] };
+		for (int k = 0; k < 3; k++) {
+			__m256 uk = _mm256_loadu_ps(u[k]), vk = _mm256_loadu_ps(v[k]);
+			_mm256_storeu_ps(p[k], _mm256_fmadd_ps(cx, uk, _mm256_mul_ps(sn, vk)));
+			_mm256_storeu_ps(dp[k], _mm256_fmsub_ps(wc, vk, _mm256_mul_ps(ws, uk)));
+		}
+	}
+	orbit_evaluate_scalar(e, time, s, i, end);
+}
+
+#endif // GRAVITY_KERNEL_X86
+
+inline orbit_evaluate_fn get_orbit_kernel(simd_level level) {
+#ifdef GRAVITY_KERNEL_X86
+	simd_level supported = detect_simd_level();
+	if (level > supported)
+		level = supported;
+	if (level >= simd_level::AVX2)
+		return orbit_evaluate_avx2;
+#else
+	(void)level;
+#endif
+	return orbit_evaluate_scalar;
+}
+
+
+class Orbit_table {
+
+public:
+
+	/* Adds a circular orbit, with the elements of an Orbit_Object (see add_orbit in orbit_object.h) and returns its index.
+	* period is the time of one turn with the angle convention of Orbit_Object (2 * 3.14 per turn), and the body is at
+	* diameter_ini at time -time_offset, so that both agree
+	*/
+	int add(vcl::vec3 axis, vcl::vec3 diameter_ini, float radius_orbit, float period, double time_offset) {
+		if (vcl::norm(axis) == 0 || vcl::norm(diameter_ini) == 0)
+			throw std::invalid_argument("An orbit needs a non-zero axis and initial direction.");
+		if (period <= 0)
+			throw std::invalid_argument("An orbit needs a positive period.");
+
+		double n = 2 * 3.14 / period;
+		return push(n, n * time_offset, 0, radius_orbit * diameter_ini, radius_orbit * vcl::cross(axis, diameter_ini));
+	}
+
+	// Adds an elliptical orbit around a parent of gravitational parameter mu = G M, and returns its index
+	int add(const Kepler_elements& k, double mu) {
+		if (!(k.eccentricity >= 0 && k.eccentricity < 1))
+			throw std::invalid_argument("Only elliptical orbits (0 <= e < 1) can be put in an orbit table.");
+		if (k.semi_major_axis <= 0 || mu <= 0)
+			throw std::invalid_argument("An orbit needs a positive semi-major axis and parent mass.");
+
+		const double cO = std::cos(k.ascending_node), sO = std::sin(k.ascending_node);
+		const double cw = std::cos(k.periapsis), sw = std::sin(k.periapsis);
+		const double ci = std::cos(k.inclination), si = std::sin(k.inclination);
+		const vcl::vec3 P(float(cO * cw - sO * sw * ci), float(sO * cw + cO * sw * ci), float(sw * si));
+		const vcl::vec3 Q(float(-cO * sw - sO * cw * ci), float(-sO * sw + cO * cw * ci), float(cw * si));
+
+		const double a = k.semi_major_axis;
+		const double b = a * std::sqrt(1 - k.eccentricity * k.eccentricity);
+		return push(std::sqrt(mu / (a * a * a)), k.mean_anomaly, float(k.eccentricity), float(a) * P, float(b) * Q);
+	}
+
+	int size() const { return (int)elements.omega.size(); }
+
+	// Positions and speeds of every orbit at time t
+	void evaluate(double t) {
+		if (kernel == nullptr)
+			kernel = get_orbit_kernel(detect_simd_level());
+		kernel(elements, t, states, 0, size());
+		evaluated_time = t;
+		evaluated = true;
+	}
+
+	// Relative to the parent, at the time of the last evaluate
+	vcl::vec3 get_position(int k) const { return vcl::vec3(states.x[k], states.y[k], states.z[k]); }
+	vcl::vec3 get_speed(int k) const { return vcl::vec3(states.vx[k], states.vy[k], states.vz[k]); }
+
+	const Orbit_states& get_states() const { return states; }
+	bool is_evaluated(double t) const { return evaluated && evaluated_time == t; }
+
+	void set_simd_level(simd_level level) { kernel = get_orbit_kernel(level); }
+
+private:
+
+	Orbit_elements elements;
+	Orbit_states states;
+	double evaluated_time = 0;
+	bool evaluated = false;
+	orbit_evaluate_fn kernel = nullptr;
+
+	int push(double n, double phase, float e, vcl::vec3 u, vcl::vec3 w) {
+		elements.omega.push_back(n);
+		elements.phase.push_back(phase);
+		elements.e.push_back(e);
+		elements.ux.push_back(u.x);
+		elements.uy.push_back(u.y);
+		elements.uz.push_back(u.z);
+		elements.wx.push_back(w.x);
+		elements.wy.push_back(w.y);
+		elements.wz.push_back(w.z);
+
+		for (auto* a : { &states.x, &states.y, &states.z, &states.vx, &states.vy, &states.vz })
+			a->push_back(0);
+		evaluated = false;
+		return size() - 1;
+	}
+};
+
+#endif // ORBIT_TABLE_H
@@ -0,0 +1,540 @@
+#ifndef PARTICLE_MESH_H
+#define PARTICLE_MESH_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <complex>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include "Thread_pool.h"
+
+
+/* Particle-mesh gravity, for large and roughly uniform populations (belts, rings, discs)
+*
+* The objects are spread on a cubic grid of grid_size^3 nodes around them (cloud in cell), the potential is the convolution
+* of the grid with the Green function, done with FFTs on a grid twice as large (zero padding: no periodic images),
+* and the field at each object is interpolated back from the gradient of the potential (4 point differences, cloud in cell).
+* The cost is O(n + grid_size^3 log grid_size), whatever the distribution.
+*
+* The mesh only carries the long range part of gravity, -erf(r / 2 r_s) / r with r_s = split cells, which is smooth at the
+* scale of a cell. With short_range on (P3M), the rest, -erfc(r / 2 r_s) / r, is summed directly over the neighbours closer
+* than cutoff * r_s, and the result is close to exact gravity. Without it, gravity is softened below a few cells.
+*
+* As in Fmm.h, attraction levels get their own grid: the grid of level k holds what attracts an object of level k.
+* Values are computed without G (the caller scales them).
+*/
+
+const double mesh_pi = 3.141592653589793; // M_PI is not standard
+
+class Particle_mesh {
+
+public:
+
+	bool short_range = true; // P3M
+	float split = 1.25f; // r_s, in cells
+	float cutoff = 4.5f; // Direct neighbours up to cutoff * r_s
+
+	int get_grid_size() const { return grid; }
+
+	/* Nodes per side, a power of two from 16 to 512.
+	* Memory is about 200 grid_size^3 bytes whatever the number of threads: the padded grid (8 grid_size^3 complex numbers),
+	* its Green function and the potential. 52 MB at 64, 420 MB at 128, 3.4 GB at 256, 27 GB at 512
+	*/
+	void set_grid_size(int size) {
+		int g = 16;
+		while (g < size && g < 512)
+			g *= 2;
+		if (g != grid) {
+			grid = g;
+			green_ready = false;
+		}
+	}
+
+	/* Computes the field (acceleration without G) and, if potential is not null, the potential per unit mass of every object.
+	* The object at index excluded (-1 for none) attracts nothing.
+	* field (and potential) must have room for n values. pool may be nullptr.
+	*/
+	void compute(const vcl::vec3* position_, const float* mass_, const int* level_, const char* similar_, int n_, int excluded_,
+		vcl::vec3* field, double* potential, Thread_pool* pool) {
+
+		position = position_;
+		mass = mass_;
+		level = level_;
+		similar = similar_;
+		n = n_;
+		excluded = excluded_;
+
+		for (int i = 0; i < n; i++)
+			field[i] = vcl::vec3();
+		if (potential)
+			std::fill(potential, potential + n, 0.0);
+		if (n == 0)
+			return;
+
+		if (!green_ready || green_split != split)
+			build_green(pool);
+
+		place_grid();
+
+		std::vector<int> levels(level, level + n);
+		std::sort(levels.begin(), levels.end());
+
+		// A level with few objects (the planets above a belt) is cheaper to sum directly than to put on its own grid
+		on_mesh.assign(n, 1);
+		for (auto k = levels.begin(); k != levels.end(); ) {
+			auto next = std::upper_bound(k, levels.end(), *k);
+			long long targets = next - k;
+			if (targets * n < 64LL * grid * grid * grid)
+				solve_direct(*k, field, potential, pool);
+			else
+				solve_level(*k, field, potential, pool);
+			k = next;
+		}
+
+		if (short_range)
+			add_short_range(field, potential, pool);
+	}
+
+private:
+
+	int grid = 64;
+	bool green_ready = false;
+	float green_split = 0;
+
+	const vcl::vec3* position = nullptr;
+	const float* mass = nullptr;
+	const int* level = nullptr;
+	const char* similar = nullptr;
+	int n = 0;
+	int excluded = -1;
+
+	// Node (a, b, c) of the grid is at corner + h (a, b, c)
+	vcl::vec3 corner;
+	double h = 1;
+
+	std::vector<double> green; // Transform of the Green function on the padded grid, in cells
+	std::vector<std::complex<double>> work; // Padded grid, (2 grid)^3
+	std::vector<double> phi; // Potential on the grid, grid^3, in cells
+	std::vector<int> plane_start; // Deposit: objects of the level being solved, by plane of their lower nodes
+	std::vector<int> plane_objects;
+	std::vector<std::complex<double>> twiddle;
+	std::vector<int> bit_reverse;
+
+	std::vector<char> on_mesh; // Per object: 0 if its level was summed directly
+
+	// Short range neighbours: objects sorted by bins of side the cutoff distance
+	std::vector<int> bin_start;
+	std::vector<int> bin_objects;
+	int bins = 0;
+
+	bool attracts(int from, int to) const {
+		return from != excluded && (level[from] > level[to] || (level[from] == level[to] && similar[from]));
+	}
+
+	bool attracts_level(int from, int k) const {
+		return from != excluded && (level[from] > k || (level[from] == k && similar[from]));
+	}
+
+	int padded() const { return 2 * grid; }
+	size_t node(int a, int b, int c) const { return ((size_t)a * grid + b) * grid + c; }
+	size_t padded_node(int a, int b, int c) const { return ((size_t)a * padded() + b) * padded() + c; }
+
+	// Long range Green function at distance r (in cells), and at r = 0
+	double long_range(double r) const {
+		const double s = split;
+		return r == 0 ? -1 / (s * std::sqrt(mesh_pi)) : -std::erf(r / (2 * s)) / r;
+	}
+
+	void build_green(Thread_pool* pool) {
+		const int m = padded();
+		work.assign((size_t)m * m * m, 0.0);
+		for (int a = 0; a < m; a++) {
+			double x = std::min(a, m - a);
+			for (int b = 0; b < m; b++) {
+				double y = std::min(b, m - b);
+				for (int c = 0; c < m; c++) {
+					double z = std::min(c, m - c);
+					work[padded_node(a, b, c)] = long_range(std::sqrt(x * x + y * y + z * z));
+				}
+			}
+		}
+
+		prepare_fft();
+		fft_3d(false, true, pool);
+
+		// Even function: the transform is real
+		green.resize(work.size());
+		for (size_t t = 0; t < work.size(); t++)
+			green[t] = work[t].real();
+
+		green_ready = true;
+		green_split = split;
+	}
+
+	// Cube around all objects, with two empty nodes on every side for the differences
+	void place_grid() {
+		vcl::vec3 lo = position[0], hi = position[0];
+		for (int i = 1; i < n; i++) {
+			for (int c = 0; c < 3; c++) {
+				lo[c] = std::min(lo[c], position[i][c]);
+				hi[c] = std::max(hi[c], position[i][c]);
+			}
+		}
+
+		float side = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
+		if (side == 0)
+			side = 1;
+		h = 1.0001 * side / (grid - 6);
+		corner = lo - float(2 * h) * vcl::vec3(1, 1, 1);
+	}
+
+	// Node below p and the weights of the upper nodes, per coordinate
+	void cloud(const vcl::vec3& p, int* base, double* upper) const {
+		for (int c = 0; c < 3; c++) {
+			double u = (p[c] - corner[c]) / h;
+			base[c] = std::max(0, std::min((int)u, grid - 2));
+			upper[c] = u - base[c];
+		}
+	}
+
+	void solve_level(int k, vcl::vec3* field, double* potential, Thread_pool* pool) {
+
+		// Objects that attract level k, sorted by the plane (first index) of their lower nodes
+		plane_start.assign(grid + 1, 0);
+		for (int i = 0; i < n; i++) {
+			if (mass[i] == 0 || !attracts_level(i, k))
+				continue;
+			int b[3];
+			double w[3];
+			cloud(position[i], b, w);
+			plane_start[b[0] + 1]++;
+		}
+		for (int a = 0; a < grid; a++)
+			plane_start[a + 1] += plane_start[a];
+		if (plane_start[grid] == 0)
+			return;
+
+		plane_objects.resize(plane_start[grid]);
+		std::vector<int> next(plane_start.begin(), plane_start.end() - 1);
+		for (int i = 0; i < n; i++) {
+			if (mass[i] == 0 || !attracts_level(i, k))
+				continue;
+			int b[3];
+			double w[3];
+			cloud(position[i], b, w);
+			plane_objects[next[b[0]]++] = i;
+		}
+
+		/* Cloud in cell deposit straight into the padded grid, by slabs of planes: a slab takes the objects of its planes and of
+		* the plane below, and only writes its own planes. No grid per thread, and every node sums its objects in the same order
+		* whatever the number of threads
+		*/
+		work.assign(green.size(), 0.0);
+		auto deposit = [&](int begin, int end) {
+			for (int plane = std::max(0, begin - 1); plane < end; plane++) {
+				for (int o = plane_start[plane]; o < plane_start[plane + 1]; o++) {
+					int i = plane_objects[o];
+					int b[3];
+					double w[3];
+					cloud(position[i], b, w);
+					for (int a = 0; a < 8; a++) {
+						int q = b[0] + (a & 1);
+						if (q < begin || q >= end)
+							continue;
+						double weight = mass[i];
+						for (int c = 0; c < 3; c++)
+							weight *= (a >> c & 1) ? w[c] : 1 - w[c];
+						work[padded_node(q, b[1] + (a >> 1 & 1), b[2] + (a >> 2 & 1))] += weight;
+					}
+				}
+			}
+		};
+		if (pool)
+			pool->parallel_for(grid, deposit);
+		else
+			deposit(0, grid);
+
+		// Convolution with the Green function
+		fft_3d(false, false, pool);
+		for (size_t t = 0; t < work.size(); t++)
+			work[t] = std::complex<double>(work[t].real() * green[t], work[t].imag() * green[t]);
+		fft_3d(true, false, pool);
+
+		phi.resize((size_t)grid * grid * grid);
+		const double scale = 1.0 / work.size();
+		for (int a = 0; a < grid; a++)
+			for (int b = 0; b < grid; b++)
+				for (int c = 0; c < grid; c++)
+					phi[node(a, b, c)] = work[padded_node(a, b, c)].real() * scale;
+
+		// Interpolation at the objects of level k
+		auto interpolate = [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				if (level[i] != k)
+					continue;
+				int b[3];
+				double w[3];
+				cloud(position[i], b, w);
+
+				double g[3] = { 0, 0, 0 }, p = 0;
+				for (int a = 0; a < 8; a++) {
+					int q[3] = { b[0] + (a & 1), b[1] + (a >> 1 & 1), b[2] + (a >> 2 & 1) };
+					double weight = 1;
+					for (int c = 0; c < 3; c++)
+						weight *= (a >> c & 1) ? w[c] : 1 - w[c];
+					p += weight * phi[node(q[0], q[1], q[2])];
+					for (int c = 0; c < 3; c++)
+						g[c] += weight * difference(q, c);
+				}
+
+				field[i] -= vcl::vec3(float(g[0] / (h * h)), float(g[1] / (h * h)), float(g[2] / (h * h)));
+				if (potential) {
+					// Without the object's own cloud
+					if (mass[i] != 0 && attracts(i, i))
+						p -= mass[i] * self_potential(w);
+					potential[i] += p / h;
+				}
+			}
+		};
+		if (pool)
+			pool->parallel_for(n, interpolate);
+		else
+			interpolate(0, n);
+	}
+
+	// Exact sum for the objects of level k
+	void solve_direct(int k, vcl::vec3* field, double* potential, Thread_pool* pool) {
+		auto targets = [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				if (level[i] != k)
+					continue;
+				on_mesh[i] = 0;
+				double gx = 0, gy = 0, gz = 0, phi_i = 0;
+				for (int j = 0; j < n; j++) {
+					if (j == i || mass[j] == 0 || !attracts(j, i))
+						continue;
+					vcl::vec3 d = position[j] - position[i];
+					double r2 = vcl::dot(d, d);
+					if (r2 == 0)
+						throw std::runtime_error("Two objects have the same position == BOOM...");
+					double r = std::sqrt(r2);
+					double f = mass[j] / (r2 * r);
+					gx += f * d.x;
+					gy += f * d.y;
+					gz += f * d.z;
+					phi_i -= mass[j] / r;
+				}
+				field[i] = vcl::vec3(float(gx), float(gy), float(gz));
+				if (potential)
+					potential[i] = phi_i;
+			}
+		};
+		if (pool)
+			pool->parallel_for(n, targets);
+		else
+			targets(0, n);
+	}
+
+	// Derivative of phi along coordinate c at node q, in cells
+	double difference(const int* q, int c) const {
+		int up[3] = { q[0], q[1], q[2] }, down[3] = { q[0], q[1], q[2] };
+		auto at = [&](int* r, int shift) {
+			int saved = r[c];
+			r[c] = std::max(0, std::min(saved + shift, grid - 1));
+			double v = phi[node(r[0], r[1], r[2])];
+			r[c] = saved;
+			return v;
+		};
+		return (8 * (at(up, 1) - at(down, -1)) - (at(up, 2) - at(down, -2))) / 12;
+	}
+
+	// Mesh potential of a unit mass on itself, given its weights
+	double self_potential(const double* w) const {
+		double s = 0;
+		for (int a = 0; a < 8; a++)
+			for (int b = 0; b < 8; b++) {
+				double weight = 1;
+				int d2 = 0;
+				for (int c = 0; c < 3; c++) {
+					weight *= ((a >> c & 1) ? w[c] : 1 - w[c]) * ((b >> c & 1) ? w[c] : 1 - w[c]);
+					d2 += (a >> c & 1) != (b >> c & 1);
+				}
+				s += weight * long_range(std::sqrt(double(d2)));
+			}
+		return s;
+	}
+
+	// The part of gravity that the mesh leaves out, summed over the neighbours closer than cutoff * split cells
+	void add_short_range(vcl::vec3* field, double* potential, Thread_pool* pool) {
+		const double rs = split * h;
+		const double rc = cutoff * rs;
+		const float extent = float(grid * h);
+		bins = std::max(1, std::min(128, (int)(extent / rc)));
+		const double bin_side = extent / bins;
+
+		auto bin_of = [&](const vcl::vec3& p, int c) {
+			return std::max(0, std::min(bins - 1, (int)((p[c] - corner[c]) / bin_side)));
+		};
+
+		bin_start.assign((size_t)bins * bins * bins + 1, 0);
+		bin_objects.resize(n);
+		std::vector<int> bin(n, -1);
+		for (int i = 0; i < n; i++) {
+			if (i == excluded || mass[i] == 0)
+				continue;
+			bin[i] = (bin_of(position[i], 0) * bins + bin_of(position[i], 1)) * bins + bin_of(position[i], 2);
+			bin_start[bin[i] + 1]++;
+		}
+		for (size_t b = 1; b < bin_start.size(); b++)
+			bin_start[b] += bin_start[b - 1];
+		std::vector<int> fill(bin_start.begin(), bin_start.end() - 1);
+		for (int i = 0; i < n; i++)
+			if (bin[i] != -1)
+				bin_objects[fill[bin[i]]++] = i;
+
+		// erfc(r / 2 r_s) for the potential, and the same plus r / (r_s sqrt(pi)) exp(-r^2 / 4 r_s^2) for the field, tabulated in r / rc
+		const int samples = 1024;
+		std::vector<double> tail(samples + 2), force(samples + 2);
+		for (int t = 0; t <= samples + 1; t++) {
+			double u = double(t) / samples * cutoff;
+			tail[t] = std::erfc(u / 2);
+			force[t] = tail[t] + u / std::sqrt(mesh_pi) * std::exp(-u * u / 4);
+		}
+		const double rc2 = rc * rc;
+		const double to_sample = samples / rc;
+
+		auto neighbours = [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				if (!on_mesh[i])
+					continue;
+				const vcl::vec3 p = position[i];
+				int b[3] = { bin_of(p, 0), bin_of(p, 1), bin_of(p, 2) };
+				double gx = 0, gy = 0, gz = 0, pot = 0;
+
+				for (int x = std::max(0, b[0] - 1); x <= std::min(bins - 1, b[0] + 1); x++)
+					for (int y = std::max(0, b[1] - 1); y <= std::min(bins - 1, b[1] + 1); y++)
+						for (int z = std::max(0, b[2] - 1); z <= std::min(bins - 1, b[2] + 1); z++) {
+							int cell = (x * bins + y) * bins + z;
+							for (int e = bin_start[cell]; e < bin_start[cell + 1]; e++) {
+								int j = bin_objects[e];
+								if (j == i || !attracts(j, i))
+									continue;
+								vcl::vec3 d = position[j] - p;
+								double r2 = vcl::dot(d, d);
+								if (r2 >= rc2)
+									continue;
+								if (r2 == 0)
+									throw std::runtime_error("Two objects have the same position == BOOM...");
+								double r = std::sqrt(r2);
+								double sample_pos = r * to_sample;
+								int t = (int)sample_pos;
+								double w = sample_pos - t;
+								double f = mass[j] * (force[t] + w * (force[t + 1] - force[t])) / (r2 * r);
+								gx += f * d.x;
+								gy += f * d.y;
+								gz += f * d.z;
+								pot -= mass[j] * (tail[t] + w * (tail[t + 1] - tail[t])) / r;
+							}
+						}
+
+				field[i] += vcl::vec3(float(gx), float(gy), float(gz));
+				if (potential)
+					potential[i] += pot;
+			}
+		};
+		if (pool)
+			pool->parallel_for(n, neighbours);
+		else
+			neighbours(0, n);
+	}
+
+	void prepare_fft() {
+		const int m = padded();
+		int bits = 0;
+		while ((1 << bits) < m)
+			bits++;
+		bit_reverse.resize(m);
+		for (int t = 0; t < m; t++) {
+			int r = 0;
+			for (int b = 0; b < bits; b++)
+				r |= (t >> b & 1) << (bits - 1 - b);
+			bit_reverse[t] = r;
+		}
+		twiddle.resize(m / 2);
+		for (int t = 0; t < m / 2; t++)
+			twiddle[t] = std::polar(1.0, -2 * mesh_pi * t / m);
+	}
+
+	// Radix 2 transform of m values, in place. The inverse is not normalized
+	void fft_1d(std::complex<double>* v, bool inverse) const {
+		const int m = padded();
+		for (int t = 0; t < m; t++)
+			if (t < bit_reverse[t])
+				std::swap(v[t], v[bit_reverse[t]]);
+
+		for (int length = 2; length <= m; length *= 2) {
+			const int half = length / 2, stride = m / length;
+			for (int start = 0; start < m; start += length)
+				for (int t = 0; t < half; t++) {
+					const std::complex<double> w = twiddle[t * stride];
+					const std::complex<double> b = v[start + t + half];
+					const double wi = inverse ? -w.imag() : w.imag();
+					// Written out: std::complex products check for infinities
+					const std::complex<double> odd(w.real() * b.real() - wi * b.imag(), w.real() * b.imag() + wi * b.real());
+					v[start + t + half] = v[start + t] - odd;
+					v[start + t] += odd;
+				}
+		}
+	}
+
+	/* 3D transform of work, one axis after the other. Unless full, only the first grid nodes of each axis hold data before
+	* the forward transform, and only they are needed after the inverse one, so the first passes of the forward transform
+	* and the last passes of the inverse skip the lines that are empty or not needed.
+	*/
+	void fft_3d(bool inverse, bool full, Thread_pool* pool) {
+		const int part = full ? padded() : grid;
+		const int m = padded();
+
+		// Lines along axis, for the first slow_count values of the slower other coordinate and fast_count of the other
+		auto pass = [&](int axis, int slow_count, int fast_count) {
+			auto lines = [&](int begin, int end) {
+				std::vector<std::complex<double>> line(m);
+				for (int l = begin; l < end; l++) {
+					int u = l / fast_count, v = l % fast_count;
+					for (int t = 0; t < m; t++)
+						line[t] = work[line_node(axis, u, v, t)];
+					fft_1d(line.data(), inverse);
+					for (int t = 0; t < m; t++)
+						work[line_node(axis, u, v, t)] = line[t];
+				}
+			};
+			if (pool)
+				pool->parallel_for(slow_count * fast_count, lines);
+			else
+				lines(0, slow_count * fast_count);
+		};
+
+		if (!inverse) {
+			pass(2, part, part); // Along z: x and y below grid
+			pass(1, part, m); // Along y: x below grid
+			pass(0, m, m);
+		}
+		else {
+			pass(0, m, m);
+			pass(1, part, m);
+			pass(2, part, part);
+		}
+	}
+
+	// Node t of the line along axis, whose other coordinates are u (the slower one) and v
+	size_t line_node(int axis, int u, int v, int t) const {
+		switch (axis) {
+		case 0: return padded_node(t, u, v);
+		case 1: return padded_node(u, t, v);
+		default: return padded_node(u, v, t);
+		}
+	}
+};
+
+#endif // PARTICLE_MESH_H
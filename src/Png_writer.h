@@ -0,0 +1,96 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <cstdint>
+#include <algorithm>
+
+
+/* Minimal PNG encoder for 8-bit RGB images, without dependencies
+*
+* The zlib stream is made of stored (uncompressed) deflate blocks: the file is about the size of the raw pixels, and writing it
+* costs a copy and two checksums. Each row gets filter type 0 (none).
+*/
+
+inline uint32_t png_crc(const unsigned char* data, size_t n, uint32_t crc = 0xffffffffu) {
+	static const std::vector<uint32_t> table = [] {
+		std::vector<uint32_t> t(256);
+		for (uint32_t k = 0; k < 256; k++) {
+			uint32_t c = k;
+			for (int b = 0; b < 8; b++)
+				c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			t[k] = c;
+		}
+		return t;
+	}();
+	for (size_t i = 0; i < n; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+// Rows from top to bottom, 3 bytes per pixel
+inline void png_write_rgb(const std::string& path, int width, int height, const unsigned char* rgb) {
+	if (width <= 0 || height <= 0)
+		throw std::invalid_argument("A PNG image needs a positive size.");
+
+	auto put32 = [](std::vector<unsigned char>& out, uint32_t v) {
+		for (int s = 24; s >= 0; s -= 8)
+			out.push_back((unsigned char)(v >> s));
+	};
+
+	// Filtered rows: a filter byte, then the pixels
+	const size_t row = 1 + 3 * (size_t)width;
+	std::vector<unsigned char> raw(row * height);
+	for (int y = 0; y < height; y++) {
+		raw[y * row] = 0;
+		std::copy(rgb + (size_t)y * 3 * width, rgb + (size_t)(y + 1) * 3 * width, raw.begin() + y * row + 1);
+	}
+
+	// zlib: header, stored blocks of at most 65535 bytes, Adler-32
+	std::vector<unsigned char> z = { 0x78, 0x01 };
+	uint32_t a = 1, b = 0;
+	for (size_t at = 0; at < raw.size(); ) {
+		const size_t n = std::min<size_t>(65535, raw.size() - at);
+		z.push_back(at + n == raw.size() ? 1 : 0);
+		z.push_back((unsigned char)(n & 0xff));
+		z.push_back((unsigned char)(n >> 8));
+		z.push_back((unsigned char)(~n & 0xff));
+		z.push_back((unsigned char)((~n >> 8) & 0xff));
+		z.insert(z.end(), raw.begin() + at, raw.begin() + at + n);
+		for (size_t i = at; i < at + n; i++) {
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+		at += n;
+	}
+	put32(z, (b << 16) | a);
+
+	std::vector<unsigned char> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	auto chunk = [&](const char* type, const std::vector<unsigned char>& data) {
+		put32(png, (uint32_t)data.size());
+		const size_t start = png.size();
+		png.insert(png.end(), type, type + 4);
+		png.insert(png.end(), data.begin(), data.end());
+		put32(png, png_crc(&png[start], png.size() - start) ^ 0xffffffffu);
+	};
+
+	std::vector<unsigned char> header;
+	put32(header, (uint32_t)width);
+	put32(header, (uint32_t)height);
+	header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8 bits, RGB, deflate, adaptive filtering, no interlace
+	chunk("IHDR", header);
+	chunk("IDAT", z);
+	chunk("IEND", {});
+
+	std::ofstream file(path, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("Cannot open image file " + path);
+	file.write(reinterpret_cast<const char*>(png.data()), (std::streamsize)png.size());
+	if (!file)
+		throw std::runtime_error("Cannot write image file " + path);
+}
+
+#endif // PNG_WRITER_H
@@ -0,0 +1,123 @@
+#include "Precision_core.h"
+#include "Force_law.h"
+#include <cmath>
+#include <stdexcept>
+
+template <typename P>
+void Precision_core<P>::load(const vcl::vec3* position, const vcl::vec3* speed, const float* mass_, int n)
+{
+	x.resize(n); y.resize(n); z.resize(n);
+	vx.resize(n); vy.resize(n); vz.resize(n);
+	ax.assign(n, 0); ay.assign(n, 0); az.assign(n, 0);
+	mass.resize(n);
+
+	for (int i = 0; i < n; i++) {
+		x[i] = position[i].x; y[i] = position[i].y; z[i] = position[i].z;
+		vx[i] = speed[i].x; vy[i] = speed[i].y; vz[i] = speed[i].z;
+		mass[i] = mass_[i];
+	}
+}
+
+template <typename P>
+void Precision_core<P>::store(vcl::vec3* position, vcl::vec3* speed, vcl::vec3* acceleration) const
+{
+	for (size_t i = 0; i < x.size(); i++) {
+		position[i] = vcl::vec3(float(x[i]), float(y[i]), float(z[i]));
+		speed[i] = vcl::vec3(float(vx[i]), float(vy[i]), float(vz[i]));
+		acceleration[i] = vcl::vec3(float(ax[i]), float(ay[i]), float(az[i]));
+	}
+}
+
+template <typename P>
+template <typename Law>
+void Precision_core<P>::field(const Law& law, int i, const std::vector<int>& sources, double* potential)
+{
+	const position_type xi = x[i], yi = y[i], zi = z[i];
+	accumulator_type sx = 0, sy = 0, sz = 0;
+	double pot = 0;
+
+	for (int j : sources) {
+		if (j == i)
+			continue;
+
+		// The separation is taken in the position type, then rounded to the force type
+		force_type dx = force_type(x[j] - xi), dy = force_type(y[j] - yi), dz = force_type(z[j] - zi);
+		force_type r2 = dx * dx + dy * dy + dz * dz;
+		if (r2 == 0 && Law::singular)
+			throw std::runtime_error("Two objects have the same position == BOOM...");
+		if (r2 == 0 || !law.in_range(r2))
+			continue;
+
+		force_type f = law.acceleration(r2, mass[i], mass[j]);
+		sx += accumulator_type(f * dx);
+		sy += accumulator_type(f * dy);
+		sz += accumulator_type(f * dz);
+		if (potential)
+			pot += law.potential(r2, mass[i], mass[j]);
+	}
+
+	ax[i] = sx;
+	ay[i] = sy;
+	az[i] = sz;
+	if (potential)
+		*potential = pot;
+}
+
+template <typename P>
+template <typename Law>
+void Precision_core<P>::all_fields(const Law& law, const std::vector<std::vector<int>>& attractor_lists, const std::vector<int>& list_of, double* potential_energy, Thread_pool* pool)
+{
+	auto blocks = [&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+			field(law, i, attractor_lists[list_of[i]], potential_energy ? &potential_energy[i] : nullptr);
+	};
+
+	if (pool)
+		pool->parallel_for((int)x.size(), blocks);
+	else
+		blocks(0, (int)x.size());
+}
+
+template <typename P>
+void Precision_core<P>::compute_forces(const std::vector<std::vector<int>>& attractor_lists, const std::vector<int>& list_of, double* potential_energy, Thread_pool* pool)
+{
+	if (softening > 0)
+		all_fields(Plummer_law{ G, softening }, attractor_lists, list_of, potential_energy, pool);
+	else
+		all_fields(Newtonian_law{ G }, attractor_lists, list_of, potential_energy, pool);
+}
+
+template <typename P>
+void Precision_core<P>::kick(double dt)
+{
+	const position_type h = position_type(dt);
+	for (size_t i = 0; i < x.size(); i++) {
+		vx[i] += position_type(ax[i]) * h;
+		vy[i] += position_type(ay[i]) * h;
+		vz[i] += position_type(az[i]) * h;
+	}
+}
+
+template <typename P>
+void Precision_core<P>::drift(double dt)
+{
+	const position_type h = position_type(dt);
+	for (size_t i = 0; i < x.size(); i++) {
+		x[i] += vx[i] * h;
+		y[i] += vy[i] * h;
+		z[i] += vz[i] * h;
+	}
+}
+
+template class Precision_core<precision_float>;
+template class Precision_core<precision_double>;
+template class Precision_core<precision_mixed>;
+
+std::unique_ptr<Integration_core> make_integration_core(precision p, double G)
+{
+	switch (p) {
+	case precision::DOUBLE: return std::unique_ptr<Integration_core>(new Precision_core<precision_double>(G));
+	case precision::MIXED: return std::unique_ptr<Integration_core>(new Precision_core<precision_mixed>(G));
+	default: return std::unique_ptr<Integration_core>(new Precision_core<precision_float>(G));
+	}
+}
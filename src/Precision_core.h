@@ -0,0 +1,105 @@
+#ifndef PRECISION_CORE_H
+#define PRECISION_CORE_H
+
+#include "vcl/vcl.hpp"
+#include <vector>
+#include <memory>
+#include "Thread_pool.h"
+
+
+/* Scalar types of the Simulator's direct-sum leapfrog core
+*
+* FLOAT: everything in float, fastest
+* DOUBLE: everything in double, for long integrations
+* MIXED: positions, speeds and sums in double, each pair force in float from the (double) separation:
+*	close objects keep their relative precision, and the expensive part stays in float
+*/
+enum class precision { FLOAT, DOUBLE, MIXED };
+
+struct precision_float {
+	typedef float position_type; // Positions and speeds
+	typedef float force_type; // Distance and force of one pair
+	typedef float accumulator_type; // Sum of the pair forces
+};
+
+struct precision_double {
+	typedef double position_type;
+	typedef double force_type;
+	typedef double accumulator_type;
+};
+
+struct precision_mixed {
+	typedef double position_type;
+	typedef float force_type;
+	typedef double accumulator_type;
+};
+
+
+/* State of the objects in the chosen precision, integrated without going through vcl::vec3 (always float)
+*
+* The Simulator loads it from its arrays, steps it, and stores it back rounded to float: as long as nobody touches the objects
+* from outside, the core keeps the full precision from one step to the next.
+*/
+class Integration_core {
+
+public:
+
+	virtual ~Integration_core() {}
+
+	virtual void load(const vcl::vec3* position, const vcl::vec3* speed, const float* mass, int n) = 0;
+	virtual void store(vcl::vec3* position, vcl::vec3* speed, vcl::vec3* acceleration) const = 0;
+
+	// Acceleration of every object from the objects of attractor_lists[list_of[i]]. potential_energy (filled if not null) in double whatever the precision
+	virtual void compute_forces(const std::vector<std::vector<int>>& attractor_lists, const std::vector<int>& list_of, double* potential_energy, Thread_pool* pool) = 0;
+
+	virtual void kick(double dt) = 0;
+	virtual void drift(double dt) = 0;
+
+	// Plummer softening length, 0 for exact gravity. See Force_law.h
+	virtual void set_softening(double eps) = 0;
+};
+
+template <typename P>
+class Precision_core : public Integration_core {
+
+public:
+
+	typedef typename P::position_type position_type;
+	typedef typename P::force_type force_type;
+	typedef typename P::accumulator_type accumulator_type;
+
+	explicit Precision_core(double G_) : G(G_) {}
+
+	void load(const vcl::vec3* position, const vcl::vec3* speed, const float* mass_, int n) override;
+	void store(vcl::vec3* position, vcl::vec3* speed, vcl::vec3* acceleration) const override;
+	void compute_forces(const std::vector<std::vector<int>>& attractor_lists, const std::vector<int>& list_of, double* potential_energy, Thread_pool* pool) override;
+	void kick(double dt) override;
+	void drift(double dt) override;
+	void set_softening(double eps) override { softening = eps; }
+
+private:
+
+	double G;
+	double softening = 0;
+
+	std::vector<position_type> x, y, z;
+	std::vector<position_type> vx, vy, vz;
+	std::vector<accumulator_type> ax, ay, az;
+	std::vector<force_type> mass;
+
+	// Acceleration of object i, and its potential energy if asked
+	template <typename Law>
+	void field(const Law& law, int i, const std::vector<int>& sources, double* potential);
+
+	template <typename Law>
+	void all_fields(const Law& law, const std::vector<std::vector<int>>& attractor_lists, const std::vector<int>& list_of, double* potential_energy, Thread_pool* pool);
+};
+
+// Compiled once, in Precision_core.cpp
+extern template class Precision_core<precision_float>;
+extern template class Precision_core<precision_double>;
+extern template class Precision_core<precision_mixed>;
+
+std::unique_ptr<Integration_core> make_integration_core(precision p, double G);
+
+#endif // PRECISION_CORE_H
@@ -1,9 +1,28 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
 #include "vcl/vcl.hpp"
 #include <map>
+#include <memory>
+#include <vector>
 #include <string>
 #include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include "Octree.h"
+#include "Fmm.h"
+#include "Particle_mesh.h"
+#include "Kepler.h"
+#include "Ephemeris.h"
+#include "Gravity_kernel.h"
+#include "Thread_pool.h"
+#include "Diagnostics.h"
+#include "Precision_core.h"
+#include "Force_law.h"
 
 
+// Describes an object when it is added to the Simulator, or read back from it
 struct Mass_object {
 
 	float mass;
@@ -12,12 +31,13 @@ struct Mass_object {
 	vcl::vec3 axis;
 
 	vcl::vec3 speed;
-	vcl::vec3 last_move;
 
 	int attraction_level; // A mass object will only attract objects of lower "or equal" attraction levels (use to exclude tiny or giant objects)
 	bool attracts_similar = true; // removes the "or equal" condition of attraction_level
 
-	double potential_energy; // Let's keep things realistic
+	float radius = 0; // For collisions. Two objects of radius 0 never collide
+
+	double potential_energy; // Let's keep things realistic. As of the last energy evaluation of the Simulator
 	double total_energy; // For manual use only.
 
 	void update_energy() {
@@ -28,171 +48,1635 @@ struct Mass_object {
 
 const double G = 1; // Ignoring scale for now : all unit arbitrary;
 
-class Simulator { // Uses pointers  FOR NOW
+/* What happens when two objects touch during a step (see Simulator::set_collision_response)
+*
+* NONE: nothing is checked, objects go through each other (and the exact methods throw if they are at the same position)
+* MERGE: the lighter object is absorbed by the heavier one, conserving mass, momentum and volume (radius^3)
+* BOUNCE: the relative speed along the line of centers is reversed and multiplied by the restitution (1: elastic)
+* FLAG: the contact is only recorded, at every step during which the objects touch
+*/
+enum class collision_response {
+	NONE,
+	MERGE,
+	BOUNCE,
+	FLAG
+};
+
+// A contact found by the collision check
+struct Collision {
+	long long step; // Step during which the objects touch
+	int first, second; // Handles. After a merge, first is the merged object and second does not exist any more
+	double time; // Of the contact
+	vcl::vec3 position; // Contact point
+	float speed; // Relative speed at the contact
+};
+
+// Result of an energy evaluation of the Simulator
+struct Energy_report {
+	long long step; // Number of steps done at the evaluation
+	double kinetic;
+	double potential; // Each pair counted once
+	double total;
+	double drift; // (total - reference total) / (sum of the magnitudes of the terms): the reference is the first evaluation after a reset
+	double max_drift; // Largest |drift| since the reference was set
+};
+
+/* Integration schemes. All are symplectic: the energy error stays bounded instead of drifting, even with large timesteps
+*
+* LEAPFROG: kick-drift-kick velocity Verlet, 2nd order, one force evaluation per step
+* YOSHIDA4: 4th order composition of three leapfrog steps, three force evaluations per step
+* WISDOM_HOLMAN: the attraction of the central object (the Sun) is followed exactly along Kepler orbits,
+*	the other interactions are kicks (democratic heliocentric coordinates). Much larger steps for Sun-dominated systems
+* BLOCK_LEAPFROG: leapfrog where every object has its own power-of-two fraction of the timestep, chosen from its acceleration and jerk.
+*	Forces are only evaluated for the objects at the end of their step
+* HIERARCHICAL: objects given a parent (set_parent) move relative to it. The two-body orbit around the parent is followed exactly
+*	(Kepler drift), the rest of the forces, including the tide of the parent's own environment, are kicks.
+*	Deeper levels can get more kicks per step (set_hierarchy_substeps). Not symplectic, but time-symmetric
+*/
+enum class integrator {
+	LEAPFROG,
+	YOSHIDA4,
+	WISDOM_HOLMAN,
+	BLOCK_LEAPFROG,
+	HIERARCHICAL
+};
+
+// How the forces are evaluated at each step
+enum class force_method {
+	DIRECT, // Exact all-pairs sum, O(N^2)
+	DIRECT_SIMD, // Same sum with the vectorized kernel of Gravity_kernel.h (float precision)
+	BARNES_HUT, // Octree approximation, O(N log N). See Octree.h
+	FMM, // Fast multipole method, O(N). See Fmm.h
+	PARTICLE_MESH // FFT on a grid plus direct neighbours (P3M), for large roughly uniform populations. See Particle_mesh.h
+};
+
+/* Objects are stored as a structure of arrays: object i is at index i of every array, and the arrays stay dense.
+*
+* Indices change when objects are removed (the last object is swapped into the hole), so the outside world only sees handles.
+* A handle is given by add_object and stays valid until the object is removed. Freed handles are reused.
+*/
+class Simulator {
 
 public:
 
-	void add_object(std::string name, Mass_object * object) {
-		if (objects.count(name) != 0)
-			throw std::invalid_argument("An object with that name is already registered.");
+	// Returns the handle of the new object. Up-to-date potential energies are updated with its pairs, O(N); stale ones stay stale
+	int add_object(std::string name, const Mass_object& object) {
+		bool incremental = potentials_valid;
+		int handle = insert(name, object);
+		int i = size() - 1;
+
+		if (incremental) {
+			for (int j = 0; j < i; j++) {
+				potential_to(j, i);
+				potential_to(i, j);
+				update_energy(j);
+			}
+			update_energy(i);
+			potentials_valid = true;
+		}
+
+		return handle;
+	}
+
+	// Adds many objects at once: the interaction lists are rebuilt once, and the energies at the next evaluation
+	std::vector<int> add_objects(const std::vector<std::string>& names_, const std::vector<Mass_object>& objects) {
+		if (names_.size() != objects.size())
+			throw std::invalid_argument("There must be one name per object.");
+
+		std::vector<int> handles;
+		handles.reserve(objects.size());
+		for (size_t k = 0; k < objects.size(); k++)
+			handles.push_back(insert(names_[k], objects[k]));
+
+		return handles;
+	}
+
+	// Swap and pop: the last object takes the place of the removed one
+	void remove_object(int handle) {
+		int i = index(handle);
+		int last = (int)mass.size() - 1;
+
+		// Up-to-date potential energies lose the pairs of the removed object
+		if (potentials_valid) {
+			for (int j = 0; j <= last; j++) {
+				if (j != i && attracts(i, j)) {
+					potential_energy[j] -= pair_energy(i, j);
+					update_energy(j);
+				}
+			}
+		}
+
+		handle_by_name.erase(names[i]);
+
+		if (i != last) {
+			mass[i] = mass[last];
+			position[i] = position[last];
+			speed[i] = speed[last];
+			level[i] = level[last];
+			similar[i] = similar[last];
+			block_level[i] = block_level[last];
+			parent_handle[i] = parent_handle[last];
+			radius[i] = radius[last];
+			potential_energy[i] = potential_energy[last];
+			total_energy[i] = total_energy[last];
+			names[i] = names[last];
+			index_to_handle[i] = index_to_handle[last];
+			handle_to_index[index_to_handle[i]] = i;
+		}
+
+		mass.pop_back();
+		position.pop_back();
+		speed.pop_back();
+		level.pop_back();
+		similar.pop_back();
+		block_level.pop_back();
+		parent_handle.pop_back();
+		radius.pop_back();
+		potential_energy.pop_back();
+		total_energy.pop_back();
+		names.pop_back();
+		index_to_handle.pop_back();
+
+		handle_to_index[handle] = -1;
+		free_handles.push_back(handle);
+		forces_valid = false;
+		lists_valid = false;
+		reference_valid = false;
+		core_valid = false;
+		relative_valid = false;
+		particle_forces_valid = false;
+
+		// Its satellites become free objects
+		for (int& p : parent_handle)
+			if (p == handle)
+				p = -1;
+	}
+
+	// -1 if there is no object with that name
+	int find(std::string name) const {
+		auto it = handle_by_name.find(name);
+		return it == handle_by_name.end() ? -1 : it->second;
+	}
+
+	int size() const { return (int)mass.size(); }
+
+	// Handles of all objects, in storage order
+	const std::vector<int>& get_handles() const { return index_to_handle; }
+
+	// A copy of the current state of the object. Energies are those of the last energy evaluation
+	Mass_object get_object(int handle) const {
+		int i = index(handle);
+		Mass_object o;
+		o.mass = mass[i];
+		o.position = position[i];
+		o.speed = speed[i];
+		o.attraction_level = level[i];
+		o.attracts_similar = similar[i];
+		o.radius = radius[i];
+		o.potential_energy = potential_energy[i];
+		o.total_energy = total_energy[i];
+		return o;
+	}
+
+	const std::string& get_name(int handle) const { return names[index(handle)]; }
+	vcl::vec3 get_position(int handle) const { return position[index(handle)]; }
+	vcl::vec3 get_speed(int handle) const { return speed[index(handle)]; }
+	double get_potential_energy(int handle) const { return potential_energy[index(handle)]; }
+	double get_total_energy(int handle) const { return total_energy[index(handle)]; }
+
+	void set_position(int handle, vcl::vec3 p) { position[index(handle)] = p; forces_valid = false; potentials_valid = false; core_valid = false; relative_valid = false; particle_forces_valid = false; }
+	void set_speed(int handle, vcl::vec3 v) { speed[index(handle)] = v; core_valid = false; relative_valid = false; }
+	void set_radius(int handle, float r) { radius[index(handle)] = r; }
+
+	/* Collisions are checked at the start of every step, before any force is evaluated: each object is swept along a straight line
+	* over the step, and pairs of spheres that touch (or already overlap) get the response. Close encounters are resolved before
+	* they produce huge forces, so dense populations keep large steps. The broad phase sorts the swept boxes along x and sweeps them.
+	*/
+	void set_collision_response(collision_response r) { response = r; }
+	void set_restitution(float e) { restitution = e; }
+
+	// Contacts found since the last clear_collisions, in the order they were handled
+	const std::vector<Collision>& get_collisions() const { return collisions; }
+	void clear_collisions() { collisions.clear(); }
+
+	void set_force_method(force_method m) { method = m; forces_valid = false; }
+
+	// Barnes-Hut opening angle: smaller is more accurate, 0 is exact
+	void set_opening_angle(float theta) { tree.theta = theta; forces_valid = false; }
+
+	// FMM expansion order (1 to 8) and opening angle
+	void set_fmm_order(int p) { fmm.set_order(p); forces_valid = false; }
+	void set_fmm_opening_angle(float theta) { fmm.theta = theta; forces_valid = false; }
+
+	// Particle mesh: nodes per side (rounded up to a power of two, 16 to 512), and the direct correction of close pairs.
+	// Without it, gravity is softened below a few cells. The mesh takes about 200 size^3 bytes: 420 MB at 128, 3.4 GB at 256
+	void set_mesh_size(int size) { mesh.set_grid_size(size); forces_valid = false; }
+	void set_mesh_short_range(bool on) { mesh.short_range = on; forces_valid = false; }
+
+	// Below this number of objects the exact sum is used whatever the method (it is faster anyway)
+	void set_barnes_hut_threshold(int n) { barnes_hut_threshold = n; forces_valid = false; }
+
+	void set_integrator(integrator scheme_) { scheme = scheme_; }
+
+	// Central body of the Wisdom-Holman split. By default, the most massive object
+	void set_central_object(int handle) { central = handle; }
+
+	// BLOCK_LEAPFROG: objects step with timestep / 2^k, k <= max_level. Smaller eta means smaller steps (dt = eta * |acceleration| / |jerk|)
+	void set_block_timesteps(int max_level, double eta) {
+		block_max_level = std::max(0, std::min(max_level, 30));
+		block_eta = eta;
+	}
+
+	// Plummer softening length of the DIRECT forces (0, the default, for exact gravity). The tree and SIMD methods ignore it
+	void set_softening(double eps) {
+		softening = std::max(0.0, eps);
+		forces_valid = false;
+		potentials_valid = false;
+		core_forces_valid = false;
+	}
+
+	// Scalar types of DIRECT forces with LEAPFROG or YOSHIDA4, see Precision_core.h. Other methods and integrators work in float
+	void set_precision(precision p) {
+		scalar_precision = p;
+		core.reset();
+		core_valid = false;
+	}
+
+	precision get_precision() const { return scalar_precision; }
+
+	// HIERARCHICAL: the object moves relative to parent (a handle, -1 for none)
+	void set_parent(int handle, int parent) {
+		int i = index(handle);
+		if (parent != -1 && index(parent) == i)
+			throw std::invalid_argument("An object cannot be its own parent.");
+		parent_handle[i] = parent;
+		relative_valid = false;
+	}
+
+	int get_parent(int handle) const { return parent_handle[index(handle)]; }
+
+	// (child, parent) links by name, for example from drawable_hierarchy in orbit_object.h. Names that are not registered are skipped
+	void set_hierarchy(const std::vector<std::pair<std::string, std::string>>& links) {
+		for (const auto& link : links) {
+			int child = find(link.first), parent = find(link.second);
+			if (child != -1 && parent != -1)
+				set_parent(child, parent);
+		}
+	}
+
+	// HIERARCHICAL: objects of depth d (1 for the satellites of a free object, 2 for theirs...) are kicked n^(d-1) times per step
+	void set_hierarchy_substeps(int n) { hierarchy_substeps = std::max(1, n); }
+
+	// DIRECT_SIMD uses the best instruction set available, unless a lower one is asked for
+	void set_simd_level(simd_level level) {
+		kernel = get_gravity_kernel(level);
+		swarm_kernel = get_swarm_kernel(level);
+		forces_valid = false;
+	}
+
+	/* Restricted problem: rails and test particles
+	*
+	* A rail is a massive body whose position is a known function of time (an Orbit_Object for example, see rail_of in orbit_object.h).
+	* It attracts every object and every test particle, and nothing moves it.
+	* Test particles are massless: they feel the rails and the objects but attract nothing, and only have an index.
+	* They are stored apart, coordinate by coordinate, and advanced with leapfrog whatever the integrator, so a step costs
+	* O(particles * (rails + objects)) for them.
+	*/
+	int add_rail(std::string name, float rail_mass, std::function<vcl::vec3(double)> rail_position) {
+		rails.push_back({ name, rail_mass, rail_position });
+		rail_time = std::nan("");
+		forces_valid = false;
+		core_valid = false;
+		particle_forces_valid = false;
+		return (int)rails.size() - 1;
+	}
+
+	int get_rail_count() const { return (int)rails.size(); }
+	const std::string& get_rail_name(int rail) const { return rails.at(rail).name; }
+	vcl::vec3 get_rail_position(int rail) const { return rails.at(rail).position(current_time); }
+
+	// Returns the index of the first new particle
+	int add_test_particles(const std::vector<vcl::vec3>& positions, const std::vector<vcl::vec3>& speeds) {
+		if (positions.size() != speeds.size())
+			throw std::invalid_argument("There must be one speed per test particle.");
+		int first = get_test_particle_count();
+		for (size_t k = 0; k < positions.size(); k++) {
+			particle_x.push_back(positions[k].x);
+			particle_y.push_back(positions[k].y);
+			particle_z.push_back(positions[k].z);
+			particle_vx.push_back(speeds[k].x);
+			particle_vy.push_back(speeds[k].y);
+			particle_vz.push_back(speeds[k].z);
+		}
+		particle_forces_valid = false;
+		return first;
+	}
+
+	void clear_test_particles() {
+		for (auto* a : { &particle_x, &particle_y, &particle_z, &particle_vx, &particle_vy, &particle_vz, &particle_ax, &particle_ay, &particle_az })
+			a->clear();
+	}
+
+	int get_test_particle_count() const { return (int)particle_x.size(); }
+	vcl::vec3 get_test_particle_position(int k) const { return vcl::vec3(particle_x.at(k), particle_y.at(k), particle_z.at(k)); }
+	vcl::vec3 get_test_particle_speed(int k) const { return vcl::vec3(particle_vx.at(k), particle_vy.at(k), particle_vz.at(k)); }
+
+	// Time of the simulation, advanced by simulate. The rails are evaluated at it
+	double get_time() const { return current_time; }
+	void set_time(double t) {
+		current_time = t;
+		forces_valid = false;
+		core_valid = false;
+		particle_forces_valid = false;
+	}
+
+	/* Simulates [get_time(), get_time() + duration] and fits the positions of the objects of handles, see Ephemeris.h.
+	* Steps are at most max_timestep, shortened to land on every sample time. The simulation is left at the end of the ephemeris
+	*/
+	Ephemeris record_ephemeris(const std::vector<int>& handles, double duration, double segment_length, int degree, double max_timestep) {
+		if (!(max_timestep > 0))
+			throw std::invalid_argument("The timestep must be positive.");
+
+		std::vector<std::string> object_names;
+		for (int h : handles)
+			object_names.push_back(get_name(h));
+
+		auto advance_to = [&](double t) {
+			while (t - current_time > 1e-12 * std::abs(t)) // Rounding of the time
+				simulate(std::min(t - current_time, max_timestep));
+		};
+
+		Ephemeris e = Ephemeris::build(object_names, current_time, current_time + duration, segment_length, degree, [&](double t, vcl::vec3* out) {
+			advance_to(t);
+			for (size_t k = 0; k < handles.size(); k++)
+				out[k] = get_position(handles[k]);
+		});
+		advance_to(e.get_end_time());
+		return e;
+	}
+
+	// Largest relative difference between the accelerations given by DIRECT_SIMD and DIRECT, for the current positions
+	double check_simd_kernel() {
+		force_method saved = method;
+
+		method = force_method::DIRECT;
+		compute_forces(-1);
+		std::vector<vcl::vec3> reference = acceleration;
 
-		// Update potential energy
-		object->potential_energy = 0;
+		method = force_method::DIRECT_SIMD;
+		compute_forces(-1);
 
-		for (auto obj : objects) {
-			potential_to(*obj.second, *object);
-			potential_to(*object, *obj.second);
-			obj.second->update_energy();
+		double error = 0;
+		for (int i = 0; i < size(); i++) {
+			double a = vcl::norm(reference[i]);
+			if (a > 0)
+				error = std::max(error, (double)vcl::norm(acceleration[i] - reference[i]) / a);
 		}
-		
-		objects[name] = object;
-		object->update_energy();
+
+		method = saved;
+		forces_valid = false;
+		return error;
+	}
+
+	// Threads used by the force evaluation (the calling thread included). Results do not depend on it
+	void set_threads(int n) {
+		n = std::max(1, n);
+		if (n == get_threads())
+			return;
+		pool.reset(n > 1 ? new Thread_pool(n) : nullptr);
 	}
 
-	void remove_object(std::string name) {
-		objects.erase(name);
+	int get_threads() const { return pool ? pool->size() : 1; }
+
+	// Number of single-object force evaluations since the creation of the Simulator
+	long long get_force_evaluations() const { return force_evaluations; }
+
+	// Records are sent to d while it is set (nullptr to stop). See Diagnostics.h for the compile-time level
+	void set_diagnostics(Diagnostics* d) { diagnostics = d; }
+
+	/* Energies are not part of the step: the force evaluation only computes potentials when an evaluation is due.
+	*
+	* Every k steps (0, the default: never) the energies of all objects and of the system are evaluated, which also sends a diagnostics record.
+	* evaluate_energy does it on demand, with an extra force evaluation only if the potentials are stale.
+	*/
+	void set_energy_interval(int k) { energy_interval = std::max(0, k); }
+
+	const Energy_report& evaluate_energy() {
+		if (!potentials_valid) {
+			with_potentials = true;
+			compute_forces(-1);
+			with_potentials = false;
+			potentials_valid = true;
+		}
+
+#if SIMULATOR_DIAGNOSTICS >= 2
+		if (diagnostics)
+			previous_total_energy = total_energy;
+#endif
+
+		/* Each pair counted once. potential_energy[i] holds the pairs of the objects attracting i: a mutual pair (same level, both
+		* attracting similar objects) is in the potentials of both objects, one half each; a one-sided pair only in the attracted one.
+		* An object that does not attract similar ones has one-sided pairs only, one that does has its one-sided pairs with the higher levels
+		*/
+		if (!lists_valid)
+			build_interaction_lists();
+		double kinetic = 0, potential = 0, scale = 0;
+		for (int i = 0; i < size(); i++) {
+			update_energy(i);
+			double k = 0.5 * mass[i] * vcl::dot(speed[i], speed[i]);
+			double own = potential_energy[i];
+			if (similar[i]) {
+				double one_sided = 0;
+				for (int j : higher_lists[list_of[i]])
+					one_sided += pair_energy(j, i);
+				own = one_sided + 0.5 * (potential_energy[i] - one_sided);
+			}
+			kinetic += k;
+			potential += own;
+			scale += k + std::abs(own);
+		}
+
+		Energy_report& r = last_energy;
+		r.step = step_count;
+		r.kinetic = kinetic;
+		r.potential = potential;
+		r.total = kinetic + potential;
+		if (!reference_valid) {
+			reference_energy = r.total;
+			r.max_drift = 0;
+			reference_valid = true;
+		}
+		r.drift = scale > 0 ? (r.total - reference_energy) / scale : 0;
+		r.max_drift = std::max(r.max_drift, std::abs(r.drift));
+
+#if SIMULATOR_DIAGNOSTICS >= 1
+		if (diagnostics)
+			diagnostics->push({ diagnostic_type::STEP, step_count, -1, last_timestep, r.drift });
+#endif
+#if SIMULATOR_DIAGNOSTICS >= 2
+		if (diagnostics && previous_speed.size() == speed.size() && previous_total_energy.size() == total_energy.size()) {
+			for (int i = 0; i < size(); i++)
+				diagnostics->push({ diagnostic_type::OBJECT, step_count, index_to_handle[i], vcl::norm(speed[i] - previous_speed[i]), total_energy[i] - previous_total_energy[i] });
+		}
+#endif
+
+		return r;
 	}
 
+	// Result of the last evaluation, without computing anything
+	const Energy_report& get_last_energy() const { return last_energy; }
+
+	// The next evaluation becomes the reference of the drift. Also done when objects are added or removed
+	void reset_energy_reference() { reference_valid = false; }
+
+	// Kinetic energy plus potential energy, each pair counted once. Evaluated now
+	double get_system_energy() { return evaluate_energy().total; }
+
 	void simulate(double timestep) {
 
-		for (auto obj1 : objects) {
+		if (response != collision_response::NONE)
+			handle_collisions(timestep);
 
-			vcl::vec3 delta_speed;
+#if SIMULATOR_DIAGNOSTICS >= 2
+		if (diagnostics)
+			previous_speed = speed;
+#endif
 
-			for (auto obj2 : objects) {
-				// Here we look at the effect of obj2 on obj1 (there may be more efficient ways)
-				
-				if (obj1.first == obj2.first)
-					continue;
+		if (scheme != integrator::HIERARCHICAL)
+			relative_valid = false;
+
+		// Potentials are only computed by the force evaluations of a step that ends with an energy evaluation
+		const bool energy_due = energy_interval > 0 && (step_count + 1) % energy_interval == 0;
+		with_potentials = energy_due;
+		potentials_valid = false;
+
+		// The test particles need the sources at the start of the step
+		const bool swarm = !particle_x.empty();
+		if (swarm && !particle_forces_valid)
+			swarm_forces();
+
+		position_time = current_time;
+
+		switch (scheme) {
+		case integrator::LEAPFROG:
+			step_leapfrog(timestep);
+			break;
+		case integrator::YOSHIDA4:
+			// Three leapfrog steps whose errors cancel out up to the 4th order
+			step_leapfrog(yoshida_w1 * timestep);
+			step_leapfrog(yoshida_w0 * timestep);
+			step_leapfrog(yoshida_w1 * timestep);
+			break;
+		case integrator::WISDOM_HOLMAN:
+			step_wisdom_holman(timestep);
+			break;
+		case integrator::BLOCK_LEAPFROG:
+			step_block_leapfrog(timestep);
+			break;
+		case integrator::HIERARCHICAL:
+			step_hierarchical(timestep);
+			break;
+		}
+
+		current_time += timestep;
+		position_time = current_time;
+
+		if (swarm)
+			step_swarm(timestep);
+
+		with_potentials = false;
+		potentials_valid = energy_due;
+		last_timestep = timestep;
+		step_count++;
+
+		if (energy_due)
+			evaluate_energy();
+	}
+
+	/* One step of at most max_timestep, as long as the motion allows, and returns its length. The step is
+	* eta * min |acceleration| / |jerk| over the objects (the criterion of BLOCK_LEAPFROG), the jerk being the change of the
+	* accelerations during the previous adaptive step, and grows by 2 at most from one step to the next. The first one is
+	* eta * min |speed| / |acceleration|. Made to cover long spans in few force evaluations, see Time_warp.h
+	*/
+	double simulate_adaptive(double max_timestep, double eta = 0.05) {
+		if (!(max_timestep > 0) || !(eta > 0))
+			throw std::invalid_argument("The timestep and eta must be positive.");
+
+		if (!forces_valid || forces_excluded != -1 || (int)acceleration.size() != size())
+			compute_forces(-1);
+		if ((int)adaptive_acceleration.size() != size())
+			adaptive_timestep = 0; // Objects were added or removed
+
+		double dt = adaptive_timestep;
+		if (dt <= 0) {
+			dt = max_timestep / (1 << block_max_level); // Everything at rest: grows from there
+			double scale = 0;
+			for (int i = 0; i < size(); i++) {
+				float a = vcl::norm(acceleration[i]), v = vcl::norm(speed[i]);
+				if (a > 0 && v > 0)
+					scale = scale > 0 ? std::min(scale, eta * v / a) : eta * v / a;
+			}
+			if (scale > 0)
+				dt = scale;
+		}
+		dt = std::min(dt, max_timestep);
+
+		adaptive_acceleration = acceleration;
+		simulate(dt);
+
+		// The jerk compares full fields: WISDOM_HOLMAN leaves the interactions only, without the central object
+		if (!forces_valid || forces_excluded != -1)
+			compute_forces(-1);
+
+		double next = 2 * dt;
+		for (int i = 0; i < size(); i++) {
+			double jerk = vcl::norm(acceleration[i] - adaptive_acceleration[i]) / dt;
+			if (jerk > 0)
+				next = std::min(next, eta * vcl::norm(acceleration[i]) / jerk);
+		}
+		adaptive_timestep = next;
+		return dt;
+	}
+
+	void simulate(double time, double timestep) {
 
-				// Update potential energy
-				obj1.second->potential_energy = 0;
-				double force = potential_to(*obj2.second, *obj1.second);
+		int n_timesteps = (int)(time / timestep);
 
-				if (force != -1.0) { // This tells us that obj2 attracts obj1
-					delta_speed += force * (obj2.second->position - obj1.second->position)*timestep;
-					
+		for (int i = 0; i < n_timesteps; i++)
+			simulate(timestep);
+
+		double remaining = time - timestep * n_timesteps;
+		if (remaining > 0)
+			simulate(remaining);
+
+	}
+
+private:
+
+	// Object arrays, all indexed the same way
+	std::vector<float> mass;
+	std::vector<vcl::vec3> position;
+	std::vector<vcl::vec3> speed;
+	std::vector<vcl::vec3> acceleration;
+	std::vector<int> level; // attraction_level
+	std::vector<char> similar; // attracts_similar
+	std::vector<int> block_level; // BLOCK_LEAPFROG: the object steps with timestep / 2^block_level. -1 until it is chosen
+	std::vector<int> parent_handle; // HIERARCHICAL: -1 for a free object
+	std::vector<float> radius;
+	std::vector<double> potential_energy;
+	std::vector<double> total_energy;
+
+	// Side tables
+	std::vector<std::string> names;
+	std::map<std::string, int> handle_by_name;
+	std::vector<int> handle_to_index; // -1 for a free handle
+	std::vector<int> index_to_handle;
+	std::vector<int> free_handles;
+
+	force_method method = force_method::DIRECT;
+	int barnes_hut_threshold = 256;
+	Octree tree;
+	Fmm fmm;
+	Particle_mesh mesh;
+	std::vector<vcl::vec3> system_field; // Methods that handle the whole system at once
+	std::vector<double> system_potential;
+	gravity_field_fn kernel = nullptr;
+	std::unique_ptr<Thread_pool> pool;
+
+	Diagnostics* diagnostics = nullptr;
+	long long step_count = 0;
+	std::vector<vcl::vec3> previous_speed;
+	std::vector<double> previous_total_energy;
+
+	integrator scheme = integrator::LEAPFROG;
+	int central = -1; // Handle
+
+	// Yoshida coefficients: w1 = 1 / (2 - 2^(1/3)), w0 = 1 - 2 w1
+	const double yoshida_w1 = 1.3512071919596578;
+	const double yoshida_w0 = -1.7024143839193155;
+
+	// acceleration matches the current positions. Lets a step reuse the last evaluation of the previous one
+	bool forces_valid = false;
+
+	// Energy accounting
+	int energy_interval = 0;
+	bool with_potentials = false; // compute_forces also fills potential_energy
+	bool potentials_valid = false; // potential_energy matches the current positions
+	bool reference_valid = false;
+	double reference_energy = 0;
+	double last_timestep = 0;
+	Energy_report last_energy = {};
+
+	bool lists_valid = false;
+	std::vector<std::vector<int>> attractor_lists; // One per distinct level
+	std::vector<std::vector<int>> higher_lists; // Same, with the higher levels only: the attractors that are not attracted back
+	std::vector<int> list_of; // Index in attractor_lists of each object's level
+	std::vector<Gravity_sources> level_sources; // attractor_lists packed for the vectorized kernel
+	int forces_excluded = -1;
+
+	int block_max_level = 10;
+	double block_eta = 0.05;
+	long long force_evaluations = 0;
+
+	// simulate_adaptive: next step, and the accelerations at the start of the last one
+	double adaptive_timestep = 0;
+	std::vector<vcl::vec3> adaptive_acceleration;
+
+	// Block timestep work arrays
+	std::vector<int> active;
+	std::vector<vcl::vec3> previous_acceleration;
+
+	// Wisdom-Holman work arrays
+	std::vector<vcl::vec3> helio_position;
+	std::vector<vcl::vec3> bary_speed;
+
+	// Collisions
+	collision_response response = collision_response::NONE;
+	float restitution = 1;
+	std::vector<Collision> collisions;
+	std::vector<int> sweep_order;
+	std::vector<int> sweep_active;
+
+	// Restricted problem
+	struct Rail {
+		std::string name;
+		float mass;
+		std::function<vcl::vec3(double)> position;
+	};
+	std::vector<Rail> rails;
+	std::vector<vcl::vec3> rail_position;
+	double rail_time = std::nan(""); // Time of rail_position
+	double current_time = 0;
+	double position_time = 0; // Time of the positions during a step, for the rails
+	std::vector<float> particle_x, particle_y, particle_z;
+	std::vector<float> particle_vx, particle_vy, particle_vz;
+	std::vector<float> particle_ax, particle_ay, particle_az; // Without G
+	bool particle_forces_valid = false;
+	Swarm_sources swarm_sources;
+	gravity_swarm_fn swarm_kernel = nullptr;
+
+	// Direct leapfrog core in the chosen precision
+	precision scalar_precision = precision::FLOAT;
+	std::unique_ptr<Integration_core> core;
+	double softening = 0;
+	bool core_valid = false; // The core holds the current state (in more precision than the arrays)
+	bool core_forces_valid = false;
+
+	// Hierarchical work arrays. The relative state is kept between steps, as it is more precise than the absolute one for tight satellites
+	int hierarchy_substeps = 1;
+	bool relative_valid = false;
+	std::vector<int> parent_index; // -1 for a free object
+	std::vector<int> depth;
+	std::vector<int> by_depth; // Parents before their satellites
+	std::vector<double> weight; // Mass of the barycenter of each object, see hierarchy_weights
+	std::vector<vcl::vec3> relative_position; // Barycenter to parent. Absolute for free objects
+	std::vector<vcl::vec3> relative_speed;
+	std::vector<vcl::vec3> barycenter_acceleration;
+	std::vector<vcl::vec3> perturbation;
+	std::vector<vcl::vec3> sums;
+	std::vector<char> needed;
+
+	// Appends an object to the arrays and gives it a handle
+	int insert(const std::string& name, const Mass_object& object) {
+		if (handle_by_name.count(name) != 0)
+			throw std::invalid_argument("An object with that name is already registered.");
+
+		int i = (int)mass.size();
+
+		mass.push_back(object.mass);
+		position.push_back(object.position);
+		speed.push_back(object.speed);
+		level.push_back(object.attraction_level);
+		similar.push_back(object.attracts_similar);
+		block_level.push_back(-1);
+		parent_handle.push_back(-1);
+		radius.push_back(object.radius);
+		potential_energy.push_back(0);
+		total_energy.push_back(0);
+		names.push_back(name);
+
+		int handle;
+		if (free_handles.empty()) {
+			handle = (int)handle_to_index.size();
+			handle_to_index.push_back(i);
+		}
+		else {
+			handle = free_handles.back();
+			free_handles.pop_back();
+			handle_to_index[handle] = i;
+		}
+		index_to_handle.push_back(handle);
+		handle_by_name[name] = handle;
+		forces_valid = false;
+		lists_valid = false;
+		potentials_valid = false;
+		reference_valid = false;
+		core_valid = false;
+		relative_valid = false;
+		particle_forces_valid = false;
+
+		return handle;
+	}
+
+	/* Interaction lists: for every attraction level present, the indices of the objects that attract that level.
+	* The direct methods only go through the list of their target, so tiny objects only see the massive ones.
+	* Levels never change, so the lists are only rebuilt after an object is added or removed.
+	*/
+	void build_interaction_lists() {
+		std::vector<int> distinct(level);
+		std::sort(distinct.begin(), distinct.end());
+		distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+
+		attractor_lists.assign(distinct.size(), std::vector<int>());
+		higher_lists.assign(distinct.size(), std::vector<int>());
+		list_of.resize(size());
+
+		for (size_t k = 0; k < distinct.size(); k++) {
+			for (int j = 0; j < size(); j++) {
+				if (level[j] > distinct[k] || (level[j] == distinct[k] && similar[j]))
+					attractor_lists[k].push_back(j);
+				if (level[j] > distinct[k])
+					higher_lists[k].push_back(j);
+			}
+		}
+		for (int i = 0; i < size(); i++)
+			list_of[i] = (int)(std::lower_bound(distinct.begin(), distinct.end(), level[i]) - distinct.begin());
+
+		lists_valid = true;
+	}
+
+	int index(int handle) const {
+		if (handle < 0 || handle >= (int)handle_to_index.size() || handle_to_index[handle] == -1)
+			throw std::invalid_argument("Invalid object handle.");
+		return handle_to_index[handle];
+	}
+
+	void update_energy(int i) {
+		total_energy[i] = 0.5 * std::pow(vcl::norm(speed[i]), 2) * mass[i] + potential_energy[i];
+	}
+
+	// Whether object from attracts object to
+	bool attracts(int from, int to) const {
+		return level[from] > level[to] || (level[from] == level[to] && similar[from]);
+	}
+
+	void kick(double dt) {
+		for (int i = 0; i < size(); i++)
+			speed[i] += acceleration[i] * dt;
+	}
+
+	// Kick-drift-kick
+	void step_leapfrog(double dt) {
+
+		if (method == force_method::DIRECT && rails.empty()) {
+			step_leapfrog_core(dt);
+			return;
+		}
+		core_valid = false;
+
+		if (!forces_valid || forces_excluded != -1)
+			compute_forces(-1);
+
+		kick(dt / 2);
+
+		for (int i = 0; i < size(); i++)
+			position[i] += speed[i] * dt;
+		position_time += dt;
+
+		compute_forces(-1);
+
+		kick(dt / 2);
+	}
+
+	// Same step in the precision of the core, which keeps its state between steps as long as the objects are not modified from outside
+	void step_leapfrog_core(double dt) {
+
+		if (!core)
+			core = make_integration_core(scalar_precision, G);
+		core->set_softening(softening);
+
+		if (!core_valid) {
+			core->load(position.data(), speed.data(), mass.data(), size());
+			core_forces_valid = false;
+		}
+		if (!lists_valid)
+			build_interaction_lists();
+
+		if (!core_forces_valid)
+			core_forces();
+
+		core->kick(dt / 2);
+		core->drift(dt);
+		core_forces();
+		core->kick(dt / 2);
+
+		acceleration.resize(size());
+		core->store(position.data(), speed.data(), acceleration.data());
+		core_valid = true;
+		forces_valid = true;
+		forces_excluded = -1;
+	}
+
+	void core_forces() {
+		core->compute_forces(attractor_lists, list_of, with_potentials ? potential_energy.data() : nullptr, pool.get());
+		force_evaluations += size();
+		core_forces_valid = true;
+	}
+
+	/* Block timesteps: the timestep is split in 2^block_max_level ticks.
+	*
+	* An object of level k is active every 2^(block_max_level - k) ticks: it is kicked by half its step at the start, and at the end
+	* its force is evaluated again and it is kicked by the other half. Nothing happens between the ends of the smallest steps:
+	* the loop jumps from one to the next, and every object drifts over the whole span. With every object at level 0, the
+	* timestep is a single leapfrog step. At the end of the timestep all objects are synchronized.
+	*/
+	void step_block_leapfrog(double dt) {
+
+		const int n = size();
+		const int kmax = block_max_level;
+		core_valid = false;
+		const long long ticks = 1LL << kmax;
+		const double tick_dt = dt / ticks;
+
+		if (!forces_valid || forces_excluded != -1)
+			compute_forces(-1);
+
+		for (int i = 0; i < n; i++)
+			if (block_level[i] < 0 || block_level[i] > kmax)
+				block_level[i] = kmax; // Unknown jerk: smallest step first
+
+		previous_acceleration.resize(n);
+
+		long long tick = 0;
+		while (tick < ticks) {
+
+			long long smallest = ticks;
+			for (int i = 0; i < n; i++) {
+				long long stride = 1LL << (kmax - block_level[i]);
+				smallest = std::min(smallest, stride);
+				if (tick % stride == 0) {
+					previous_acceleration[i] = acceleration[i];
+					speed[i] += acceleration[i] * (0.5 * stride * tick_dt);
 				}
+			}
 
+			// Strides are powers of 2: the next end of a step is the next multiple of the smallest one
+			const long long next = (tick / smallest + 1) * smallest;
+			const double span = (next - tick) * tick_dt;
+			for (int i = 0; i < n; i++)
+				position[i] += speed[i] * span;
+			position_time += span;
+			tick = next;
+
+			active.clear();
+			for (int i = 0; i < n; i++)
+				if (tick % (1LL << (kmax - block_level[i])) == 0)
+					active.push_back(i);
+
+			compute_forces(-1, &active);
+
+			for (int i : active) {
+				long long stride = 1LL << (kmax - block_level[i]);
+				double step = stride * tick_dt;
+				speed[i] += acceleration[i] * (0.5 * step);
+
+				// New level from |a| / |da/dt|
+				double jerk = vcl::norm(acceleration[i] - previous_acceleration[i]) / step;
+				double a = vcl::norm(acceleration[i]);
+				int wanted = 0;
+				if (jerk > 0 && a > 0)
+					wanted = (int)std::ceil(std::log2(dt * jerk / (block_eta * a)));
+				wanted = std::max(0, std::min(wanted, kmax));
+
+				// Smaller steps are always possible, larger ones only one level at a time and when they stay aligned on the block grid
+				if (wanted > block_level[i])
+					block_level[i] = wanted;
+				else if (wanted < block_level[i] && tick % (2 * stride) == 0)
+					block_level[i]--;
 			}
+		}
+	}
 
+	// parent_index, depth and by_depth from parent_handle
+	void build_hierarchy() {
+		const int n = size();
+		parent_index.resize(n);
+		depth.assign(n, -1);
+		for (int i = 0; i < n; i++)
+			parent_index[i] = parent_handle[i] == -1 ? -1 : handle_to_index[parent_handle[i]];
 
-			// Now we force conserved total energy
+		for (int i = 0; i < n; i++) {
+			int d = 0;
+			for (int p = parent_index[i]; p != -1; p = parent_index[p])
+				if (++d > n)
+					throw std::invalid_argument("The parents of the objects form a cycle.");
+			depth[i] = d;
+		}
 
-			vcl::vec3 last_move = obj1.second->last_move;
-			obj1.second->last_move = delta_speed;
-			obj1.second->speed += delta_speed;
+		by_depth.resize(n);
+		for (int i = 0; i < n; i++)
+			by_depth[i] = i;
+		std::stable_sort(by_depth.begin(), by_depth.end(), [this](int a, int b) { return depth[a] < depth[b]; });
+	}
 
-			if (obj1.second->total_energy - obj1.second->potential_energy < 0) {
-				std::cout << "energy gain: " << obj1.second->potential_energy - obj1.second->total_energy << std::endl;
-				obj1.second->total_energy = obj1.second->potential_energy;
-				continue;
+	/* Jacobi-style coordinates: an object with satellites moves, relative to its parent, as the barycenter of itself and its satellites.
+	*
+	* Only the satellites that attract their parent count in its barycenter (weight), so that a satellite too small to move its parent
+	* does not make the barycenter wobble. relative_position[i] is the barycenter of i minus the position of its parent (absolute for free objects).
+	*/
+	void hierarchy_weights() {
+		const int n = size();
+		weight.assign(mass.begin(), mass.end());
+		for (int k = n - 1; k >= 0; k--) {
+			int i = by_depth[k];
+			int p = parent_index[i];
+			if (p != -1 && attracts(i, p))
+				weight[p] += weight[i];
+		}
+	}
+
+	// Weighted mean of values over each barycenter (children before parents)
+	void barycenter_values(const std::vector<vcl::vec3>& values, std::vector<vcl::vec3>& result) {
+		const int n = size();
+		sums.resize(n);
+		for (int i = 0; i < n; i++)
+			sums[i] = mass[i] * values[i];
+		result.resize(n);
+		for (int k = n - 1; k >= 0; k--) {
+			int i = by_depth[k];
+			result[i] = weight[i] > 0 ? sums[i] / float(weight[i]) : values[i];
+			int p = parent_index[i];
+			if (p != -1 && attracts(i, p))
+				sums[p] += sums[i];
+		}
+	}
+
+	void to_relative() {
+		const int n = size();
+		barycenter_values(position, relative_position);
+		barycenter_values(speed, relative_speed);
+		for (int i = 0; i < n; i++) {
+			int p = parent_index[i];
+			if (p != -1) {
+				relative_position[i] -= position[p];
+				relative_speed[i] -= speed[p];
 			}
+		}
+	}
 
+	// Positions (or speeds) of the objects from their relative values, parents first
+	void to_absolute(const std::vector<vcl::vec3>& relative, std::vector<vcl::vec3>& absolute) {
+		const int n = size();
+		sums.assign(n, vcl::vec3());
+		for (int i = 0; i < n; i++) {
+			int p = parent_index[i];
+			if (p != -1 && attracts(i, p))
+				sums[p] += float(weight[i]) * relative[i];
+		}
+		for (int i : by_depth) {
+			int p = parent_index[i];
+			vcl::vec3 barycenter = p == -1 ? relative[i] : absolute[p] + relative[i];
+			absolute[i] = weight[i] > 0 ? barycenter - sums[i] / float(weight[i]) : barycenter;
+		}
+	}
 
-			double last_speed_norm2 = std::pow(vcl::norm(last_move), 2);
+	// G (m_parent + weight of the object), with only the masses that attract
+	double hierarchy_mu(int i) const {
+		int p = parent_index[i];
+		return G * ((attracts(p, i) ? mass[p] : 0.0) + (attracts(i, p) ? weight[i] : 0.0));
+	}
+
+	// Relative acceleration of the barycenter of object i that the Kepler drift does not follow: everything but the two-body pull with the parent.
+	// Objects at the end of their step have fresh accelerations, and so do their satellites and parent
+	void hierarchy_perturbation(int i) {
+		int p = parent_index[i];
+		if (p == -1) {
+			perturbation[i] = barycenter_acceleration[i];
+			return;
+		}
+		vcl::vec3 r = relative_position[i];
+		float d = vcl::norm(r);
+		float d3 = d * d * d;
+		vcl::vec3 pair_i = attracts(p, i) ? -float(G * mass[p] / d3) * r : vcl::vec3();
+		vcl::vec3 pair_p = attracts(i, p) ? float(G * weight[i] / d3) * r : vcl::vec3();
+		perturbation[i] = (barycenter_acceleration[i] - pair_i) - (acceleration[p] - pair_p);
+	}
+
+	/* Hierarchical step: relative kick, drift, relative kick, with the timestep split in ticks for the deeper levels.
+	*
+	* An object of depth d is active every stride = ticks / substeps^(d-1) ticks, like in step_block_leapfrog; its satellites are active at least as often.
+	* Everybody drifts at every tick: free objects in a straight line, the others along their Kepler orbit around the parent.
+	*/
+	void step_hierarchical(double dt) {
 
-			if (last_speed_norm2 == 0) continue;
+		const int n = size();
+		core_valid = false;
+		build_hierarchy();
+		hierarchy_weights();
 
-			double speed2 = std::pow(vcl::norm(obj1.second->speed), 2);
-			double expected_speed = std::sqrt(2 * (obj1.second->total_energy - obj1.second->potential_energy) / obj1.second->mass);
-			double angle = vcl::dot(last_move, obj1.second->speed);
+		int max_depth = 0;
+		for (int i = 0; i < n; i++)
+			max_depth = std::max(max_depth, depth[i]);
 
-			double A = last_speed_norm2;
-			double B = -2 * angle;
-			double C = speed2 - expected_speed * expected_speed;
+		// At most 4096 ticks: the deepest levels share the same rate beyond that
+		long long ticks = 1;
+		int levels = 0;
+		while (levels < max_depth - 1 && ticks * hierarchy_substeps <= 4096) {
+			ticks *= hierarchy_substeps;
+			levels++;
+		}
+		std::vector<long long> stride_of_depth(max_depth + 1, ticks);
+		for (int d = 2; d <= max_depth; d++) {
+			long long kicks = 1;
+			for (int k = 0; k < std::min(d - 1, levels); k++)
+				kicks *= hierarchy_substeps;
+			stride_of_depth[d] = ticks / kicks;
+		}
+		const double tick_dt = dt / ticks;
+
+		if (!relative_valid)
+			to_relative();
 
-			double delta = B * B - 4 * A * C;
+		if (!forces_valid || forces_excluded != -1)
+			compute_forces(-1);
+		perturbation.resize(n);
+		barycenter_values(acceleration, barycenter_acceleration);
+		for (int i = 0; i < n; i++)
+			hierarchy_perturbation(i);
 
-			double lambda = 0;
+		for (long long tick = 0; tick < ticks; tick++) {
+
+			for (int i = 0; i < n; i++) {
+				long long stride = stride_of_depth[depth[i]];
+				if (tick % stride == 0)
+					relative_speed[i] += perturbation[i] * float(0.5 * stride * tick_dt);
+			}
 
-			if (delta >= 0) {
-				if (B > 0)
-					lambda = (-B + std::sqrt(delta)) / 2 / A;
+			for (int i = 0; i < n; i++) {
+				double mu = parent_index[i] == -1 ? 0.0 : hierarchy_mu(i);
+				if (mu > 0)
+					kepler_drift(relative_position[i], relative_speed[i], mu, tick_dt);
 				else
-					lambda = (-B - std::sqrt(delta)) / 2 / A;
+					relative_position[i] += relative_speed[i] * float(tick_dt);
 			}
+			to_absolute(relative_position, position);
+			position_time += tick_dt;
+
+			// The active objects, and their parents for the tide
+			active.clear();
+			needed.assign(n, 0);
+			for (int i = 0; i < n; i++) {
+				if ((tick + 1) % stride_of_depth[depth[i]] == 0) {
+					active.push_back(i);
+					needed[i] = 1;
+					if (parent_index[i] != -1)
+						needed[parent_index[i]] = 1;
+				}
+			}
+			if (active.empty())
+				continue;
+
+			if ((int)active.size() == n)
+				compute_forces(-1);
 			else {
-				lambda = -B / 2 / A;
+				std::vector<int> targets;
+				for (int i = 0; i < n; i++)
+					if (needed[i])
+						targets.push_back(i);
+				compute_forces(-1, &targets);
 			}
-			
-			obj1.second->speed -= lambda * last_move;
+			barycenter_values(acceleration, barycenter_acceleration);
 
-			std::cout << "delta1 " << delta << std::endl;
+			for (int i : active) {
+				hierarchy_perturbation(i);
+				long long stride = stride_of_depth[depth[i]];
+				relative_speed[i] += perturbation[i] * float(0.5 * stride * tick_dt);
+			}
+		}
 
-			// Avec la deuxime direction aussi (overkill au possible)
+		to_absolute(relative_speed, speed);
+		relative_valid = true;
+	}
 
-			last_speed_norm2 = std::pow(vcl::norm(delta_speed), 2);
+	int central_index() const {
+		if (central != -1 && central < (int)handle_to_index.size() && handle_to_index[central] != -1)
+			return handle_to_index[central];
 
-			if (last_speed_norm2 == 0) continue;
+		int c = -1;
+		for (int i = 0; i < size(); i++)
+			if (c == -1 || mass[i] > mass[c])
+				c = i;
+		return c;
+	}
 
-			speed2 = std::pow(vcl::norm(obj1.second->speed), 2);
-			expected_speed = std::sqrt(2 * (obj1.second->total_energy - obj1.second->potential_energy) / obj1.second->mass);
-			angle = vcl::dot(delta_speed, obj1.second->speed);
+	/* Wisdom-Holman step in democratic heliocentric coordinates: positions relative to the central object, speeds relative to the barycenter
+	*
+	* interaction kick (dt/2), central object drift (dt/2), Kepler drift (dt), central object drift (dt/2), interaction kick (dt/2)
+	*
+	* The state is in float whatever set_precision says (only the barycenter is summed in double); kepler_drift works in double
+	*/
+	void step_wisdom_holman(double dt) {
 
-			A = last_speed_norm2;
-			B = -2 * angle;
-			C = speed2 - expected_speed * expected_speed;
+		const int n = size();
+		const int c = central_index();
+		core_valid = false;
 
-			delta = B * B - 4 * A * C;
+		if (n < 2 || mass[c] == 0) {
+			step_leapfrog(dt);
+			return;
+		}
 
-			lambda = 0;
+		// The barycenter is kept in double: rounded in float, it would move the central object a little at every step
+		double M = 0, barycenter[3] = { 0, 0, 0 }, momentum[3] = { 0, 0, 0 };
+		for (int i = 0; i < n; i++) {
+			M += mass[i];
+			for (int k = 0; k < 3; k++) {
+				barycenter[k] += double(mass[i]) * position[i][k];
+				momentum[k] += double(mass[i]) * speed[i][k];
+			}
+		}
+		for (int k = 0; k < 3; k++) {
+			barycenter[k] /= M;
+			momentum[k] /= M;
+		}
+		const vcl::vec3 barycenter_speed = { float(momentum[0]), float(momentum[1]), float(momentum[2]) };
+
+		helio_position.resize(n);
+		bary_speed.resize(n);
+		for (int i = 0; i < n; i++) {
+			helio_position[i] = position[i] - position[c];
+			bary_speed[i] = speed[i] - barycenter_speed;
+		}
+
+		// Interactions between non-central objects only: the central attraction is in the Kepler drift
+		if (!forces_valid || forces_excluded != c)
+			compute_forces(c);
+
+		for (int i = 0; i < n; i++)
+			if (i != c)
+				bary_speed[i] += acceleration[i] * (dt / 2);
+
+		helio_drift(c, dt / 2);
+
+		const double mu = G * mass[c];
+		for (int i = 0; i < n; i++) {
+			if (i == c)
+				continue;
+			if (attracts(c, i))
+				kepler_drift(helio_position[i], bary_speed[i], mu, dt);
+			else
+				helio_position[i] += bary_speed[i] * dt;
+		}
 
-			if (delta >= 0) {
-				lambda = std::min((-B + std::sqrt(delta)) / 2 / A, (-B - std::sqrt(delta)) / 2 / A);
+		helio_drift(c, dt / 2);
+
+		// Back to absolute positions, the barycenter moving in a straight line
+		double offset[3] = { 0, 0, 0 };
+		for (int i = 0; i < n; i++)
+			if (i != c)
+				for (int k = 0; k < 3; k++)
+					offset[k] += double(mass[i]) * helio_position[i][k];
+		for (int k = 0; k < 3; k++)
+			position[c][k] = float(barycenter[k] + momentum[k] * dt - offset[k] / M);
+		for (int i = 0; i < n; i++)
+			if (i != c)
+				position[i] = position[c] + helio_position[i];
+		position_time += dt;
+
+		compute_forces(c);
+
+		vcl::vec3 central_momentum;
+		for (int i = 0; i < n; i++) {
+			if (i == c)
+				continue;
+			bary_speed[i] += acceleration[i] * (dt / 2);
+			speed[i] = barycenter_speed + bary_speed[i];
+			central_momentum += mass[i] * bary_speed[i];
+		}
+		speed[c] = barycenter_speed - central_momentum / mass[c];
+
+		// potential_energy does not include the central attraction yet
+		if (with_potentials) {
+			for (int i = 0; i < n; i++) {
+				if (i != c && attracts(c, i))
+					potential_energy[i] += -G * mass[c] * mass[i] / vcl::norm(helio_position[i]);
 			}
-			else {
-				lambda = -B / 2 / A;
+		}
+	}
+
+	// Heliocentric positions move with the momentum of the central object
+	void helio_drift(int c, double dt) {
+		vcl::vec3 p;
+		for (int i = 0; i < size(); i++)
+			if (i != c)
+				p += mass[i] * bary_speed[i];
+		const vcl::vec3 shift = p * float(dt / mass[c]);
+		for (int i = 0; i < size(); i++)
+			if (i != c)
+				helio_position[i] += shift;
+	}
+
+	// Fills acceleration (and potential_energy if with_potentials), for the objects of targets only if given. The object at index excluded (-1 for none) attracts nothing
+	void compute_forces(int excluded, const std::vector<int>* targets = nullptr) {
+		compute_object_forces(excluded, targets);
+
+		if (!rails.empty())
+			add_rail_forces(targets);
+	}
+
+	// The rails at position_time, the time of the current positions. Their potential energy is not counted: they are external
+	void add_rail_forces(const std::vector<int>* targets) {
+		update_rails(position_time);
+		const int n_targets = targets ? (int)targets->size() : size();
+		for_each_target(targets, n_targets, [&](int i) {
+			for (size_t r = 0; r < rails.size(); r++) {
+				vcl::vec3 d = rail_position[r] - position[i];
+				float r2 = vcl::dot(d, d);
+				if (r2 > 0)
+					acceleration[i] += float(G * rails[r].mass / (r2 * std::sqrt(r2))) * d;
 			}
+		});
+	}
+
+	void update_rails(double t) {
+		if (t == rail_time)
+			return;
+		rail_position.resize(rails.size());
+		for (size_t r = 0; r < rails.size(); r++)
+			rail_position[r] = rails[r].position(t);
+		rail_time = t;
+	}
+
+	// Accelerations of the test particles from the rails at position_time and the massive objects where they are
+	void swarm_forces() {
+		if (swarm_kernel == nullptr)
+			swarm_kernel = get_swarm_kernel(detect_simd_level());
+
+		update_rails(position_time);
+		swarm_sources.clear();
+		for (size_t r = 0; r < rails.size(); r++)
+			swarm_sources.add(rail_position[r], rails[r].mass);
+		for (int i = 0; i < size(); i++)
+			if (mass[i] > 0)
+				swarm_sources.add(position[i], mass[i]);
+
+		const int n = get_test_particle_count();
+		particle_ax.resize(n);
+		particle_ay.resize(n);
+		particle_az.resize(n);
 
-			obj1.second->speed -= lambda * delta_speed;
+		auto blocks = [&](int begin, int end) {
+			swarm_kernel(swarm_sources, particle_x.data(), particle_y.data(), particle_z.data(), particle_ax.data(), particle_ay.data(), particle_az.data(), begin, end);
+		};
+		if (pool)
+			pool->parallel_for(n, blocks);
+		else
+			blocks(0, n);
 
-			std::cout << "delta2 " << delta << std::endl;
+		particle_forces_valid = true;
+	}
 
-			std::cout << vcl::norm(obj1.second->speed) - expected_speed << std::endl;
+	// Kick-drift-kick of the test particles, once the objects are at the end of the step
+	void step_swarm(double dt) {
+		const int n = get_test_particle_count();
+		const float h = float(G * dt / 2), d = float(dt);
 
+		for (int i = 0; i < n; i++) {
+			particle_vx[i] += particle_ax[i] * h;
+			particle_vy[i] += particle_ay[i] * h;
+			particle_vz[i] += particle_az[i] * h;
+			particle_x[i] += particle_vx[i] * d;
+			particle_y[i] += particle_vy[i] * d;
+			particle_z[i] += particle_vz[i] * d;
 		}
 
-		for (auto obj : objects) {
+		swarm_forces();
 
-			//std::cout << obj.first << " pos " << obj.second->position << std::endl;
-			//std::cout << obj.first << " " << obj.second->speed << std::endl;
-			obj.second->position += obj.second->speed * timestep; // update positions
+		for (int i = 0; i < n; i++) {
+			particle_vx[i] += particle_ax[i] * h;
+			particle_vy[i] += particle_ay[i] * h;
+			particle_vz[i] += particle_az[i] * h;
 		}
 	}
 
-	void simulate(double time, double timestep) {
+	// Pairs of objects that touch during the next step (straight lines), with the time of the contact, then the responses in time order
+	void handle_collisions(double dt) {
+		const int n = size();
 
-		int n_timesteps = (int)time / timestep;
+		struct Contact {
+			double t; // Fraction of the step
+			int a, b; // Handles
+		};
+		std::vector<Contact> contacts;
 
-		for (int i = 0; i < n_timesteps; i++)
-			simulate(timestep);
+		// Broad phase: boxes around the swept spheres, sorted by their low x
+		auto low = [&](int i, int c) { return std::min(position[i][c], position[i][c] + float(dt) * speed[i][c]) - radius[i]; };
+		auto high = [&](int i, int c) { return std::max(position[i][c], position[i][c] + float(dt) * speed[i][c]) + radius[i]; };
+
+		sweep_order.resize(n);
+		for (int i = 0; i < n; i++)
+			sweep_order[i] = i;
+		std::vector<float> low_x(n);
+		for (int i = 0; i < n; i++)
+			low_x[i] = low(i, 0);
+		std::sort(sweep_order.begin(), sweep_order.end(), [&](int a, int b) { return low_x[a] < low_x[b]; });
+
+		sweep_active.clear();
+		for (int i : sweep_order) {
+			float x = low_x[i];
+			sweep_active.erase(std::remove_if(sweep_active.begin(), sweep_active.end(), [&](int j) { return high(j, 0) < x; }), sweep_active.end());
+
+			for (int j : sweep_active) {
+				if (radius[i] + radius[j] == 0)
+					continue;
+				if (high(i, 1) < low(j, 1) || high(j, 1) < low(i, 1) || high(i, 2) < low(j, 2) || high(j, 2) < low(i, 2))
+					continue;
+
+				// Narrow phase: first t in [0, 1] with |d + t dv| = ri + rj
+				vcl::vec3 d = position[j] - position[i];
+				vcl::vec3 dv = float(dt) * (speed[j] - speed[i]);
+				double r = radius[i] + radius[j];
+				double a = vcl::dot(dv, dv), b = 2.0 * vcl::dot(d, dv), c = double(vcl::dot(d, d)) - r * r;
+				double t;
+				if (c <= 0)
+					t = 0;
+				else {
+					double disc = b * b - 4 * a * c;
+					if (a == 0 || b >= 0 || disc < 0)
+						continue;
+					t = (-b - std::sqrt(disc)) / (2 * a);
+					if (t > 1)
+						continue;
+				}
+				contacts.push_back({ t, index_to_handle[i], index_to_handle[j] });
+			}
+			sweep_active.push_back(i);
+		}
+
+		std::sort(contacts.begin(), contacts.end(), [](const Contact& x, const Contact& y) { return x.t < y.t; });
+
+		for (const Contact& contact : contacts) {
+			// Gone in an earlier merge
+			if (handle_to_index[contact.a] == -1 || handle_to_index[contact.b] == -1)
+				continue;
+			int i = index(contact.a), j = index(contact.b);
+			if (mass[j] > mass[i])
+				std::swap(i, j);
+
+			const float tc = float(contact.t * dt);
+			vcl::vec3 pi = position[i] + tc * speed[i], pj = position[j] + tc * speed[j];
+			vcl::vec3 normal = pj - pi;
+			float distance = vcl::norm(normal);
+			normal = distance > 0 ? normal / distance : vcl::vec3(1, 0, 0);
+			float approach = vcl::dot(speed[i] - speed[j], normal);
+
+			Collision record{ step_count, index_to_handle[i], index_to_handle[j], current_time + tc, pi + radius[i] * normal, vcl::norm(speed[j] - speed[i]) };
+
+			if (response == collision_response::MERGE) {
+				// Merged at the contact point, then back along the merged speed so that the step leaves from the contact
+				const int hi = index_to_handle[i];
+				position[i] = pi;
+				position[j] = pj;
+				merge(i, j);
+				i = index(hi);
+				position[i] -= tc * speed[i];
+			}
+			else if (response == collision_response::BOUNCE && approach > 0) {
+				// Share of the change of relative speed taken by each object
+				float total = mass[i] + mass[j];
+				float share_i = total > 0 ? mass[j] / total : 0.5f;
+				float share_j = total > 0 ? mass[i] / total : 0.5f;
+				vcl::vec3 change = (1 + restitution) * approach * normal;
+				speed[i] -= share_i * change;
+				speed[j] += share_j * change;
+
+				// Back along the new speeds from the contact point (pushed apart if they already overlapped), so that the step leaves from the contact
+				float overlap = std::max(0.0f, radius[i] + radius[j] - distance);
+				position[i] = pi - share_i * overlap * normal - tc * speed[i];
+				position[j] = pj + share_j * overlap * normal - tc * speed[j];
+				moved();
+			}
+
+			collisions.push_back(record);
+		}
+	}
+
+	// j is absorbed by i, which keeps its handle and name
+	void merge(int i, int j) {
+		float total = mass[i] + mass[j];
+		float wi = total > 0 ? mass[i] / total : 0.5f;
+		position[i] = wi * position[i] + (1 - wi) * position[j];
+		speed[i] = wi * speed[i] + (1 - wi) * speed[j];
+		mass[i] = total;
+		radius[i] = std::cbrt(radius[i] * radius[i] * radius[i] + radius[j] * radius[j] * radius[j]);
+		if (level[j] > level[i]) {
+			level[i] = level[j];
+			similar[i] = similar[j];
+		}
 
-		simulate(timestep * n_timesteps - time);
+		// The satellites of j now go around i
+		const int hi = index_to_handle[i], hj = index_to_handle[j];
+		for (int& p : parent_handle)
+			if (p == hj)
+				p = hi;
+		if (parent_handle[i] == hj)
+			parent_handle[i] = -1;
 
+		moved();
+		remove_object(hj);
 	}
 
-private:
-	std::map<std::string, Mass_object*> objects;
+	// After a response: everything that depends on the state is stale, and energy is not conserved across it
+	void moved() {
+		forces_valid = false;
+		potentials_valid = false;
+		reference_valid = false;
+		core_valid = false;
+		relative_valid = false;
+		particle_forces_valid = false;
+	}
+
+	// Forces between the objects, with the chosen method
+	void compute_object_forces(int excluded, const std::vector<int>* targets) {
+
+		const int n = size();
+		const int n_targets = targets ? (int)targets->size() : n;
+		acceleration.resize(n);
+		force_evaluations += n_targets;
+		if (targets == nullptr) {
+			forces_valid = true;
+			forces_excluded = excluded;
+		}
+
+		if (method == force_method::DIRECT_SIMD) {
+
+			if (kernel == nullptr)
+				kernel = get_gravity_kernel(detect_simd_level());
+
+			if (!lists_valid)
+				build_interaction_lists();
+
+			level_sources.resize(attractor_lists.size());
+			for (size_t k = 0; k < attractor_lists.size(); k++)
+				level_sources[k].pack(position.data(), mass.data(), level.data(), similar.data(), attractor_lists[k], excluded);
+
+			for_each_target(targets, n_targets, [&](int i) {
+				double potential;
+				vcl::vec3 field;
+				kernel(level_sources[list_of[i]], position[i], gravity_rank_limit(level[i]), field, potential);
+
+				acceleration[i] = float(G) * field;
+				if (with_potentials)
+					potential_energy[i] = G * mass[i] * potential;
+			});
+			return;
+		}
+
+		if (method == force_method::FMM && n >= barnes_hut_threshold) {
+
+			// Whole system at once: the cost is linear and does not depend on the number of targets
+			system_field.resize(n);
+			system_potential.resize(n);
+			fmm.compute(position.data(), mass.data(), level.data(), similar.data(), n, excluded, system_field.data(), system_potential.data(), pool.get());
+
+			for_each_target(targets, n_targets, [&](int i) {
+				acceleration[i] = float(G) * system_field[i];
+				if (with_potentials)
+					potential_energy[i] = G * mass[i] * system_potential[i];
+			});
+			return;
+		}
+
+		if (method == force_method::PARTICLE_MESH && n >= barnes_hut_threshold) {
+			system_field.resize(n);
+			system_potential.resize(n);
+			mesh.compute(position.data(), mass.data(), level.data(), similar.data(), n, excluded, system_field.data(), with_potentials ? system_potential.data() : nullptr, pool.get());
+
+			for_each_target(targets, n_targets, [&](int i) {
+				acceleration[i] = float(G) * system_field[i];
+				if (with_potentials)
+					potential_energy[i] = G * mass[i] * system_potential[i];
+			});
+			return;
+		}
+
+		if (method == force_method::BARNES_HUT && n >= barnes_hut_threshold) {
 
-	// Calculates the potential energy of To in From's field
-	// Return a useful value
-	static double potential_to(Mass_object& from, Mass_object& to) {
-		
+			float excluded_mass = 0;
+			if (excluded != -1) {
+				excluded_mass = mass[excluded];
+				mass[excluded] = 0;
+			}
 
-		if (from.attraction_level > to.attraction_level || (from.attraction_level == to.attraction_level && from.attracts_similar)) // Checks whether the impact of From on To should be simulated
-		{
+			tree.build(position.data(), mass.data(), level.data(), similar.data(), n);
 
-			double distance = vcl::norm(from.position - to.position);
-			if (distance == 0)
-				throw std::runtime_error("Two objects have the same position == BOOM..."); // Berk. Custom exception WIP
-			double PE = -G * from.mass * to.mass / distance;
-			to.potential_energy += PE;
+			for_each_target(targets, n_targets, [&](int i) {
+				double potential;
+				vcl::vec3 field = tree.field_at(i, potential);
 
-			return -PE / (distance * distance);
+				acceleration[i] = float(G) * field;
+				if (with_potentials)
+					potential_energy[i] = G * (i == excluded ? excluded_mass : mass[i]) * potential;
+			});
 
+			if (excluded != -1)
+				mass[excluded] = excluded_mass;
+			return;
 		}
-		return -1.0;
+
+		if (!lists_valid)
+			build_interaction_lists();
+
+		if (softening > 0)
+			direct_forces(Plummer_law{ G, softening }, excluded, targets, n_targets);
+		else
+			direct_forces(Newtonian_law{ G }, excluded, targets, n_targets);
 	}
 
-};
\ No newline at end of file
+	// Exact sum over the interaction list of every target (which only holds objects that attract it)
+	template <typename Law>
+	void direct_forces(const Law& law, int excluded, const std::vector<int>* targets, int n_targets) {
+		for_each_target(targets, n_targets, [&](int i) {
+			acceleration[i] = law_field(law, position.data(), mass.data(), attractor_lists[list_of[i]], i, excluded, with_potentials ? &potential_energy[i] : nullptr);
+		});
+	}
+
+	// Calls f(i) for every target object, on the thread pool if there is one. f may only write the data of object i
+	template <typename F>
+	void for_each_target(const std::vector<int>* targets, int n_targets, F f) {
+		auto blocks = [&](int begin, int end) {
+			for (int t = begin; t < end; t++)
+				f(targets ? (*targets)[t] : t);
+		};
+
+		if (pool)
+			pool->parallel_for(n_targets, blocks);
+		else
+			blocks(0, n_targets);
+	}
+
+	// Adds the potential energy of To in From's field
+	// Returns false if From does not attract To
+	bool potential_to(int from, int to) {
+
+		if (!attracts(from, to)) // Checks whether the impact of From on To should be simulated
+			return false;
+
+		potential_energy[to] += pair_energy(from, to);
+		return true;
+	}
+
+	// Energy of a pair, with the same force law as the DIRECT forces
+	double pair_energy(int from, int to) const {
+		vcl::vec3 d = position[from] - position[to];
+		double r2 = vcl::dot(d, d);
+		if (softening > 0)
+			return Plummer_law{ G, softening }.potential(r2, mass[to], mass[from]);
+		if (r2 == 0)
+			throw std::runtime_error("Two objects have the same position == BOOM..."); // Berk. Custom exception WIP
+		return Newtonian_law{ G }.potential(r2, mass[to], mass[from]);
+	}
+
+};
+
+#endif // SIMULATOR_H
@@ -0,0 +1,135 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <exception>
+
+
+/* Fixed set of worker threads for data-parallel loops
+*
+* parallel_for splits [0, n) in blocks that the workers (and the calling thread) take one after the other.
+* Which thread handles which block changes from one call to the next, so the loop body must only write to its own indices:
+* results are then the same whatever the number of threads. Sums over the indices are done afterwards, in index order.
+*/
+class Thread_pool {
+
+public:
+
+	// n_threads includes the calling thread
+	explicit Thread_pool(int n_threads) {
+		for (int i = 1; i < n_threads; i++)
+			workers.emplace_back([this] { work(); });
+	}
+
+	~Thread_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& w : workers)
+			w.join();
+	}
+
+	Thread_pool(const Thread_pool&) = delete;
+	void operator=(const Thread_pool&) = delete;
+
+	int size() const { return (int)workers.size() + 1; }
+
+	// Calls f(begin, end) on blocks covering [0, n). Returns when every block is done. An exception thrown by f is rethrown here
+	void parallel_for(int n, const std::function<void(int, int)>& f) {
+		if (n <= 0)
+			return;
+
+		if (workers.empty()) {
+			f(0, n);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &f;
+			job_size = n;
+			block = std::max(1, n / (8 * size()));
+			next_block = 0;
+			busy = (int)workers.size();
+			generation++;
+		}
+		wake.notify_all();
+
+		run_blocks();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return busy == 0; });
+		job = nullptr;
+
+		if (error) {
+			std::exception_ptr e = error;
+			error = nullptr;
+			std::rethrow_exception(e);
+		}
+	}
+
+private:
+
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	const std::function<void(int, int)>* job = nullptr;
+	int job_size = 0;
+	int block = 1;
+	std::atomic<int> next_block{ 0 };
+	int busy = 0;
+	unsigned long long generation = 0;
+	bool stopping = false;
+	std::exception_ptr error; // First exception of the current job
+
+	void run_blocks() {
+		while (true) {
+			int begin = next_block.fetch_add(block);
+			if (begin >= job_size)
+				return;
+			try {
+				(*job)(begin, std::min(job_size, begin + block));
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+				next_block = job_size; // Skip the remaining blocks
+			}
+		}
+	}
+
+	void work() {
+		unsigned long long seen = 0;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+			}
+
+			run_blocks();
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				busy--;
+			}
+			done.notify_one();
+		}
+	}
+};
+
+#endif // THREAD_POOL_H
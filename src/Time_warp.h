@@ -0,0 +1,211 @@
+#ifndef TIME_WARP_H
+#define TIME_WARP_H
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+
+
+/* Jumps a scene far ahead in time, in seconds of computation instead of hours of display
+*
+* What has a closed form (Orbit_Object, Orbit_table, an Ephemeris) does not need anything: it is evaluated at scene_time,
+* which includes every warp. What must be integrated (a Belt, a Simulator) is a track: a function that advances its own state
+* by one step of at most the time it is given, as large as its accuracy allows, and returns the time it advanced
+* (Belt::update_coord_adaptive, Simulator::simulate_adaptive). A track has a rate: its time per scene time.
+*
+* start(duration) runs the tracks on a background thread until each has advanced by duration times its rate, the least
+* advanced one first, so that they stay together. Steps run back to back in batches of a few milliseconds, nothing is drawn
+* in between. The render thread holds hold() while it reads the states of the tracks: the warp thread only steps between
+* batches, and gives way as soon as the render thread waits.
+*/
+class Time_warp {
+
+public:
+
+	Time_warp() = default;
+	~Time_warp() { cancel(); }
+
+	Time_warp(const Time_warp&) = delete;
+	Time_warp& operator=(const Time_warp&) = delete;
+
+	// Returns the index of the track. rate: time of the track per scene time
+	int add_track(std::string name, std::function<double(double)> step, double rate = 1) {
+		if (running.load())
+			throw std::logic_error("Tracks cannot be added during a warp.");
+		if (!(rate > 0))
+			throw std::invalid_argument("The rate of a track must be positive.");
+		tracks.push_back({ name, step, rate, 0 });
+		return (int)tracks.size() - 1;
+	}
+
+	int get_track_count() const { return (int)tracks.size(); }
+	const std::string& get_track_name(int track) const { return tracks.at(track).name; }
+
+	// Advances every track by duration (scene time), on the warp thread. Throws the error of the previous warp, if any
+	void start(double duration) {
+		if (running.load())
+			throw std::logic_error("A warp is already running.");
+		if (warp_thread.joinable())
+			warp_thread.join();
+		rethrow();
+		if (!(duration > 0))
+			throw std::invalid_argument("The duration of a warp must be positive.");
+
+		for (Track& k : tracks)
+			k.done = 0;
+		{
+			std::lock_guard<std::mutex> lock(progress_mutex);
+			target = duration;
+			advanced = 0;
+			progress = 0;
+		}
+		steps = 0;
+		stop = false;
+		running = true;
+		warp_thread = std::thread([this] { run(); });
+	}
+
+	// Stops after the current batch. What was advanced is kept: scene_time stays consistent with the tracks
+	void cancel() {
+		stop = true;
+		if (warp_thread.joinable())
+			warp_thread.join();
+	}
+
+	// Waits for the end of the warp, and throws the error of a track if one failed
+	void wait() {
+		if (warp_thread.joinable())
+			warp_thread.join();
+		rethrow();
+	}
+
+	bool is_running() const { return running.load(); }
+
+	// Fraction of the current (or last) warp done by the least advanced track
+	double get_progress() const {
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		return progress;
+	}
+
+	long long get_step_count() const { return steps.load(); }
+
+	// Scene time at this clock time: the clock plus every warp, and the part of the current warp done by every track
+	double scene_time(double clock) const {
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		return clock + jumped + advanced;
+	}
+
+	// Held by the render thread while it reads or changes the states of the tracks
+	std::unique_lock<std::mutex> hold() {
+		render_waiting++;
+		std::unique_lock<std::mutex> lock(state_mutex);
+		render_waiting--;
+		return lock;
+	}
+
+	// Length of the batches of steps between which the render thread can read the tracks
+	void set_batch_duration(double milliseconds) { batch = std::chrono::microseconds((long long)(1000 * milliseconds)); }
+
+private:
+
+	struct Track {
+		std::string name;
+		std::function<double(double)> step;
+		double rate;
+		double done; // Track time advanced during the current warp
+	};
+
+	std::vector<Track> tracks;
+	std::thread warp_thread;
+	std::atomic<bool> running{ false };
+	std::atomic<bool> stop{ false };
+	std::atomic<int> render_waiting{ 0 };
+	std::atomic<long long> steps{ 0 };
+	std::chrono::microseconds batch{ 5000 };
+	std::exception_ptr error;
+
+	std::mutex state_mutex; // The states of the tracks
+	mutable std::mutex progress_mutex; // The four values below
+	double progress = 1;
+	double target = 0;
+	double advanced = 0; // Scene time done by every track during the current warp
+	double jumped = 0; // Scene time of the finished warps
+
+	void run() {
+		try {
+			bool finished = false;
+			while (!finished && !stop.load()) {
+				while (render_waiting.load() > 0)
+					std::this_thread::yield();
+
+				std::lock_guard<std::mutex> lock(state_mutex);
+				const auto end = std::chrono::steady_clock::now() + batch;
+				do {
+					finished = step_least_advanced();
+				} while (!finished && std::chrono::steady_clock::now() < end);
+
+				publish(finished);
+			}
+			if (!finished)
+				publish(true); // Cancelled: keep what was done
+		}
+		catch (...) {
+			error = std::current_exception();
+			publish(true);
+		}
+		running = false;
+	}
+
+	// One step of the track that is the least advanced in scene time. True when every track reached the target
+	bool step_least_advanced() {
+		Track* least = nullptr;
+		for (Track& k : tracks)
+			if (k.done < target * k.rate && (least == nullptr || k.done / k.rate < least->done / least->rate))
+				least = &k;
+		if (least == nullptr)
+			return true;
+
+		const double remaining = target * least->rate - least->done;
+		const double dt = least->step(remaining);
+		if (!(dt > 0))
+			throw std::runtime_error("The track " + least->name + " of the time warp did not advance.");
+		least->done += std::min(dt, remaining);
+		if (target * least->rate - least->done <= 1e-12 * target * least->rate) // Rounding of the sum of the steps
+			least->done = target * least->rate;
+		steps++;
+		return false;
+	}
+
+	// The scene time done by every track becomes visible. At the end of the warp, it moves to the time jumped
+	void publish(bool last) {
+		double least = target;
+		for (const Track& k : tracks)
+			least = std::min(least, k.done / k.rate);
+
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		progress = least / target;
+		if (last) {
+			jumped += least;
+			advanced = 0;
+		}
+		else
+			advanced = least;
+	}
+
+	void rethrow() {
+		if (error) {
+			std::exception_ptr e = error;
+			error = nullptr;
+			std::rethrow_exception(e);
+		}
+	}
+};
+
+#endif // TIME_WARP_H
@@ -9,6 +9,7 @@
 //#include "Simulator.h"
 #include "scene_initializer.hpp"
 #include "orbit_object_helper.hpp"
+#include "Time_warp.h"
 
 using namespace vcl;
 
@@ -77,14 +78,18 @@ void switch_center_object(Object_Drawable* ob, double t) {
 void focus_on_selected(double t) {
 	if (selected != nullptr) {
 		focused = selected;
-		scene.camera.set_distance_to_center(vcl::norm(scene.camera.position() - focused->position(t))); // Distance to center updated to avoid 
-		scene.camera.look_at(scene.camera.position(), focused->position(t), scene.camera.up());
+		scene.camera.set_distance_to_center(vcl::norm(scene.camera.position() - focused->world_position(t))); // Distance to center updated to avoid 
+		scene.camera.look_at(scene.camera.position(), focused->world_position(t), scene.camera.up());
 	}
 }
 
 // Asteroid belt object
 Belt belt;
 
+// Jumps the scene ahead: the belt is integrated in the background, everything else is evaluated at the warped time
+Time_warp warp;
+float warp_duration = 1000000.0f;
+
 int main(int, char* argv[])
 {
 	std::cout << "Run " << argv[0] << std::endl;
@@ -143,7 +148,9 @@ int main(int, char* argv[])
 
 		// As opposed to other planets, belt asteroid positions are not defined at every instant and have to be incrementally calculated
 		// the dt/10 factor is arbitrary - They evolve on a different timescale than planets
-		belt.update_coord(dt/10);
+		// During a time warp, the warp thread advances it instead
+		if (!warp.is_running())
+			belt.update_coord(dt/10);
 
 		// Update camera. Dual_Camera object has a partial implementation of inertia (at least rotational) - See Dual_Camera for more info
 		just_for_time.update();
@@ -187,6 +194,8 @@ void initialize_data()
 
 	// Creates our asteroid belt. See Orbit_object.hpp and Scene_initializer.hpp
 	belt = create_belt((s.get_object("Sun")), 200000, { 1, 0, 0 }, 200, 10, 100 , 1, 2, 10);
+	s.rebuild_world();
+	warp.add_track("Belt", [](double max_dt) { return (double)belt.update_coord_adaptive((float)max_dt); }, 1.0 / 10); // Same factor as the main loop
 
 	just_for_time.update();
 	selected = s.get_object("Saturn");
@@ -210,6 +219,7 @@ void initialize_data()
 }
 
 void cleanup() {
+	warp.cancel();
 	Scene_initializer s = Scene_initializer::getInstance();
 	s.kill_initializer(); // Singleton destroyer
 }
@@ -221,7 +231,13 @@ void display_frame()
 
 
 	float const dt = just_for_time.update();
-	double t = just_for_time.t / 2;
+	double t = warp.scene_time(just_for_time.t / 2);
+
+	// The belt is not stepped by a time warp while the frame is drawn
+	auto warp_hold = warp.hold();
+
+	// Every position of the frame is read from this pass
+	s.update_world(t);
 
 
 	// Draw the skybox
@@ -242,14 +258,14 @@ void display_frame()
 
 	if (focused != nullptr)
 	{
-		scene.camera.set_center_of_rotation(focused->position(t), focused->radius_drawn());
+		scene.camera.set_center_of_rotation(focused->world_position(t), focused->radius_drawn());
 	}
 
 
 	
 	s.draw(t, scene);
 
-	vec3 satpos = s.get_object("Saturn")->position(t);
+	vec3 satpos = s.get_object("Saturn")->world_position(t);
 	float satrad = s.get_object("Saturn")->radius_drawn();
 
 	saturn_billboard.transform.translate = satpos;
@@ -338,7 +354,7 @@ void display_frame()
 		*  Orientation depends on the camera
 		*/
 
-		vec3 p = selected->position(t);
+		vec3 p = selected->world_position(t);
 		float r = selected->radius_drawn();
 		float dst = vcl::norm(scene.camera.position() - p);
 		vec3 normto = (p - scene.camera.position()) / dst;
@@ -383,6 +399,17 @@ void display_interface()
 	ImGui::SliderFloat("planet_size", &p_size, 1.0f, 10.0f, "%.3f", 4.0f);
 	ImGui::SliderFloat("sun brightness", &occ_factor, 0.0f, 2.0f, "%.3f", 1.0f);
 
+	// Time warp: jumps ahead by the duration
+	ImGui::InputFloat("warp duration", &warp_duration);
+	if (warp.is_running()) {
+		ImGui::ProgressBar(float(warp.get_progress()));
+		if (ImGui::Button("Stop warp"))
+			warp.cancel();
+	}
+	else if (ImGui::Button("Warp") && warp_duration > 0) {
+		warp.start(warp_duration);
+	}
+
 	// The following helps explore the planete tree
 	// First is the parent button, then the planet button, then the children buttons
 	// Clicking selects them
@@ -484,7 +511,7 @@ void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
 	Scene_initializer s = Scene_initializer::getInstance();
 
 	float const dt = just_for_time.update();
-	double t = just_for_time.t / 2;
+	double t = warp.scene_time(just_for_time.t / 2);
 
 
 	if (!user.cursor_on_gui) {
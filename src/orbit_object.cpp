@@ -0,0 +1,143 @@
+#include "orbit_object.h"
+#include "Orbit_table.h"
+#include "Event_search.h"
+#include "Lambert.h"
+#include <iostream>
+
+float G = 1;
+
+float p_size = 1.0f;
+
+double random_rotate_time = 100000.0;
+
+void print(float s, std::string mess) {
+    std::cout << mess << ": " << s << std::endl;
+}
+
+int add_orbit(Orbit_table& table, const Orbit_Object& obj) {
+    return table.add(obj.axis, obj.diameter_ini, obj.radius_orbit, obj.period, random_rotate_time);
+}
+
+int add_orbit(Orbit_table& table, const Kepler_elements& elements, float parent_mass) {
+    return table.add(elements, G * parent_mass);
+}
+
+std::vector<std::pair<std::string, std::string>> drawable_hierarchy(const Object_Drawable* root) {
+    std::vector<std::pair<std::string, std::string>> links;
+    std::vector<const Object_Drawable*> todo = { root };
+    for (size_t k = 0; k < todo.size(); k++) {
+        for (const Object_Drawable* child : todo[k]->enfants) {
+            links.push_back({ child->name, todo[k]->name });
+            todo.push_back(child);
+        }
+    }
+    return links;
+}
+
+std::function<vcl::vec3(double)> rail_of(Object_Drawable* drawable) {
+    return [drawable](double t) { return drawable->position(t); };
+}
+
+Ephemeris record_ephemeris(Object_Drawable* root, double begin, double end, double segment_length, int degree) {
+    std::vector<Planete_Drawable*> planets;
+    std::vector<std::string> names;
+    std::vector<Object_Drawable*> todo = { root };
+    for (size_t k = 0; k < todo.size(); k++) {
+        auto* planet = dynamic_cast<Planete_Drawable*>(todo[k]);
+        if (planet != nullptr && planet->parent != nullptr && planet->planete != nullptr) {
+            planets.push_back(planet);
+            names.push_back(planet->name);
+        }
+        for (Object_Drawable* child : todo[k]->enfants)
+            todo.push_back(child);
+    }
+
+    return Ephemeris::build(names, begin, end, segment_length, degree, [&](double t, vcl::vec3* out) {
+        for (size_t k = 0; k < planets.size(); k++)
+            out[k] = planets[k]->planete->position(t);
+    });
+}
+
+void attach_ephemeris(Object_Drawable* root, const Ephemeris* ephemeris) {
+    std::map<std::string, int> bodies;
+    for (int b = 0; ephemeris != nullptr && b < ephemeris->get_body_count(); b++)
+        bodies[ephemeris->get_name(b)] = b;
+
+    std::vector<Object_Drawable*> todo = { root };
+    for (size_t k = 0; k < todo.size(); k++) {
+        Object_Drawable* d = todo[k];
+        auto found = bodies.find(d->name);
+        d->ephemeris = found != bodies.end() ? ephemeris : nullptr;
+        d->ephemeris_body = found != bodies.end() ? found->second : -1;
+        for (Object_Drawable* child : d->enfants)
+            todo.push_back(child);
+    }
+}
+
+std::vector<Event_body> event_bodies(Object_Drawable* root) {
+    std::vector<Event_body> bodies;
+    std::vector<Object_Drawable*> todo = { root };
+    std::vector<int> parent_of = { -1 };
+    for (size_t k = 0; k < todo.size(); k++) {
+        Event_body body;
+        body.name = todo[k]->name;
+        body.radius = todo[k]->radius;
+        body.parent = parent_of[k];
+        auto* planet = dynamic_cast<Planete_Drawable*>(todo[k]);
+        if (planet != nullptr && planet->parent != nullptr && planet->planete != nullptr) {
+            Orbit_Object* orbit = planet->planete;
+            body.position = [orbit](double t) { return orbit->position(t); };
+            body.speed = [orbit](double t) { return orbit->speed(t); };
+            body.max_speed = 2 * 3.14 * orbit->radius_orbit / orbit->period;
+            body.max_acceleration = body.max_speed * body.max_speed / orbit->radius_orbit;
+        }
+        else {
+            body.position = [](double) { return vcl::vec3(); };
+            body.speed = [](double) { return vcl::vec3(); };
+        }
+        bodies.push_back(body);
+
+        for (Object_Drawable* child : todo[k]->enfants)
+            if (dynamic_cast<Planete_Drawable*>(child) != nullptr) { // Asteroids have no closed-form orbit
+                todo.push_back(child);
+                parent_of.push_back((int)k);
+            }
+    }
+    return bodies;
+}
+
+Transfer_body transfer_body(Planete_Drawable* planet) {
+    Orbit_Object* orbit = planet->planete;
+    return { [orbit](double t) { return orbit->position(t); }, [orbit](double t) { return orbit->speed(t); } };
+}
+
+double parent_mu(const Orbit_Object& orbit) {
+    const double n = 2 * 3.14 / orbit.period;
+    return n * n * double(orbit.radius_orbit) * orbit.radius_orbit * orbit.radius_orbit;
+}
+
+void init_orbit_circ(Orbit_Object& obj, float parent_mass, vcl::vec3 initial_position, vcl::vec3 ax) {
+
+    if (parent_mass == 0) throw std::invalid_argument("Parent cannot be massless when initializing orbit.");
+    if (is_equal(initial_position, { 0.0f, 0.0f, 0.0f })) throw std::invalid_argument("Orbits of radius 0 are not permitted.");
+
+
+
+
+
+    if (is_equal(ax, { 0.0f, 0.0f, 0.0f })) {
+        if (initial_position.x == 0) {
+            ax = { 1.0f, 0.0f, 0.0f };
+        }
+        else {
+            ax = { initial_position.y, -initial_position.x, 0 };
+        }
+    }
+
+    obj.axis = ax / vcl::norm(ax);
+    obj.radius_orbit = vcl::norm(initial_position);
+    obj.diameter_ini = initial_position / obj.radius_orbit;
+
+    obj.period = sqrt(4 * pow(3.14, 2) * pow(obj.radius_orbit, 3) / (G * (parent_mass)));
+
+}
@@ -2,20 +2,29 @@
 #define ORBIT_OBJECT_H
 #include "vcl/vcl.hpp"
 #include <stdexcept>
+#include <functional>
+#include <map>
 #include "draw_helper.hpp"
+#include "Force_law.h"
+#include "Kepler.h"
+#include "Ephemeris.h"
 
+// Defined in Orbit_table.h, Event_search.h and Lambert.h, included by orbit_object.cpp only
+class Orbit_table;
+struct Kepler_elements;
+struct Event_body;
+struct Transfer_body;
 
-float G = 1;
 
-void print(float s, std::string mess = "") {
-    std::cout << mess << ": " << s << std::endl;
-};
+extern float G;
+
+void print(float s, std::string mess = "");
 
-float p_size = 1.0f; // Planet sizes -> use to scale all objects except asteroids and the sun
+extern float p_size; // Planet sizes -> use to scale all objects except asteroids and the sun
 
 // All planets are initially set at the same axis. 
 // A large start time randomizes their positions 
-double random_rotate_time = 100000.0; 
+extern double random_rotate_time;
 
 
 // Characterizes a circular orbit, the caracteristics of which can be gotten at any time t.
@@ -31,27 +40,27 @@ struct Orbit_Object {
 
     vcl::vec3 diameter_ini ; // rayon initial, à entrer par l'utilisateur, normalisé à 1 (utiliser normalize())
 
-    vcl::vec3 position(float t){        // quel type pour le temps ?
+    vcl::vec3 position(double t){        // double: far in the future (time warp), a float time would not resolve an orbit
         t += random_rotate_time;
         if (norm(diameter_ini) == 0 || norm(axis) == 0)
             {vcl::call_error("norme non nulle", "définir un vecteur non vide", "Orbit_Object", "position", 22);}
-        float angle = 2*3.14*t/period ;
+        float angle = float(std::fmod(2*3.14*t/period, kepler_two_pi)) ;   // reduced in double, by the period of cos and sin
         vcl::vec3 axis1 = diameter_ini;
         vcl::vec3 axis3 = axis;
         vcl::vec3 axis2 = cross(axis3, axis1);
         return (std::cos(angle)*radius_orbit*axis1 + std::sin(angle)*radius_orbit*axis2);
     }
 
-    vcl::vec3 speed(float t){
+    vcl::vec3 speed(double t){
         t += random_rotate_time;
         if (norm(diameter_ini) == 0 || norm(axis) == 0)
             {vcl::call_error("norme non nulle", "définir un vecteur non vide", "Orbit_Object", "position", 22);}
-        float angle = 2*3.14*t/period ;
+        float angle = float(std::fmod(2*3.14*t/period, kepler_two_pi)) ;   // reduced in double, by the period of cos and sin
         vcl::vec3 axis1 = diameter_ini / norm(diameter_ini);
         vcl::vec3 axis3 = axis / norm(axis);
         vcl::vec3 axis2 = cross(axis3, axis1);
         float v = 2*3.14*radius_orbit/period ;      // la norme est constante dans le cas de l'orbite circulaire
-        return (std::cos(angle)*v*axis2 + std::sin(angle)*v*axis1);
+        return (std::cos(angle)*v*axis2 - std::sin(angle)*v*axis1);  // derivative of position
      }
 
 
@@ -61,6 +70,14 @@ struct Orbit_Object {
 // Initializes an Obrit_Object. The trajectory is orthogonal to ax, and around zero.
 void init_orbit_circ(Orbit_Object& obj, float parent_mass, vcl::vec3 initial_position, vcl::vec3 ax = { 0.0f, 0.0f, 0.0f });
 
+// Adds the orbit to a table evaluated in batches, see Orbit_table.h. Returns its index in the table
+int add_orbit(Orbit_table& table, const Orbit_Object& obj);
+
+// Adds an elliptical, inclined orbit around a parent of mass parent_mass. Returns its index in the table
+int add_orbit(Orbit_table& table, const Kepler_elements& elements, float parent_mass);
+
+
+struct World_transforms;
 
 // Any object physical object that will be drawn. It is part of a tree.
 // This class is abstract
@@ -76,8 +93,8 @@ struct Object_Drawable {
     // inital rotation to correct object axis - does not change with time
     vcl::rotation rot_corr_axis = vcl::rotation();
 
-    float rotation_angle(float t) {
-        return (rotation_speed * t);
+    float rotation_angle(double t) {
+        return float(std::fmod(rotation_speed * t, 2 * 3.14159265358979));
     }
 
     // Must be redefined in children classes
@@ -85,6 +102,29 @@ struct Object_Drawable {
 
     virtual vcl::vec3 position(double t, vcl::vec3 parent_pos) = 0;
 
+    // Set by World_transforms::build. Where the frame's position and model transform of the object are stored
+    World_transforms* world = nullptr;
+    int world_index = -1;
+
+    // Set by attach_ephemeris. Within its time span, the position relative to the parent is read from it
+    const Ephemeris* ephemeris = nullptr;
+    int ephemeris_body = -1;
+
+    // Position and model transform of the frame being drawn (see World_transforms), or computed at t before the first pass
+    vcl::vec3 world_position(double t);
+    vcl::affine_rts world_model(double t);
+
+    // Model transform of the mesh when the object is at world_pos
+    virtual vcl::affine_rts model(vcl::vec3 world_pos, double t) {
+        vcl::affine_rts m;
+        // another systematic rotation because textures usually needed it
+        m.rotate = vcl::rotation({ 0, 0, 1 }, -vcl::pi / 2) * rot_corr_axis;
+        m.rotate = vcl::rotation(rotation_axis, rotation_angle(t)) * m.rotate;
+        m.translate = world_pos;
+        m.scale = radius * p_size;
+        return m;
+    }
+
     // Caractéristiques de la texture
 
     GLuint texture;
@@ -104,13 +144,7 @@ struct Object_Drawable {
     void virtual setup_mesh(double t) {
         mesh.shader = shader;
         mesh.shading = shading;
-
-        // another systematic rotation because textures usually needed it
-        mesh.transform.rotate = vcl::rotation({ 0, 0, 1 }, -vcl::pi / 2) * rot_corr_axis;
-        mesh.transform.rotate = vcl::rotation(rotation_axis, rotation_angle(t)) * mesh.transform.rotate;
-        mesh.transform.translate = position(t);
-
-        mesh.transform.scale = radius*p_size;
+        mesh.transform = world_model(t);
         mesh.texture = texture;
     }
 
@@ -122,6 +156,13 @@ struct Object_Drawable {
 };
 
 
+// (child name, parent name) for every link of the tree below root, parents first. Feeds Simulator::set_hierarchy
+std::vector<std::pair<std::string, std::string>> drawable_hierarchy(const Object_Drawable* root);
+
+// Position of a drawable as a function of time, for Simulator::add_rail. The drawable must outlive the Simulator
+std::function<vcl::vec3(double)> rail_of(Object_Drawable* drawable);
+
+
 // Just like Object_Drawables but with a Orbit_Object to define a trajectory
 struct Planete_Drawable: public Object_Drawable {
     Orbit_Object* planete = nullptr;
@@ -148,14 +189,21 @@ struct Planete_Drawable: public Object_Drawable {
         if (parent == nullptr)
             return { 0,0,0 };
         else
-            return planete->position(t) + parent->position(t);
+            return orbit_position(t) + parent->position(t);
     }
 
     virtual vcl::vec3 position(double t, vcl::vec3 parent_pos) {
         if (parent == nullptr)
             return vcl::vec3();
         else
-            return planete->position(t) + parent_pos;
+            return orbit_position(t) + parent_pos;
+    }
+
+    // Relative to the parent
+    vcl::vec3 orbit_position(double t) {
+        if (ephemeris != nullptr && ephemeris->covers(t))
+            return ephemeris->position(ephemeris_body, t);
+        return planete->position(t);
     }
 
 };
@@ -215,14 +263,18 @@ struct Sun_Drawable : public Object_Drawable {
 
     virtual vcl::vec3 position(double t, vcl::vec3 parent_pos) { return { 0.0, 0.0, 0.0 }; }
 
+    virtual vcl::affine_rts model(vcl::vec3 world_pos, double t) {
+        vcl::affine_rts m;
+        m.rotate = vcl::rotation(rotation_axis, rotation_angle(t));
+        m.translate = world_pos;
+        m.scale = radius;
+        return m;
+    }
+
     void virtual draw_obj(double t, scene_environment scene) {
 
         mesh.shader = shader;
-
-        mesh.transform.rotate = vcl::rotation(rotation_axis, rotation_angle(t));
-        mesh.transform.translate = position(t);
-
-        mesh.transform.scale = radius;
+        mesh.transform = world_model(t);
 
         drawsun(mesh, scene, t);
     }
@@ -249,9 +301,15 @@ struct Asteroid_Drawable : public Object_Drawable {
         return pos + parent_pos;
     }
 
+    // Asteroids are not scaled with the planets
+    virtual vcl::affine_rts model(vcl::vec3 world_pos, double t) {
+        vcl::affine_rts m = Object_Drawable::model(world_pos, t);
+        m.scale = radius;
+        return m;
+    }
+
     void virtual draw_obj(double t, scene_environment scene) {
         setup_mesh(t);
-        mesh.transform.scale /= p_size;
         draw(mesh, scene, true);
 
            
@@ -260,6 +318,92 @@ struct Asteroid_Drawable : public Object_Drawable {
 };
 
 
+/* World positions and model transforms of every object of a tree, for one frame
+*
+* position(t) walks up to the root, so each call costs the depth of the tree and the same ancestors are recomputed for
+* every child, every asteroid, and every consumer (drawing, picking, camera, markers). Here the objects are stored parents
+* first: a single pass computes each world position from the one of its parent, already known, with position(t, parent_pos).
+* Consumers then read the arrays through world_position and world_model.
+*
+* build must be called again when objects are added to the tree. Objects added since are computed from the tree.
+*/
+struct World_transforms {
+    std::vector<Object_Drawable*> nodes; // Parents before their children
+    std::vector<int> parent_of; // Index in nodes, -1 for the root
+    std::vector<vcl::vec3> positions;
+    std::vector<vcl::affine_rts> models;
+
+    double time = 0; // Of the last update
+    bool updated = false;
+
+    void build(Object_Drawable* root) {
+        nodes = { root };
+        parent_of = { -1 };
+        for (size_t k = 0; k < nodes.size(); k++) {
+            nodes[k]->world = this;
+            nodes[k]->world_index = (int)k;
+            for (Object_Drawable* child : nodes[k]->enfants) {
+                nodes.push_back(child);
+                parent_of.push_back((int)k);
+            }
+        }
+        positions.resize(nodes.size());
+        models.resize(nodes.size());
+        updated = false;
+    }
+
+    void update(double t) {
+        for (size_t k = 0; k < nodes.size(); k++) {
+            vcl::vec3 parent_pos = parent_of[k] < 0 ? vcl::vec3() : positions[parent_of[k]];
+            positions[k] = nodes[k]->position(t, parent_pos);
+            models[k] = nodes[k]->model(positions[k], t);
+        }
+        time = t;
+        updated = true;
+    }
+
+    // The objects are left pointing to nothing, before they are deleted or the tree is rebuilt
+    void clear() {
+        for (Object_Drawable* node : nodes) {
+            node->world = nullptr;
+            node->world_index = -1;
+        }
+        nodes.clear();
+        parent_of.clear();
+        positions.clear();
+        models.clear();
+        updated = false;
+    }
+};
+
+// Fits the orbits of the planets below root (relative to their parents) over [begin, end], see Ephemeris.h
+Ephemeris record_ephemeris(Object_Drawable* root, double begin, double end, double segment_length, int degree);
+
+// The objects below root found by name in the ephemeris read their positions from it. It must outlive them, or be detached
+void attach_ephemeris(Object_Drawable* root, const Ephemeris* ephemeris);
+
+// The root and the planets below it, for Event_search. Positions and speeds are the exact circular orbits
+std::vector<Event_body> event_bodies(Object_Drawable* root);
+
+// A planet for Porkchop, relative to its parent
+Transfer_body transfer_body(Planete_Drawable* planet);
+
+// Gravitational parameter of the parent of a circular orbit, from its period: the mu of the transfers around that parent
+double parent_mu(const Orbit_Object& orbit);
+
+inline vcl::vec3 Object_Drawable::world_position(double t) {
+    if (world != nullptr && world->updated)
+        return world->positions[world_index];
+    return position(t);
+}
+
+inline vcl::affine_rts Object_Drawable::world_model(double t) {
+    if (world != nullptr && world->updated)
+        return world->models[world_index];
+    return model(position(t), t);
+}
+
+
 // Manages asteroids
 struct Belt {
 
@@ -294,60 +438,103 @@ struct Belt {
 
     std::vector<Asteroid_Drawable*> elements;
 
-    void update_coord(float dt) {
-        for (unsigned int i=0; i < elements.size(); i++) {
-            auto& ei = *elements[i];
-            for (unsigned int j = i + 1; j < elements.size(); j++) {
-
-                auto &ej = *elements[j];
-                vcl::vec3 diff = ei.pos - ej.pos;
-                if (vcl::norm(diff) < D) {
-                    ei.speed += diff * dt * ka / (ei.mass * pow(vcl::norm(diff), 2));
-                    ej.speed += -diff * dt * ka / (ej.mass * pow(vcl::norm(diff), 2));
-                }
-            }
-            // Calculate the projected position on the normal orbit
-            vcl::vec3 projax = ei.pos - axis * vcl::dot(ei.pos, axis);
-            float dst = vcl::norm(projax);
-            projax = projax / dst * radius_orbit; 
+    // Work arrays of update_coord
+    std::vector<vcl::vec3> positions, speeds, accelerations, drifts;
+    std::vector<float> masses;
 
-            ei.speed += -(ei.speed - speed_rotation * vcl::normalize(vcl::cross(axis, ei.pos))) * dt * lambda / ei.mass;   //utheta au projeté vaut normalize(cross(axis, position))
+    // update_coord_adaptive: next step, and the accelerations of the last one
+    float adaptive_dt = 0;
+    std::vector<vcl::vec3> previous_accelerations;
 
-            // A force brings asteroids back to their orbit
-            float ellip = 800.0f;
-            if (ellip * std::pow(vcl::dot(ei.pos - projax, axis), 2) +  (radius_orbit - dst)*(radius_orbit - dst) > depth*depth) ei.pos += ei.speed * dt - (ei.pos - projax) * dt * sigma1 / ei.mass;
-            else ei.pos += ei.speed * dt - (ei.pos - projax) * dt * sigma2 / ei.mass;
-
-        }
+    void update_coord(float dt) {
+        compute_accelerations();
+        advance(dt);
     }
-};
 
-void init_orbit_circ(Orbit_Object& obj, float parent_mass, vcl::vec3 initial_position, vcl::vec3 ax) {
-
-    if (parent_mass == 0) throw std::invalid_argument("Parent cannot be massless when initializing orbit.");
-    if (is_equal(initial_position, { 0.0f, 0.0f, 0.0f })) throw std::invalid_argument("Orbits of radius 0 are not permitted.");
-
-
-
-
-
-    if (is_equal(ax, { 0.0f, 0.0f, 0.0f })) {
-        if (initial_position.x == 0) {
-            ax = { 1.0f, 0.0f, 0.0f };
+    /* One step of at most max_dt, as long as the motion allows, and returns its length: eta * min |acceleration| / |jerk|
+    * over the asteroids, the jerk from the accelerations of the previous step (as in Simulator::simulate_adaptive).
+    * The first one is eta * min |speed| / |acceleration|. For long runs, see Time_warp.h
+    */
+    float update_coord_adaptive(float max_dt, float eta = 0.05f) {
+        compute_accelerations();
+        const int n = (int)elements.size();
+
+        float dt = adaptive_dt;
+        if (dt <= 0 || (int)previous_accelerations.size() != n) {
+            dt = max_dt;
+            for (int i = 0; i < n; i++) {
+                float a = vcl::norm(accelerations[i]);
+                if (a > 0)
+                    dt = std::min(dt, eta * vcl::norm(elements[i]->speed) / a);
+            }
         }
         else {
-            ax = { initial_position.y, -initial_position.x, 0 };
+            float next = 2 * dt;
+            for (int i = 0; i < n; i++) {
+                float jerk = vcl::norm(accelerations[i] - previous_accelerations[i]) / dt;
+                if (jerk > 0)
+                    next = std::min(next, eta * vcl::norm(accelerations[i]) / jerk);
+            }
+            dt = next;
+        }
+        // The pull back to the ring is explicit: a fraction of its time scale. And no asteroid moves by more than a fraction
+        // of the contact distance with respect to the ring between two evaluations of the repulsion
+        dt = std::min(dt, 0.2f / std::max(sigma1, sigma2));
+        for (int i = 0; i < n; i++) {
+            const vcl::vec3& p = elements[i]->pos;
+            float peculiar = vcl::norm(elements[i]->speed - speed_rotation * vcl::normalize(vcl::cross(axis, p)));
+            if (peculiar > 0)
+                dt = std::min(dt, 0.25f * D / peculiar);
         }
+        dt = std::min(dt, max_dt);
+        if (dt <= 0)
+            dt = max_dt;
+
+        advance(dt);
+        previous_accelerations = accelerations;
+        adaptive_dt = dt;
+        return dt;
     }
 
-    obj.axis = ax / vcl::norm(ax);
-    obj.radius_orbit = vcl::norm(initial_position);
-    obj.diameter_ini = initial_position / obj.radius_orbit;
+private:
+
+    void compute_accelerations() {
+        const int n = (int)elements.size();
+        positions.resize(n);
+        speeds.resize(n);
+        masses.resize(n);
+        accelerations.resize(n);
+        drifts.resize(n);
+        for (int i = 0; i < n; i++) {
+            positions[i] = elements[i]->pos;
+            speeds[i] = elements[i]->speed;
+            masses[i] = elements[i]->mass;
+        }
 
-    obj.period = sqrt(4 * pow(3.14, 2) * pow(obj.radius_orbit, 3) / (G * (parent_mass)));
+        Repulsive_law repulsion{ ka, D }; // To avoid collisions
 
-}
+        // Brings asteroids back to their orbit, and homogenizes their speeds
+        Spring_to_ring_law ring;
+        ring.axis = axis;
+        ring.radius = radius_orbit;
+        ring.depth = depth;
+        ring.sigma_far = sigma1;
+        ring.sigma_near = sigma2;
+        ring.damping = lambda;
+        ring.rotation_speed = speed_rotation;
+
+        law_pairs(repulsion, ring, positions.data(), speeds.data(), masses.data(), n, accelerations.data(), drifts.data());
+    }
 
+    void advance(float dt) {
+        const int n = (int)elements.size();
+        for (int i = 0; i < n; i++) {
+            auto& ei = *elements[i];
+            ei.speed += accelerations[i] * dt;
+            ei.pos += (ei.speed + drifts[i]) * dt;
+        }
+    }
+};
 
 
 #endif // ORBIT_OBJECT_H
@@ -6,6 +6,7 @@
 #include <map>
 #include <string>
 #include <fstream>
+#include <sstream>
 
 
 
@@ -57,12 +58,26 @@ public:
         return closest_angle_rec(ray, c_pos, parent, t, angle_select, dst);
     }
 
+    // Computes the world positions and model transforms of the whole tree at t, once per frame, before anything reads them
+    void update_world(double t) {
+        world->update(t);
+    }
+
+    // Must be called after objects are added to the tree (asteroids of a belt for instance)
+    void rebuild_world() {
+        world->build(parent);
+    }
+
     // Draws the objects, with their respective virtual draw functions
     void draw(double t, scene_environment scene) {
         draw_rec_(t, scene, parent);
     }
 
     void kill_initializer() {
+        if (world != nullptr)
+            world->clear(); // Detaches the objects from it
+        delete world;
+        world = nullptr;
         delete_rec(parent);
     }
 
@@ -285,18 +300,20 @@ private:
         neptune->planete->mass = 1;
         neptune->texture = textures["Neptune"];
 
+        world = new World_transforms();
+        world->build(parent);
 
     }
 
     // Complexite  amliorer
     Object_Drawable* closest_object_rec(vcl::vec3 pos, Object_Drawable* p, double t) {
-        float mindist = vcl::norm(pos - p->position(t));
+        float mindist = vcl::norm(pos - p->world_position(t));
         auto minp = p;
 
         for (auto child : p->enfants)
         {
             auto k = closest_object_rec(pos, child, t);
-            float tempmindist = std::min(mindist, vcl::norm(k->position(t) - pos));
+            float tempmindist = std::min(mindist, vcl::norm(k->world_position(t) - pos));
             if (tempmindist > mindist) {
                 mindist = tempmindist;
                 minp = k;
@@ -324,7 +341,7 @@ private:
 
 
     Object_Drawable* closest_angle_rec(vcl::vec3 ray, vcl::vec3 c_pos, Object_Drawable* p, double t, float angle_select, float& dist_return) {
-        vcl::vec3 rel_pos = p->position(t) - c_pos;
+        vcl::vec3 rel_pos = p->world_position(t) - c_pos;
         double dist = vcl::norm(rel_pos);
         float angle = std::acos(vcl::dot(rel_pos, ray) / dist);
         float angle_min = std::atan(p->radius_drawn() * 1.3/ dist);
@@ -375,6 +392,7 @@ private:
     }
 
     Object_Drawable* parent;
+    World_transforms* world = nullptr; // A pointer, since the instance is copied around
     std::map<std::string, GLuint> textures;
     std::map<std::string, GLuint> shaders;
     std::map<std::string, vcl::mesh_drawable*> meshes;